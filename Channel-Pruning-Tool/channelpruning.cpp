@@ -0,0 +1,705 @@
+#include "channelpruning.h"
+#include <caffe/util/io.hpp>
+#include <caffe/util/upgrade_proto.hpp>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace caffe;
+using namespace cv;
+
+static vector<int64_t> blobDims(const BlobProto &blob)
+{
+    vector<int64_t> dims;
+    if(blob.has_shape()) {
+        for(int i = 0; i < blob.shape().dim_size(); i++) {
+            dims.push_back(blob.shape().dim(i));
+        }
+    }
+    else {
+        dims.push_back(blob.num());
+        dims.push_back(blob.channels());
+        dims.push_back(blob.height());
+        dims.push_back(blob.width());
+    }
+    return dims;
+}
+
+//删除blob在axis维上被标记的通道
+static bool sliceBlob(BlobProto *blob, int axis, const vector<char> &removed)
+{
+    vector<int64_t> dims = blobDims(*blob);
+    if(axis >= (int)dims.size() || dims[axis] != (int64_t)removed.size()) {
+        //老格式的一维参数存在width里
+        axis = -1;
+        for(size_t i = 0; i < dims.size(); i++) {
+            if(dims[i] == (int64_t)removed.size()) {
+                axis = i;
+                break;
+            }
+        }
+        if(axis < 0) {
+            return false;
+        }
+    }
+
+    int64_t outer = 1, inner = 1;
+    for(int i = 0; i < axis; i++) {
+        outer *= dims[i];
+    }
+    for(size_t i = axis + 1; i < dims.size(); i++) {
+        inner *= dims[i];
+    }
+
+    vector<float> data;
+    for(int64_t o = 0; o < outer; o++) {
+        for(int64_t c = 0; c < dims[axis]; c++) {
+            if(removed[c]) {
+                continue;
+            }
+            const float *src = blob->data().data() + (o * dims[axis] + c) * inner;
+            data.insert(data.end(), src, src + inner);
+        }
+    }
+
+    dims[axis] -= std::count(removed.begin(), removed.end(), 1);
+    blob->clear_data();
+    for(size_t i = 0; i < data.size(); i++) {
+        blob->add_data(data[i]);
+    }
+    blob->clear_num();
+    blob->clear_channels();
+    blob->clear_height();
+    blob->clear_width();
+    blob->mutable_shape()->clear_dim();
+    for(size_t i = 0; i < dims.size(); i++) {
+        blob->mutable_shape()->add_dim(dims[i]);
+    }
+    return true;
+}
+
+static int64_t countParams(const NetParameter &net)
+{
+    int64_t count = 0;
+    for(int i = 0; i < net.layer_size(); i++) {
+        for(int j = 0; j < net.layer(i).blobs_size(); j++) {
+            count += net.layer(i).blobs(j).data_size();
+        }
+    }
+    return count;
+}
+
+static int segmentChannels(const vector<ChannelSegment> &segments)
+{
+    int channels = 0;
+    for(size_t i = 0; i < segments.size(); i++) {
+        channels += segments[i].channels;
+    }
+    return channels;
+}
+
+ChannelPruningTool::ChannelPruningTool()
+{
+    prefix = "mobilenet0_";
+    pruneRatio = 0.25f;
+    threshold = 0;
+    minKeepRatio = 0.25f;
+    maxImages = 20;
+}
+
+ChannelPruningTool::~ChannelPruningTool()
+{
+}
+
+void ChannelPruningTool::setModelPath(const string &deployFile, const string &modelFile)
+{
+    this->deployFile = deployFile;
+    this->modelFile = modelFile;
+}
+
+void ChannelPruningTool::setOutputPath(const string &deployFile, const string &modelFile)
+{
+    outDeployFile = deployFile;
+    outModelFile = modelFile;
+}
+
+void ChannelPruningTool::setPrunePrefix(const string &prefix)
+{
+    this->prefix = prefix;
+}
+
+void ChannelPruningTool::setPruneRatio(float ratio)
+{
+    pruneRatio = ratio;
+}
+
+void ChannelPruningTool::setThreshold(float threshold)
+{
+    this->threshold = threshold;
+}
+
+void ChannelPruningTool::setMinKeepRatio(float ratio)
+{
+    minKeepRatio = ratio;
+}
+
+void ChannelPruningTool::setInputDir(const string &inputDir, int maxImages)
+{
+    this->inputDir = inputDir;
+    this->maxImages = maxImages;
+}
+
+int ChannelPruningTool::newSpace(int channels)
+{
+    ChannelSpace space;
+    space.channels = channels;
+    space.prunable = true;
+    space.observedOffset = 0;
+    spaces.push_back(space);
+    parent.push_back(spaces.size() - 1);
+    return spaces.size() - 1;
+}
+
+int ChannelPruningTool::findSpace(int space)
+{
+    while(parent[space] != space) {
+        space = parent[space] = parent[parent[space]];
+    }
+    return space;
+}
+
+//Eltwise两边的通道一一对应，合并成一个空间
+void ChannelPruningTool::mergeSpaces(int a, int b)
+{
+    a = findSpace(a);
+    b = findSpace(b);
+    if(a == b) {
+        return;
+    }
+
+    ChannelSpace &sa = spaces[a];
+    ChannelSpace &sb = spaces[b];
+    sa.prunable = sa.prunable && sb.prunable && sa.channels == sb.channels;
+    sa.producers.insert(sa.producers.end(), sb.producers.begin(), sb.producers.end());
+    sa.passLayers.insert(sa.passLayers.end(), sb.passLayers.begin(), sb.passLayers.end());
+    sa.consumers.insert(sa.consumers.end(), sb.consumers.begin(), sb.consumers.end());
+    parent[b] = a;
+}
+
+void ChannelPruningTool::markUnprunable(const vector<ChannelSegment> &segments)
+{
+    for(size_t i = 0; i < segments.size(); i++) {
+        spaces[findSpace(segments[i].space)].prunable = false;
+    }
+}
+
+void ChannelPruningTool::buildSpaces()
+{
+    map<string, int> consumedBy;
+
+    for(int i = 0; i < deploy.layer_size(); i++) {
+        const LayerParameter &layer = deploy.layer(i);
+        const string &type = layer.type();
+
+        vector<ChannelSegment> in;
+        if(layer.bottom_size() > 0) {
+            in = blobSegments[layer.bottom(0)];
+        }
+        for(int b = 0; b < layer.bottom_size(); b++) {
+            consumedBy[layer.bottom(b)] = i;
+        }
+        int inChannels = segmentChannels(in);
+        vector<ChannelSegment> out;
+
+        if(type == "Input") {
+            int channels = layer.input_param().shape(0).dim(1);
+            int s = newSpace(channels);
+            spaces[s].prunable = false;
+            out.push_back(ChannelSegment{s, channels});
+        }
+        else if(type == "Convolution" || type == "Deconvolution") {
+            const ConvolutionParameter &conv = layer.convolution_param();
+            int group = conv.group();
+            int numOutput = conv.num_output();
+
+            if(group > 1 && group == inChannels && numOutput == inChannels) {
+                //depthwise卷积(包括双线性上采样)逐通道计算，沿用输入空间
+                int offset = 0;
+                for(size_t k = 0; k < in.size(); k++) {
+                    spaces[findSpace(in[k].space)].passLayers.push_back(make_pair(i, offset));
+                    offset += in[k].channels;
+                }
+                out = in;
+            }
+            else if(group == 1 && type == "Convolution") {
+                int offset = 0;
+                for(size_t k = 0; k < in.size(); k++) {
+                    spaces[findSpace(in[k].space)].consumers.push_back(make_pair(i, offset));
+                    offset += in[k].channels;
+                }
+                int s = newSpace(numOutput);
+                spaces[s].producers.push_back(i);
+                out.push_back(ChannelSegment{s, numOutput});
+            }
+            else {
+                markUnprunable(in);
+                int s = newSpace(numOutput);
+                spaces[s].prunable = false;
+                out.push_back(ChannelSegment{s, numOutput});
+            }
+        }
+        else if((type == "BatchNorm" || type == "Scale") && layer.bottom_size() == 1) {
+            int offset = 0;
+            for(size_t k = 0; k < in.size(); k++) {
+                spaces[findSpace(in[k].space)].passLayers.push_back(make_pair(i, offset));
+                offset += in[k].channels;
+            }
+            out = in;
+        }
+        else if(type == "ReLU" || (type == "Crop" && layer.crop_param().axis() >= 2)) {
+            //Crop只裁剪空间维度，第二个输入只提供大小
+            out = in;
+        }
+        else if(type == "Concat" && layer.concat_param().axis() == 1) {
+            for(int b = 0; b < layer.bottom_size(); b++) {
+                const vector<ChannelSegment> &segments = blobSegments[layer.bottom(b)];
+                out.insert(out.end(), segments.begin(), segments.end());
+            }
+        }
+        else if(type == "Eltwise") {
+            out = in;
+            for(int b = 1; b < layer.bottom_size(); b++) {
+                const vector<ChannelSegment> &other = blobSegments[layer.bottom(b)];
+                if(other.size() != in.size()) {
+                    markUnprunable(in);
+                    markUnprunable(other);
+                    continue;
+                }
+                for(size_t k = 0; k < in.size(); k++) {
+                    if(in[k].channels != other[k].channels) {
+                        markUnprunable(in);
+                        markUnprunable(other);
+                        break;
+                    }
+                    mergeSpaces(in[k].space, other[k].space);
+                }
+            }
+        }
+        else {
+            //Reshape、Softmax等无法跟踪通道的层
+            for(int b = 0; b < layer.bottom_size(); b++) {
+                markUnprunable(blobSegments[layer.bottom(b)]);
+            }
+            int s = newSpace(0);
+            spaces[s].prunable = false;
+            out.push_back(ChannelSegment{s, 0});
+        }
+
+        for(int t = 0; t < layer.top_size(); t++) {
+            blobSegments[layer.top(t)] = out;
+        }
+
+        //激活统计取每个空间最后经过的blob，一般是relu之后
+        if(layer.top_size() > 0 && type != "Input") {
+            int offset = 0;
+            for(size_t k = 0; k < out.size(); k++) {
+                ChannelSpace &space = spaces[findSpace(out[k].space)];
+                space.observedBlob = layer.top(0);
+                space.observedOffset = offset;
+                offset += out[k].channels;
+            }
+        }
+    }
+
+    //网络输出的通道不能改
+    for(map<string, vector<ChannelSegment> >::iterator it = blobSegments.begin(); it != blobSegments.end(); ++it) {
+        bool isOutput = true;
+        for(int i = 0; i < deploy.layer_size() && isOutput; i++) {
+            const LayerParameter &layer = deploy.layer(i);
+            for(int b = 0; b < layer.bottom_size(); b++) {
+                //in-place层的输入不算消费
+                if(layer.bottom(b) == it->first && (layer.top_size() == 0 || layer.top(0) != it->first)) {
+                    isOutput = false;
+                    break;
+                }
+            }
+        }
+        if(isOutput) {
+            markUnprunable(it->second);
+        }
+    }
+
+    //只裁剪指定前缀的卷积
+    for(size_t s = 0; s < spaces.size(); s++) {
+        if(findSpace(s) != (int)s) {
+            continue;
+        }
+        ChannelSpace &space = spaces[s];
+        if(space.producers.empty()) {
+            space.prunable = false;
+        }
+        for(size_t k = 0; k < space.producers.size(); k++) {
+            if(deploy.layer(space.producers[k]).name().compare(0, prefix.size(), prefix) != 0) {
+                space.prunable = false;
+            }
+        }
+    }
+}
+
+//network slimming：Scale层的|gamma|
+void ChannelPruningTool::gammaImportance()
+{
+    for(size_t s = 0; s < spaces.size(); s++) {
+        ChannelSpace &space = spaces[s];
+        if(findSpace(s) != (int)s || !space.prunable) {
+            continue;
+        }
+
+        space.importance.assign(space.channels, 0);
+        bool found = false;
+        for(size_t k = 0; k < space.passLayers.size(); k++) {
+            const LayerParameter &layer = deploy.layer(space.passLayers[k].first);
+            if(layer.type() != "Scale" || weightIndex.count(layer.name()) == 0) {
+                continue;
+            }
+            const LayerParameter &w = weights.layer(weightIndex[layer.name()]);
+            if(w.blobs_size() == 0) {
+                continue;
+            }
+            const BlobProto &gamma = w.blobs(0);
+            for(int c = 0; c < space.channels; c++) {
+                space.importance[c] += fabs(gamma.data(space.passLayers[k].second + c));
+            }
+            found = true;
+        }
+
+        if(!found) {
+            space.prunable = false;
+        }
+    }
+}
+
+//样本上每个通道的平均|激活|，同时考虑了beta造成的常数输出
+void ChannelPruningTool::activationImportance()
+{
+    Caffe::set_mode(Caffe::CPU);
+    Net<float> net(deployFile, TEST);
+    net.CopyTrainedLayersFrom(modelFile);
+
+    for(size_t s = 0; s < spaces.size(); s++) {
+        if(findSpace(s) == (int)s && spaces[s].prunable) {
+            spaces[s].importance.assign(spaces[s].channels, 0);
+        }
+    }
+
+    for(size_t i = 0; i < images.size(); i++) {
+        setInput(net, images[i]);
+        net.Forward();
+
+        for(size_t s = 0; s < spaces.size(); s++) {
+            ChannelSpace &space = spaces[s];
+            if(findSpace(s) != (int)s || !space.prunable) {
+                continue;
+            }
+            const boost::shared_ptr<Blob<float> > blob = net.blob_by_name(space.observedBlob);
+            int spatial = blob->height() * blob->width();
+            for(int c = 0; c < space.channels; c++) {
+                const float *data = blob->cpu_data() + (space.observedOffset + c) * spatial;
+                double sum = 0;
+                for(int k = 0; k < spatial; k++) {
+                    sum += fabs(data[k]);
+                }
+                space.importance[c] += sum / spatial / images.size();
+            }
+        }
+    }
+}
+
+void ChannelPruningTool::selectChannels()
+{
+    struct Candidate
+    {
+        float score;
+        int space;
+        int channel;
+    };
+    vector<Candidate> candidates;
+    vector<int> kept(spaces.size(), 0);
+    vector<int> minKeep(spaces.size(), 0);
+
+    for(size_t s = 0; s < spaces.size(); s++) {
+        ChannelSpace &space = spaces[s];
+        if(findSpace(s) != (int)s || !space.prunable) {
+            continue;
+        }
+        space.removed.assign(space.channels, 0);
+        kept[s] = space.channels;
+        minKeep[s] = max(1, (int)ceil(space.channels * minKeepRatio));
+
+        //按空间内均值归一化，不同层之间可以比较
+        double mean = 0;
+        for(int c = 0; c < space.channels; c++) {
+            mean += space.importance[c];
+        }
+        mean /= space.channels;
+        for(int c = 0; c < space.channels; c++) {
+            float score = mean > 0 ? space.importance[c] / mean : 0;
+            candidates.push_back(Candidate{score, (int)s, c});
+        }
+    }
+
+    sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.score < b.score;
+    });
+
+    int toRemove = threshold > 0 ? candidates.size() : (int)(candidates.size() * pruneRatio);
+    for(size_t i = 0; i < candidates.size() && toRemove > 0; i++) {
+        const Candidate &cand = candidates[i];
+        if(threshold > 0 && cand.score >= threshold) {
+            break;
+        }
+        if(kept[cand.space] <= minKeep[cand.space]) {
+            continue;
+        }
+        spaces[cand.space].removed[cand.channel] = 1;
+        kept[cand.space]--;
+        toRemove--;
+    }
+
+    //保留通道数对齐到4，方便SIMD
+    for(int i = candidates.size() - 1; i >= 0; i--) {
+        const Candidate &cand = candidates[i];
+        ChannelSpace &space = spaces[cand.space];
+        if(space.channels % 4 == 0 && kept[cand.space] % 4 != 0 && space.removed[cand.channel]) {
+            space.removed[cand.channel] = 0;
+            kept[cand.space]++;
+        }
+    }
+}
+
+void ChannelPruningTool::applyPruning()
+{
+    //每层输出(或逐通道参数)和输入要删除的通道
+    map<int, vector<char> > outRemoved;
+    map<int, vector<char> > inRemoved;
+    map<int, int> layerChannels;
+
+    for(size_t s = 0; s < spaces.size(); s++) {
+        const ChannelSpace &space = spaces[s];
+        if(findSpace(s) != (int)s || !space.prunable) {
+            continue;
+        }
+
+        for(size_t k = 0; k < space.producers.size(); k++) {
+            outRemoved[space.producers[k]] = space.removed;
+        }
+
+        vector<pair<int, int> > users[2] = {space.passLayers, space.consumers};
+        map<int, vector<char> > *targets[2] = {&outRemoved, &inRemoved};
+        for(int u = 0; u < 2; u++) {
+            for(size_t k = 0; k < users[u].size(); k++) {
+                int layer = users[u][k].first;
+                int offset = users[u][k].second;
+                vector<char> &removed = (*targets[u])[layer];
+                if(removed.empty()) {
+                    removed.assign(segmentChannels(blobSegments[deploy.layer(layer).bottom(0)]), 0);
+                }
+                for(int c = 0; c < space.channels; c++) {
+                    removed[offset + c] = space.removed[c];
+                }
+            }
+        }
+    }
+
+    for(int i = 0; i < deploy.layer_size(); i++) {
+        LayerParameter *layer = deploy.mutable_layer(i);
+        LayerParameter *w = weightIndex.count(layer->name()) ? weights.mutable_layer(weightIndex[layer->name()]) : NULL;
+
+        if(outRemoved.count(i)) {
+            const vector<char> &removed = outRemoved[i];
+            int count = std::count(removed.begin(), removed.end(), 1);
+
+            if(layer->type() == "Convolution" || layer->type() == "Deconvolution") {
+                ConvolutionParameter *conv = layer->mutable_convolution_param();
+                if(conv->group() > 1) {
+                    conv->set_group(conv->group() - count);
+                }
+                conv->set_num_output(conv->num_output() - count);
+            }
+
+            //卷积、BN、Scale的前两个参数都是逐输出通道的，BN第三个参数是全局系数
+            for(int b = 0; w != NULL && b < w->blobs_size() && b < 2; b++) {
+                if(!sliceBlob(w->mutable_blobs(b), 0, removed)) {
+                    printf("can not slice blob %d of %s.\n", b, layer->name().c_str());
+                }
+            }
+        }
+
+        if(inRemoved.count(i) && w != NULL && w->blobs_size() > 0) {
+            if(!sliceBlob(w->mutable_blobs(0), 1, inRemoved[i])) {
+                printf("can not slice input of %s.\n", layer->name().c_str());
+            }
+        }
+    }
+}
+
+void ChannelPruningTool::loadImages()
+{
+    DIR *dir = opendir(inputDir.c_str());
+    if(dir == NULL) {
+        return;
+    }
+
+    vector<string> files;
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+        if(strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+            files.push_back(inputDir + "/" + ent->d_name);
+        }
+    }
+    closedir(dir);
+    sort(files.begin(), files.end());
+
+    for(size_t i = 0; i < files.size() && (int)images.size() < maxImages; i++) {
+        Mat img = imread(files[i]);
+        if(!img.empty()) {
+            images.push_back(img);
+        }
+    }
+}
+
+//与RetinaFace::preProcess一致
+void ChannelPruningTool::setInput(Net<float> &net, const Mat &img)
+{
+    Blob<float> *input = net.input_blobs()[0];
+    int inputW = input->width();
+    int inputH = input->height();
+
+    float scale = max((float)img.cols / inputW, (float)img.rows / inputH);
+    Mat resize = img;
+    if(scale > 1) {
+        cv::resize(img, resize, Size(), 1 / scale, 1 / scale);
+    }
+    copyMakeBorder(resize, resize, 0, inputH - resize.rows, 0, inputW - resize.cols, BORDER_CONSTANT, Scalar(0));
+    resize.convertTo(resize, CV_32FC3);
+    cvtColor(resize, resize, CV_BGR2RGB);
+
+    vector<Mat> channels;
+    float *data = input->mutable_cpu_data();
+    for(int c = 0; c < input->channels(); c++) {
+        channels.push_back(Mat(inputH, inputW, CV_32FC1, data));
+        data += inputW * inputH;
+    }
+    split(resize, channels);
+}
+
+double ChannelPruningTool::runNet(const string &deployFile, const string &modelFile,
+                                  vector<vector<vector<float> > > &outputs)
+{
+    Caffe::set_mode(Caffe::CPU);
+    Net<float> net(deployFile, TEST);
+    net.CopyTrainedLayersFrom(modelFile);
+
+    //预热
+    setInput(net, images[0]);
+    net.Forward();
+
+    double total = 0;
+    outputs.clear();
+    for(size_t i = 0; i < images.size(); i++) {
+        setInput(net, images[i]);
+        double t = (double)getTickCount();
+        net.Forward();
+        total += ((double)getTickCount() - t) * 1000.0 / getTickFrequency();
+
+        vector<vector<float> > outs;
+        for(size_t k = 0; k < net.output_blobs().size(); k++) {
+            const Blob<float> *blob = net.output_blobs()[k];
+            outs.push_back(vector<float>(blob->cpu_data(), blob->cpu_data() + blob->count()));
+        }
+        outputs.push_back(outs);
+    }
+
+    return total / images.size();
+}
+
+void ChannelPruningTool::printReport()
+{
+    printf("\n%-40s %8s %8s\n", "space(producer)", "before", "after");
+    int before = 0, after = 0;
+    for(size_t s = 0; s < spaces.size(); s++) {
+        const ChannelSpace &space = spaces[s];
+        if(findSpace(s) != (int)s || !space.prunable) {
+            continue;
+        }
+        int kept = space.channels - std::count(space.removed.begin(), space.removed.end(), 1);
+        printf("%-40.40s %8d %8d\n", deploy.layer(space.producers[0]).name().c_str(), space.channels, kept);
+        before += space.channels;
+        after += kept;
+    }
+    printf("prunable channels: %d -> %d (%.1f%% removed)\n", before, after, before > 0 ? 100.0 * (before - after) / before : 0);
+
+    NetParameter original;
+    ReadNetParamsFromBinaryFileOrDie(modelFile, &original);
+    int64_t paramsBefore = countParams(original);
+    int64_t paramsAfter = countParams(weights);
+    printf("params: %lld -> %lld (%.1f%%)\n", (long long)paramsBefore, (long long)paramsAfter,
+           100.0 * paramsAfter / paramsBefore);
+
+    if(images.empty()) {
+        printf("no sample image, skip latency and deviation test.\n");
+        return;
+    }
+
+    vector<vector<vector<float> > > ref, pruned;
+    double t0 = runNet(deployFile, modelFile, ref);
+    double t1 = runNet(outDeployFile, outModelFile, pruned);
+    printf("cpu forward: %.2fms -> %.2fms (%.2fx)\n", t0, t1, t1 > 0 ? t0 / t1 : 0);
+
+    //每个输出的相对L1偏差
+    Net<float> net(outDeployFile, TEST);
+    for(size_t k = 0; k < net.output_blob_indices().size(); k++) {
+        double diff = 0, norm = 0;
+        for(size_t i = 0; i < ref.size(); i++) {
+            for(size_t j = 0; j < ref[i][k].size(); j++) {
+                diff += fabs(ref[i][k][j] - pruned[i][k][j]);
+                norm += fabs(ref[i][k][j]);
+            }
+        }
+        printf("%-40.40s deviation %.5f\n", net.blob_names()[net.output_blob_indices()[k]].c_str(),
+               diff / (norm + 1e-6));
+    }
+}
+
+bool ChannelPruningTool::doPruning()
+{
+    ReadNetParamsFromTextFileOrDie(deployFile, &deploy);
+    ReadNetParamsFromBinaryFileOrDie(modelFile, &weights);
+    for(int i = 0; i < weights.layer_size(); i++) {
+        weightIndex[weights.layer(i).name()] = i;
+    }
+
+    buildSpaces();
+
+    loadImages();
+    if(images.empty()) {
+        gammaImportance();
+    }
+    else {
+        printf("use activation statistics of %d images.\n", (int)images.size());
+        gammaImportance();
+        activationImportance();
+    }
+
+    selectChannels();
+    applyPruning();
+
+    WriteProtoToTextFile(deploy, outDeployFile);
+    WriteProtoToBinaryFile(weights, outModelFile);
+    printf("write %s and %s\n", outDeployFile.c_str(), outModelFile.c_str());
+
+    printReport();
+    return true;
+}
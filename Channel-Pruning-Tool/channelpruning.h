@@ -0,0 +1,104 @@
+#ifndef CHANNELPRUNING_H
+#define CHANNELPRUNING_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <caffe/caffe.hpp>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+//一段连续通道，Concat的输出由多段组成
+struct ChannelSegment
+{
+    int space;
+    int channels;
+};
+
+//卷积输出的通道空间，同一空间里的通道必须一起裁剪
+//BatchNorm/Scale/ReLU/depthwise卷积/Crop沿用输入的空间，Eltwise把输入空间合并成一个
+struct ChannelSpace
+{
+    int channels;
+    bool prunable;
+    vector<int> producers;                  //输出这些通道的普通卷积
+    vector<pair<int, int> > passLayers;     //带逐通道参数的层(BN/Scale/depthwise)，以及在该层中的通道偏移
+    vector<pair<int, int> > consumers;      //把这些通道当输入的普通卷积，以及在输入中的通道偏移
+    string observedBlob;                    //统计激活时使用的blob
+    int observedOffset;
+    vector<float> importance;
+    vector<char> removed;
+};
+
+class ChannelPruningTool
+{
+public:
+    ChannelPruningTool();
+    ~ChannelPruningTool();
+
+    //原始模型
+    void setModelPath(const string &deployFile, const string &modelFile);
+    //裁剪后的模型
+    void setOutputPath(const string &deployFile, const string &modelFile);
+    //只裁剪名字以prefix开头的卷积输出，默认只裁剪backbone
+    void setPrunePrefix(const string &prefix);
+    //裁掉的通道比例
+    void setPruneRatio(float ratio);
+    //大于0时按阈值裁剪，归一化后的重要性小于threshold的通道都裁掉，忽略pruneRatio
+    void setThreshold(float threshold);
+    //每个空间至少保留的比例
+    void setMinKeepRatio(float ratio);
+    //样本目录，设置后用激活统计作为重要性，同时用于速度和偏差测试
+    void setInputDir(const string &inputDir, int maxImages = 20);
+
+   /**
+    *	@brief  doPruning	            分析通道依赖，按重要性裁剪并写出新模型
+    *   @return                         成功返回true
+    *
+    *   @note                           最后打印裁剪前后的参数量、耗时和输出偏差
+    */
+    bool doPruning();
+
+private:
+    void buildSpaces();
+    int newSpace(int channels);
+    int findSpace(int space);
+    void mergeSpaces(int a, int b);
+    void markUnprunable(const vector<ChannelSegment> &segments);
+
+    void gammaImportance();
+    void activationImportance();
+    void selectChannels();
+    void applyPruning();
+
+    void loadImages();
+    void setInput(caffe::Net<float> &net, const cv::Mat &img);
+    //返回每张图的平均前向耗时(ms)，outputs保存每张图每个输出
+    double runNet(const string &deployFile, const string &modelFile, vector<vector<vector<float> > > &outputs);
+    void printReport();
+
+private:
+    string deployFile;
+    string modelFile;
+    string outDeployFile;
+    string outModelFile;
+    string prefix;
+    float pruneRatio;
+    float threshold;
+    float minKeepRatio;
+    string inputDir;
+    int maxImages;
+
+    caffe::NetParameter deploy;
+    caffe::NetParameter weights;
+    map<string, int> weightIndex;
+
+    vector<ChannelSpace> spaces;
+    vector<int> parent;
+    map<string, vector<ChannelSegment> > blobSegments;
+
+    vector<cv::Mat> images;
+};
+
+#endif // CHANNELPRUNING_H
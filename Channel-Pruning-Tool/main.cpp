@@ -0,0 +1,52 @@
+#include "channelpruning.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    ::google::InitGoogleLogging(argv[0]);
+
+    ChannelPruningTool *tool = new ChannelPruningTool();
+    tool->setModelPath("../model/mnet-deconv-0517.prototxt", "../model/mnet-deconv-0517.caffemodel");
+    tool->setOutputPath("../model/mnet-deconv-0517-pruned.prototxt", "../model/mnet-deconv-0517-pruned.caffemodel");
+
+    //--ratio 0.3 --images ../INT8-Calibration-Tool/dataSet --prefix mobilenet0_
+    string inputDir;
+    int maxImages = 20;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--ratio") == 0) {
+            tool->setPruneRatio(atof(argv[i + 1]));
+        }
+        else if(strcmp(argv[i], "--threshold") == 0) {
+            tool->setThreshold(atof(argv[i + 1]));
+        }
+        else if(strcmp(argv[i], "--min-keep") == 0) {
+            tool->setMinKeepRatio(atof(argv[i + 1]));
+        }
+        else if(strcmp(argv[i], "--prefix") == 0) {
+            tool->setPrunePrefix(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "--images") == 0) {
+            inputDir = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "--max-images") == 0) {
+            maxImages = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "--output") == 0) {
+            string output = argv[i + 1];
+            tool->setOutputPath(output + ".prototxt", output + ".caffemodel");
+        }
+    }
+    if(!inputDir.empty()) {
+        tool->setInputDir(inputDir, maxImages);
+    }
+
+    bool ret = tool->doPruning();
+
+    delete tool;
+
+    return ret ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#include "CpuCalibrationTableImpl.h"
+
+CpuCalibrationTableRetinaFace::CpuCalibrationTableRetinaFace()
+{
+    //与CPU推理的网络输入一致
+    input_c = 3;
+    input_h = 640;
+    input_w = 640;
+
+    num_per_batch = 1;
+}
+
+CpuCalibrationTableRetinaFace::~CpuCalibrationTableRetinaFace()
+{
+
+}
+
+cv::Mat CpuCalibrationTableRetinaFace::preprocess(cv::Mat img)
+{
+    cv::Mat image_rgb, sample_resized, sample_float;
+    cv::cvtColor(img, image_rgb, CV_BGR2RGB);
+    cv::resize(image_rgb, sample_resized, cv::Size(input_w, input_h));
+    sample_resized.convertTo(sample_float, CV_32FC3);
+    return sample_float;
+}
@@ -0,0 +1,16 @@
+#ifndef CPUCALIBRATIONTABLEIMPL_H
+#define CPUCALIBRATIONTABLEIMPL_H
+
+#include "cpucalibration.h"
+#include <opencv2/opencv.hpp>
+
+class CpuCalibrationTableRetinaFace : public CpuCalibrationTableBase
+{
+public:
+    CpuCalibrationTableRetinaFace();
+    virtual ~CpuCalibrationTableRetinaFace();
+private:
+    virtual cv::Mat preprocess(cv::Mat img) override;
+};
+
+#endif // CPUCALIBRATIONTABLEIMPL_H
@@ -0,0 +1,452 @@
+#include "cpucalibration.h"
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+//量化后的级数，与TensorRT一致
+static const int kQUANTIZED_BINS = 128;
+
+CpuCalibrationNet::CpuCalibrationNet(int chans, int height, int width, int batchSize)
+    : CpuNetBase("calibration")
+{
+    maxBatchSize = batchSize;
+    channel = chans;
+    netHeight = height;
+    netWidth = width;
+}
+
+CpuCalibrationNet::~CpuCalibrationNet()
+{
+}
+
+void CpuCalibrationNet::doInference(int batchSize, float *input)
+{
+    if(input != NULL && input != inputBuffer) {
+        memcpy(inputBuffer, input, batchSize * channel * netHeight * netWidth * sizeof(float));
+    }
+
+    if(batchSize != this->batchSize) {
+        reshape(batchSize);
+    }
+
+    forward();
+}
+
+void CpuCalibrationNet::allocateMemory()
+{
+}
+
+void CpuCalibrationNet::releaseMemory()
+{
+}
+
+//=========================================================================//
+//=========================================================================//
+
+//max(|x|)
+static float absMax(const float *data, size_t count)
+{
+    size_t i = 0;
+    float amax = 0;
+#ifdef __AVX2__
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 vmax = _mm256_setzero_ps();
+    for(; i + 8 <= count; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_andnot_ps(signMask, _mm256_loadu_ps(data + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    for(int k = 0; k < 8; k++) {
+        amax = max(amax, lanes[k]);
+    }
+#endif
+    for(; i < count; i++) {
+        amax = max(amax, fabsf(data[i]));
+    }
+    return amax;
+}
+
+//|x|落在[0, amax]上的num_bins个桶里，超出的放进最后一个桶
+static void accumulateHistogram(const float *data, size_t count, float amax, vector<double> &hist)
+{
+    int nbins = hist.size();
+    float invWidth = nbins / amax;
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 vinv = _mm256_set1_ps(invWidth);
+    const __m256i vlast = _mm256_set1_epi32(nbins - 1);
+    int32_t index[8];
+    for(; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_andnot_ps(signMask, _mm256_loadu_ps(data + i)), vinv);
+        __m256i idx = _mm256_min_epi32(_mm256_cvttps_epi32(v), vlast);
+        _mm256_storeu_si256((__m256i *)index, idx);
+        for(int k = 0; k < 8; k++) {
+            hist[index[k]] += 1;
+        }
+    }
+#endif
+    for(; i < count; i++) {
+        int idx = min((int)(fabsf(data[i]) * invWidth), nbins - 1);
+        hist[idx] += 1;
+    }
+}
+
+//分布中为0的位置加eps，其余位置等量减去，保证KL散度有定义
+static bool smoothDistribution(vector<double> &p, double eps = 0.0001)
+{
+    int zeros = 0;
+    for(size_t i = 0; i < p.size(); i++) {
+        if(p[i] == 0) {
+            zeros++;
+        }
+    }
+    int nonzeros = p.size() - zeros;
+    if(nonzeros == 0) {
+        return false;
+    }
+
+    double eps1 = eps * zeros / nonzeros;
+    for(size_t i = 0; i < p.size(); i++) {
+        p[i] += p[i] == 0 ? eps : -eps1;
+    }
+    return true;
+}
+
+CpuCalibrationTableBase::CpuCalibrationTableBase()
+{
+    input_c = 0;
+    input_h = 0;
+    input_w = 0;
+
+    num_batchs = 0;
+    num_per_batch = 1;
+    num_bins = 2048;
+
+    input_dir = "";
+    symbolFile = "";
+    paramsFile = "";
+    tablePath = "";
+
+    method = kENTROPY;
+    percentile = 99.99f;
+
+    net = NULL;
+}
+
+CpuCalibrationTableBase::~CpuCalibrationTableBase()
+{
+    if(net != NULL) {
+        net->destroyCpuContext();
+        delete net;
+    }
+}
+
+void CpuCalibrationTableBase::setInputDir(string inDir)
+{
+    input_dir = inDir;
+}
+
+void CpuCalibrationTableBase::setNumPerBatch(int numBatch)
+{
+    num_per_batch = numBatch;
+}
+
+void CpuCalibrationTableBase::setModelPath(string symbolFile, string paramsFile)
+{
+    this->symbolFile = symbolFile;
+    this->paramsFile = paramsFile;
+}
+
+void CpuCalibrationTableBase::setNetworkParams(int chans, int height, int width)
+{
+    input_c = chans;
+    input_h = height;
+    input_w = width;
+}
+
+void CpuCalibrationTableBase::setCalibrationMethod(CALIBRATION_METHOD method)
+{
+    this->method = method;
+}
+
+void CpuCalibrationTableBase::setPercentile(float percentile)
+{
+    this->percentile = percentile;
+}
+
+void CpuCalibrationTableBase::setTablePath(string tablePath)
+{
+    this->tablePath = tablePath;
+}
+
+bool CpuCalibrationTableBase::doCalibration()
+{
+    if(tablePath.empty()) {
+        string path = symbolFile;
+        size_t iPos = path.find("-symbol.json");
+        tablePath = path.substr(0, iPos) + std::string(".table.int8");
+    }
+
+    std::ifstream check(tablePath);
+    if(check.good()) {
+        printf("%s is already exits.\n", tablePath.c_str());
+        printf("If you want to recreate, please remove the old file.\n");
+        return false;
+    }
+
+    // get file list
+    struct dirent **namelist;
+    int n = scandir(input_dir.c_str(), &namelist, NULL, alphasort);
+    if(n < 0) {
+        printf("the dir is valid\n");
+        return false;
+    }
+    while(n--) {
+        if(strcmp(namelist[n]->d_name, ".") && strcmp(namelist[n]->d_name, "..")) {
+            filelist.push_back(namelist[n]->d_name);
+        }
+        free(namelist[n]);
+    }
+    free(namelist);
+
+    //打乱顺序
+    random_shuffle(filelist.begin(), filelist.end());
+    num_batchs = filelist.size() / num_per_batch;
+    printf("Total number of images = %d\n", (int)filelist.size());
+    printf("NUM_PER_BATCH = %d\n", num_per_batch);
+    printf("NUM_BATCHES = %d\n", num_batchs);
+    if(num_batchs == 0) {
+        return false;
+    }
+
+    //不合并BatchNorm和relu，每个中间张量都出现在校准表中
+    net = new CpuCalibrationNet(input_c, input_h, input_w, num_per_batch);
+    net->setFoldLayers(false);
+    net->buildCpuContext(symbolFile, paramsFile);
+
+    const vector<CpuTensor *> &tensors = net->getTensors();
+    histograms.resize(tensors.size());
+    for(size_t i = 0; i < tensors.size(); i++) {
+        histograms[i].name = tensors[i]->name;
+        histograms[i].amax = 0;
+        histograms[i].hist.assign(num_bins, 0);
+    }
+
+    printf("Collecting activation range...\n");
+    runBatches(false);
+    printf("Collecting activation histogram...\n");
+    runBatches(true);
+
+    return writeCalibrationTable();
+}
+
+void CpuCalibrationTableBase::runBatches(bool histogram)
+{
+    const vector<CpuTensor *> &tensors = net->getTensors();
+
+    int num = 0;
+    for(int i = 0; i < num_batchs; i++) {
+        std::vector<Mat> batchImages;
+        for(int j = 0; j < num_per_batch; j++) {
+            string path = input_dir + "/" + filelist[num++];
+            Mat image = imread(path);
+            if(image.data == NULL) {
+                printf("open image %s faile.\n", path.c_str());
+                continue;
+            }
+            batchImages.push_back(preprocess(image));
+        }
+        if(batchImages.empty()) {
+            continue;
+        }
+
+        prepareData(batchImages, net->getInputBuf());
+        net->doInference(batchImages.size());
+
+        for(size_t t = 0; t < tensors.size(); t++) {
+            ActivationHistogram &h = histograms[t];
+            if(!histogram) {
+                h.amax = max(h.amax, absMax(tensors[t]->data, tensors[t]->count()));
+            }
+            else if(h.amax > 0) {
+                accumulateHistogram(tensors[t]->data, tensors[t]->count(), h.amax, h.hist);
+            }
+        }
+    }
+}
+
+void CpuCalibrationTableBase::prepareData(const std::vector<Mat> batchImages, float *data)
+{
+    float *inputPtr = data;
+    for(size_t i = 0; i < batchImages.size(); i++) {
+        vector<Mat> inputMats;
+        for(int j = 0; j < input_c; j++) {
+            Mat channel(input_h, input_w, CV_32FC1, inputPtr);
+            inputMats.push_back(channel);
+            inputPtr += input_w * input_h;
+        }
+        split(batchImages[i], inputMats);
+    }
+}
+
+//与TensorRT EntropyCalibration2相同：在128到num_bins之间找使KL(P||Q)最小的截断位置
+float CpuCalibrationTableBase::entropyThreshold(const ActivationHistogram &h)
+{
+    const vector<double> &hist = h.hist;
+    float binWidth = h.amax / num_bins;
+
+    double minDivergence = 1e30;
+    int bestIndex = num_bins;
+    vector<double> p, q;
+    vector<double> outliers(num_bins + 1, 0);
+    for(int k = num_bins - 1; k >= 0; k--) {
+        outliers[k] = outliers[k + 1] + hist[k];
+    }
+    for(int i = kQUANTIZED_BINS; i <= num_bins; i++) {
+        //参考分布，截断外的数量加到最后一个桶
+        p.assign(hist.begin(), hist.begin() + i);
+        p[i - 1] += outliers[i];
+
+        //合并成128级再展开，0的位置保持为0
+        q.assign(i, 0);
+        double merged = (double)i / kQUANTIZED_BINS;
+        for(int j = 0; j < kQUANTIZED_BINS; j++) {
+            int start = (int)(j * merged);
+            int stop = j == kQUANTIZED_BINS - 1 ? i : (int)((j + 1) * merged);
+            double total = 0;
+            int nonzeros = 0;
+            for(int k = start; k < stop; k++) {
+                total += hist[k];
+                nonzeros += hist[k] != 0;
+            }
+            if(nonzeros == 0) {
+                continue;
+            }
+            for(int k = start; k < stop; k++) {
+                q[k] = hist[k] != 0 ? total / nonzeros : 0;
+            }
+        }
+
+        double sumP = 0, sumQ = 0;
+        for(int k = 0; k < i; k++) {
+            sumP += p[k];
+            sumQ += q[k];
+        }
+        if(sumP == 0 || sumQ == 0) {
+            continue;
+        }
+        for(int k = 0; k < i; k++) {
+            p[k] /= sumP;
+            q[k] /= sumQ;
+        }
+        if(!smoothDistribution(p) || !smoothDistribution(q)) {
+            continue;
+        }
+
+        double divergence = 0;
+        for(int k = 0; k < i; k++) {
+            divergence += p[k] * log(p[k] / q[k]);
+        }
+        if(divergence < minDivergence) {
+            minDivergence = divergence;
+            bestIndex = i;
+        }
+    }
+
+    return (bestIndex + 0.5f) * binWidth;
+}
+
+float CpuCalibrationTableBase::percentileThreshold(const ActivationHistogram &h)
+{
+    double total = 0;
+    for(int k = 0; k < num_bins; k++) {
+        total += h.hist[k];
+    }
+
+    double target = total * percentile / 100.0;
+    double cumulative = 0;
+    for(int k = 0; k < num_bins; k++) {
+        cumulative += h.hist[k];
+        if(cumulative >= target) {
+            return (k + 1) * h.amax / num_bins;
+        }
+    }
+    return h.amax;
+}
+
+//按桶中心估计截断误差和舍入误差之和
+float CpuCalibrationTableBase::mseThreshold(const ActivationHistogram &h)
+{
+    float binWidth = h.amax / num_bins;
+
+    double minError = 1e30;
+    float bestThreshold = h.amax;
+    for(int i = kQUANTIZED_BINS; i <= num_bins; i++) {
+        float threshold = i * binWidth;
+        float scale = threshold / 127.0f;
+        double error = 0;
+        for(int k = 0; k < num_bins; k++) {
+            if(h.hist[k] == 0) {
+                continue;
+            }
+            float x = (k + 0.5f) * binWidth;
+            float diff = x > threshold ? x - threshold : x - roundf(x / scale) * scale;
+            error += h.hist[k] * diff * diff;
+        }
+        if(error < minError) {
+            minError = error;
+            bestThreshold = threshold;
+        }
+    }
+    return bestThreshold;
+}
+
+//TRT-5102-EntropyCalibration2格式：每行 name: float(threshold / 127)的十六进制
+bool CpuCalibrationTableBase::writeCalibrationTable()
+{
+    std::ofstream output(tablePath);
+    if(!output.good()) {
+        printf("can not write %s.\n", tablePath.c_str());
+        return false;
+    }
+
+    output << "TRT-5102-EntropyCalibration2" << endl;
+    for(size_t i = 0; i < histograms.size(); i++) {
+        const ActivationHistogram &h = histograms[i];
+        if(h.amax <= 0) {
+            printf("%s is always zero, skip.\n", h.name.c_str());
+            continue;
+        }
+
+        float threshold;
+        if(method == kPERCENTILE) {
+            threshold = percentileThreshold(h);
+        }
+        else if(method == kMSE) {
+            threshold = mseThreshold(h);
+        }
+        else {
+            threshold = entropyThreshold(h);
+        }
+
+        float scale = threshold / 127.0f;
+        uint32_t hex;
+        memcpy(&hex, &scale, sizeof(hex));
+        char line[32];
+        snprintf(line, sizeof(line), "%x", hex);
+        output << h.name << ": " << line << endl;
+    }
+
+    printf("write calibration table to %s\n", tablePath.c_str());
+    return true;
+}
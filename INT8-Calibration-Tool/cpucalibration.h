@@ -0,0 +1,98 @@
+#ifndef CPUCALIBRATION_H
+#define CPUCALIBRATION_H
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "cpunetbase.h"
+
+//不依赖CUDA和TensorRT，用CPU推理网络统计每个张量的激活分布，输出与TensorRT相同格式的校准表
+
+enum CALIBRATION_METHOD
+{
+    kENTROPY,       //KL散度最小，与TensorRT EntropyCalibration2一致
+    kPERCENTILE,    //按累计分布截断
+    kMSE            //量化均方误差最小
+};
+
+//只做前向，输入大小由校准工具设置
+class CpuCalibrationNet : public CpuNetBase
+{
+public:
+    CpuCalibrationNet(int chans, int height, int width, int batchSize);
+    virtual ~CpuCalibrationNet();
+
+    virtual void doInference(int batchSize, float *input = NULL) override;
+
+private:
+    virtual void allocateMemory() override;
+    virtual void releaseMemory() override;
+};
+
+//每个张量|x|的直方图
+struct ActivationHistogram
+{
+    std::string name;
+    float amax;
+    std::vector<double> hist;
+};
+
+class CpuCalibrationTableBase
+{
+public:
+    CpuCalibrationTableBase();
+    virtual ~CpuCalibrationTableBase();
+
+    void setInputDir(std::string inDir);
+    void setNumPerBatch(int numBatch);
+    void setModelPath(std::string symbolFile, std::string paramsFile);
+    void setNetworkParams(int chans, int height, int width);
+    void setCalibrationMethod(CALIBRATION_METHOD method);
+    //kPERCENTILE时使用，例如99.99
+    void setPercentile(float percentile);
+    //默认为symbol去掉-symbol.json加.table.int8
+    void setTablePath(std::string tablePath);
+
+    bool doCalibration();
+
+private:
+    //to impl
+    virtual cv::Mat preprocess(cv::Mat img) = 0;
+
+    void prepareData(const std::vector<cv::Mat> batchImages, float *data);
+
+    //第一遍统计最大值，第二遍统计直方图
+    void collectRange();
+    void collectHistogram();
+    void runBatches(bool histogram);
+
+    float entropyThreshold(const ActivationHistogram &h);
+    float percentileThreshold(const ActivationHistogram &h);
+    float mseThreshold(const ActivationHistogram &h);
+
+    bool writeCalibrationTable();
+
+protected:
+    int input_c;
+    int input_h;
+    int input_w;
+
+    int num_batchs;
+    int num_per_batch;
+    int num_bins;
+
+    std::string input_dir;
+    std::string symbolFile;
+    std::string paramsFile;
+    std::string tablePath;
+
+    CALIBRATION_METHOD method;
+    float percentile;
+
+private:
+    CpuCalibrationNet *net;
+    std::vector<std::string> filelist;
+    std::vector<ActivationHistogram> histograms;
+};
+
+#endif // CPUCALIBRATION_H
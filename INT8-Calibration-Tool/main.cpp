@@ -1,16 +1,37 @@
+#ifdef USE_CPU
+#include "CpuCalibrationTableImpl.h"
+#include <string.h>
+#else
 #include "CalibrationTableImpl.h"
+#endif
 #include <string>
 
 using namespace std;
 
 int main(int argc, char** argv)
 {
+#ifdef USE_CPU
+    //不需要GPU，直接用MXNet模型在CPU上校准
+    CpuCalibrationTableRetinaFace *calibra = new CpuCalibrationTableRetinaFace();
+    calibra->setInputDir("../INT8-Calibration-Tool/dataSet");
+    calibra->setModelPath("../model/mnet.25-symbol.json",
+                          "../model/mnet.25-0000.params");
+
+    //entropy(默认) / percentile / mse
+    if(argc > 1 && strcmp(argv[1], "percentile") == 0) {
+        calibra->setCalibrationMethod(kPERCENTILE);
+    }
+    else if(argc > 1 && strcmp(argv[1], "mse") == 0) {
+        calibra->setCalibrationMethod(kMSE);
+    }
+#else
     CalibrationTableRetinaFace *calibra = new CalibrationTableRetinaFace();
     calibra->setEncryption(false);
     calibra->setInputDir("../INT8-Calibration-Tool/dataSet");
     calibra->setOutputDir("../batches");
     calibra->setModelPath("../model/mnet-deconv-0517.prototxt",
                           "../model/mnet-deconv-0517.caffemodel");
+#endif
 
     calibra->doCalibration();
 
@@ -0,0 +1,39 @@
+#include "mixedprecision.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    MixedPrecisionTool *tool = new MixedPrecisionTool();
+    tool->setInputDir("../INT8-Calibration-Tool/dataSet");
+    tool->setModelPath("../model/mnet.25-symbol.json", "../model/mnet.25-0000.params");
+    tool->setCalibrationTable("../model/mnet.25.table.int8");
+    tool->setOutputFile("../model/mnet.25.precision");
+
+    //--budget 0.01 --images 50 --group ssh_c1*
+    vector<string> patterns;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--budget") == 0) {
+            tool->setAccuracyBudget(atof(argv[i + 1]));
+        }
+        else if(strcmp(argv[i], "--images") == 0) {
+            tool->setMaxImages(atoi(argv[i + 1]));
+        }
+        else if(strcmp(argv[i], "--group") == 0) {
+            patterns.push_back(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "--output") == 0) {
+            tool->setOutputFile(argv[i + 1]);
+        }
+    }
+    tool->setLayerGroups(patterns);
+
+    bool ret = tool->doSelection();
+
+    delete tool;
+
+    return ret ? 0 : -1;
+}
@@ -0,0 +1,322 @@
+#include "mixedprecision.h"
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+MixedPrecisionTool::MixedPrecisionTool()
+{
+    maxImages = 50;
+    budget = 0.01f;
+    outputFile = "mnet.25.precision";
+    net = NULL;
+
+    outputNames = {"face_rpn_cls_prob_reshape_stride32",
+                   "face_rpn_bbox_pred_stride32",
+                   "face_rpn_landmark_pred_stride32",
+                   "face_rpn_cls_prob_reshape_stride16",
+                   "face_rpn_bbox_pred_stride16",
+                   "face_rpn_landmark_pred_stride16",
+                   "face_rpn_cls_prob_reshape_stride8",
+                   "face_rpn_bbox_pred_stride8",
+                   "face_rpn_landmark_pred_stride8"};
+}
+
+MixedPrecisionTool::~MixedPrecisionTool()
+{
+    if(net != NULL) {
+        net->destroyCpuContext();
+        delete net;
+    }
+}
+
+void MixedPrecisionTool::setInputDir(const string &inputDir)
+{
+    this->inputDir = inputDir;
+}
+
+void MixedPrecisionTool::setMaxImages(int maxImages)
+{
+    this->maxImages = maxImages;
+}
+
+void MixedPrecisionTool::setModelPath(const string &symbolFile, const string &paramsFile)
+{
+    this->symbolFile = symbolFile;
+    this->paramsFile = paramsFile;
+}
+
+void MixedPrecisionTool::setCalibrationTable(const string &calibrationTable)
+{
+    this->calibrationTable = calibrationTable;
+}
+
+void MixedPrecisionTool::setOutputFile(const string &outputFile)
+{
+    this->outputFile = outputFile;
+}
+
+void MixedPrecisionTool::setAccuracyBudget(float budget)
+{
+    this->budget = budget;
+}
+
+void MixedPrecisionTool::setLayerGroups(const vector<string> &patterns)
+{
+    this->patterns = patterns;
+}
+
+void MixedPrecisionTool::loadImages()
+{
+    DIR *dir = opendir(inputDir.c_str());
+    if(dir == NULL) {
+        printf("can not open %s.\n", inputDir.c_str());
+        return;
+    }
+
+    vector<string> files;
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL) {
+        string name = ent->d_name;
+        if(name == "." || name == "..") {
+            continue;
+        }
+        files.push_back(inputDir + "/" + name);
+    }
+    closedir(dir);
+    sort(files.begin(), files.end());
+
+    for(size_t i = 0; i < files.size(); i++) {
+        if(maxImages > 0 && (int)images.size() >= maxImages) {
+            break;
+        }
+        cv::Mat img = cv::imread(files[i]);
+        if(img.empty()) {
+            continue;
+        }
+        images.push_back(img);
+    }
+}
+
+//与RetinaFace::preProcess一致：等比缩放后右下补边，rgb平面排列
+void MixedPrecisionTool::preprocess(const cv::Mat &img, float *input)
+{
+    int inputW = net->getNetWidth();
+    int inputH = net->getNetHeight();
+
+    float scale = max((float)img.cols / inputW, (float)img.rows / inputH);
+    cv::Mat resize;
+    if(scale > 1) {
+        cv::resize(img, resize, cv::Size(), 1 / scale, 1 / scale);
+    }
+    else {
+        resize = img;
+    }
+    cv::copyMakeBorder(resize, resize, 0, inputH - resize.rows, 0, inputW - resize.cols,
+                       cv::BORDER_CONSTANT, cv::Scalar(0));
+
+    resize.convertTo(resize, CV_32FC3);
+    cvtColor(resize, resize, CV_BGR2RGB);
+
+    vector<cv::Mat> input_channels;
+    for(int i = 0; i < net->getChannel(); ++i) {
+        cv::Mat channel(inputH, inputW, CV_32FC1, input);
+        input_channels.push_back(channel);
+        input += inputW * inputH;
+    }
+    split(resize, input_channels);
+}
+
+float MixedPrecisionTool::evaluate(bool profile)
+{
+    CpuProfiler *profiler = net->getProfiler();
+    profiler->reset();
+    net->setCpuProfilerEnabled(profile);
+
+    bool reference = references.empty();
+    float deviation = 0;
+    for(size_t i = 0; i < images.size(); i++) {
+        preprocess(images[i], net->getInputBuf());
+        net->doInference(1);
+
+        if(reference) {
+            vector<vector<float> > outs;
+            for(size_t k = 0; k < outputNames.size(); k++) {
+                //输出是指向网络内存的视图，下一次推理会覆盖，参考值需要拷贝
+                const CpuBlob *blob = net->blob_by_name(outputNames[k]);
+                outs.push_back(vector<float>(blob->batch(0), blob->batch(0) + blob->batchStride));
+            }
+            references.push_back(outs);
+            continue;
+        }
+
+        //每张图取偏差最大的输出
+        float worst = 0;
+        for(size_t k = 0; k < outputNames.size(); k++) {
+            const float *out = net->blob_by_name(outputNames[k])->batch(0);
+            const vector<float> &ref = references[i][k];
+            double diff = 0, norm = 0;
+            for(size_t j = 0; j < ref.size(); j++) {
+                diff += fabs(out[j] - ref[j]);
+                norm += fabs(ref[j]);
+            }
+            worst = max(worst, (float)(diff / (norm + 1e-6)));
+        }
+        deviation += worst;
+    }
+
+    net->setCpuProfilerEnabled(false);
+    if(profile) {
+        for(size_t i = 0; i < profiler->mProfile.size(); i++) {
+            profiler->mProfile[i].second /= images.size();
+        }
+    }
+
+    return images.empty() ? 0 : deviation / images.size();
+}
+
+float MixedPrecisionTool::groupTime(const PrecisionGroup &group)
+{
+    const vector<CpuProfiler::Record> &records = net->getProfiler()->mProfile;
+    float time = 0;
+    for(size_t i = 0; i < group.layers.size(); i++) {
+        for(size_t j = 0; j < records.size(); j++) {
+            if(records[j].first == group.layers[i]) {
+                time += records[j].second;
+                break;
+            }
+        }
+    }
+    return time;
+}
+
+void MixedPrecisionTool::setGroupPrecision(const PrecisionGroup &group, CpuPrecision precision)
+{
+    for(size_t i = 0; i < group.layers.size(); i++) {
+        net->setLayerPrecision(group.layers[i], precision);
+    }
+}
+
+static float totalTime(CpuProfiler *profiler)
+{
+    float time = 0;
+    for(size_t i = 0; i < profiler->mProfile.size(); i++) {
+        time += profiler->mProfile[i].second;
+    }
+    return time;
+}
+
+bool MixedPrecisionTool::doSelection()
+{
+    net = new CpuRetinaFaceNet("retina");
+    net->buildCpuContext(symbolFile, paramsFile);
+    if(!net->loadCalibrationTable(calibrationTable)) {
+        printf("Can not open CalibrationTable %s.\n", calibrationTable.c_str());
+        return false;
+    }
+
+    loadImages();
+    if(images.empty()) {
+        printf("no validation image found in %s.\n", inputDir.c_str());
+        return false;
+    }
+    printf("validation images: %d\n", (int)images.size());
+
+    //分组
+    vector<string> convs = net->getLayerNames("Convolution");
+    if(patterns.empty()) {
+        patterns = convs;
+    }
+    for(size_t p = 0; p < patterns.size(); p++) {
+        PrecisionGroup group;
+        group.pattern = patterns[p];
+        bool prefix = patterns[p][patterns[p].size() - 1] == '*';
+        string key = prefix ? patterns[p].substr(0, patterns[p].size() - 1) : patterns[p];
+        for(size_t i = 0; i < convs.size(); i++) {
+            if(prefix ? convs[i].compare(0, key.size(), key) == 0 : convs[i] == key) {
+                group.layers.push_back(convs[i]);
+            }
+        }
+        if(group.layers.empty()) {
+            printf("pattern %s matches no convolution, skip.\n", patterns[p].c_str());
+            continue;
+        }
+        group.fp32Time = group.int8Time = group.deviation = 0;
+        group.int8 = false;
+        groups.push_back(group);
+    }
+
+    //fp32基准
+    evaluate(false);
+    evaluate(true);
+    float fp32Total = totalTime(net->getProfiler());
+    for(size_t g = 0; g < groups.size(); g++) {
+        groups[g].fp32Time = groupTime(groups[g]);
+    }
+
+    //每组单独切成int8
+    for(size_t g = 0; g < groups.size(); g++) {
+        setGroupPrecision(groups[g], kCpuINT8);
+        groups[g].deviation = evaluate(true);
+        groups[g].int8Time = groupTime(groups[g]);
+        setGroupPrecision(groups[g], kCpuFP32);
+
+        printf("[%d/%d] %-40.40s dev %.5f  fp32 %.3fms  int8 %.3fms\n", (int)g + 1, (int)groups.size(),
+               groups[g].pattern.c_str(), groups[g].deviation, groups[g].fp32Time, groups[g].int8Time);
+    }
+
+    //按单位偏差节省的时间排序，贪心加入，超出预算就回退
+    vector<int> order;
+    for(size_t g = 0; g < groups.size(); g++) {
+        if(groups[g].fp32Time - groups[g].int8Time > 0) {
+            order.push_back(g);
+        }
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        float ea = (groups[a].fp32Time - groups[a].int8Time) / (groups[a].deviation + 1e-6f);
+        float eb = (groups[b].fp32Time - groups[b].int8Time) / (groups[b].deviation + 1e-6f);
+        return ea > eb;
+    });
+
+    float mixedDeviation = 0;
+    for(size_t i = 0; i < order.size(); i++) {
+        PrecisionGroup &group = groups[order[i]];
+        if(group.deviation > budget) {
+            continue;
+        }
+
+        setGroupPrecision(group, kCpuINT8);
+        float deviation = evaluate(false);
+        if(deviation <= budget) {
+            group.int8 = true;
+            mixedDeviation = deviation;
+        }
+        else {
+            setGroupPrecision(group, kCpuFP32);
+        }
+    }
+
+    evaluate(true);
+    float mixedTotal = totalTime(net->getProfiler());
+    printReport(fp32Total, mixedTotal, mixedDeviation);
+
+    if(!net->savePrecisionConfig(outputFile)) {
+        printf("can not write %s.\n", outputFile.c_str());
+        return false;
+    }
+    printf("write mixed precision config to %s\n", outputFile.c_str());
+
+    return true;
+}
+
+void MixedPrecisionTool::printReport(float fp32Total, float mixedTotal, float mixedDeviation)
+{
+    printf("\n%-40s %8s %10s %10s %10s\n", "group", "mode", "deviation", "fp32(ms)", "int8(ms)");
+    for(size_t g = 0; g < groups.size(); g++) {
+        printf("%-40.40s %8s %10.5f %10.3f %10.3f\n", groups[g].pattern.c_str(), groups[g].int8 ? "INT8" : "FP32",
+               groups[g].deviation, groups[g].fp32Time, groups[g].int8Time);
+    }
+    printf("\naccuracy budget: %.5f, mixed deviation: %.5f\n", budget, mixedDeviation);
+    printf("fp32: %.3fms, mixed: %.3fms, speedup: %.2fx\n", fp32Total, mixedTotal,
+           mixedTotal > 0 ? fp32Total / mixedTotal : 0);
+}
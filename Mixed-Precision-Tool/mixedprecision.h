@@ -0,0 +1,85 @@
+#ifndef MIXEDPRECISION_H
+#define MIXEDPRECISION_H
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "cpuretinafacenet.h"
+
+using namespace std;
+
+//一组同时切换精度的卷积层
+struct PrecisionGroup
+{
+    string pattern;             //层名，以*结尾表示前缀匹配
+    vector<string> layers;      //匹配到的卷积层
+    float fp32Time;             //fp32下这组层的耗时(ms/张)
+    float int8Time;             //int8下这组层的耗时(ms/张)
+    float deviation;            //只把这组切成int8时输出相对fp32的偏差
+    bool int8;                  //最终是否使用int8
+};
+
+class MixedPrecisionTool
+{
+public:
+    MixedPrecisionTool();
+    ~MixedPrecisionTool();
+
+    //验证集目录
+    void setInputDir(const string &inputDir);
+    //最多使用的图片数，0表示全部
+    void setMaxImages(int maxImages);
+    //MXNet模型
+    void setModelPath(const string &symbolFile, const string &paramsFile);
+    //INT8-Calibration-Tool生成的校准表
+    void setCalibrationTable(const string &calibrationTable);
+    //输出的混合精度配置
+    void setOutputFile(const string &outputFile);
+    //允许的最大输出偏差(相对L1)
+    void setAccuracyBudget(float budget);
+
+   /**
+    *	@brief  setLayerGroups	        设置按组切换的层
+    *   @param  patterns		        每个元素是层名或以*结尾的前缀
+    *   @return
+    *
+    *   @note                           不设置时每个卷积层单独一组
+    */
+    void setLayerGroups(const vector<string> &patterns);
+
+   /**
+    *	@brief  doSelection	            逐组测量偏差和耗时，在精度预算内贪心选择int8层
+    *   @return                         成功返回true
+    *
+    *   @note                           结果写入outputFile，RetinaFace用loadPrecisionConfig加载
+    */
+    bool doSelection();
+
+private:
+    void loadImages();
+    void preprocess(const cv::Mat &img, float *input);
+    //跑完整个验证集，返回相对fp32的偏差，同时统计每层耗时
+    float evaluate(bool profile);
+    float groupTime(const PrecisionGroup &group);
+    void setGroupPrecision(const PrecisionGroup &group, CpuPrecision precision);
+    void printReport(float fp32Total, float mixedTotal, float mixedDeviation);
+
+private:
+    string inputDir;
+    int maxImages;
+    string symbolFile;
+    string paramsFile;
+    string calibrationTable;
+    string outputFile;
+    float budget;
+    vector<string> patterns;
+
+    vector<string> outputNames;
+    CpuRetinaFaceNet *net;
+    vector<cv::Mat> images;
+    //每张图每个输出的fp32结果
+    vector<vector<vector<float> > > references;
+    vector<PrecisionGroup> groups;
+};
+
+#endif // MIXEDPRECISION_H
@@ -1,9 +1,13 @@
 #include "RetinaFace.h"
+#ifndef USE_CPU
 #include <cuda_runtime_api.h>
+#endif
 
+#ifdef USE_NPP
 void imageROIResize8U3C(void *src, int srcWidth, int srcHeight, cv::Rect imgROI, void *dst, int dstWidth, int dstHeight);
 void convertBGR2RGBfloat(void *src, void *dst, int width, int height, cudaStream_t stream);
 void imageSplit(const void *src, float *dst, int width, int height, cudaStream_t stream);
+#endif
 
 //processing
 anchor_win  _whctrs(anchor_box anchor)
@@ -124,87 +128,216 @@ vector<vector<anchor_box>> generate_anchors_fpn(bool dense_anchor = false, vecto
     return anchors;
 }
 
-vector<anchor_box> anchors_plane(int height, int width, int stride, vector<anchor_box> base_anchors)
+//一层的基础anchor(x1, y1, x2, y2)转成中心和宽高，宽高按像素个数计(x2 - x1 + 1)
+vector<AnchorShape> toAnchorShapes(const vector<anchor_box> &base_anchors)
 {
-    /*
-    height: height of plane
-    width:  width of plane
-    stride: stride ot the original image
-    anchors_base: a base set of anchors
-    */
-
-    vector<anchor_box> all_anchors;
-    for(size_t k = 0; k < base_anchors.size(); k++) {
-        for(int ih = 0; ih < height; ih++) {
-            int sh = ih * stride;
-            for(int iw = 0; iw < width; iw++) {
-                int sw = iw * stride;
-
-                anchor_box tmp;
-                tmp.x1 = base_anchors[k].x1 + sw;
-                tmp.y1 = base_anchors[k].y1 + sh;
-                tmp.x2 = base_anchors[k].x2 + sw;
-                tmp.y2 = base_anchors[k].y2 + sh;
-                all_anchors.push_back(tmp);
-            }
-        }
+    vector<AnchorShape> shapes(base_anchors.size());
+    for(size_t i = 0; i < base_anchors.size(); i++) {
+        float width = base_anchors[i].x2 - base_anchors[i].x1 + 1;
+        float height = base_anchors[i].y2 - base_anchors[i].y1 + 1;
+        shapes[i].ctrX = base_anchors[i].x1 + 0.5 * (width - 1.0);
+        shapes[i].ctrY = base_anchors[i].y1 + 0.5 * (height - 1.0);
+        shapes[i].width = width;
+        shapes[i].height = height;
     }
 
-    return all_anchors;
+    return shapes;
 }
 
-void clip_boxes(vector<anchor_box> &boxes, int width, int height)
+//######################################################################
+//retinaface
+//######################################################################
+
+RetinaFace::RetinaFace(string &model, string network, float nms)
+    : network(network), nms_threshold(nms)
 {
-    //Clip boxes to image boundaries.
-    for(size_t i = 0; i < boxes.size(); i++) {
-        if(boxes[i].x1 < 0) {
-            boxes[i].x1 = 0;
+#ifdef USE_CPU
+    grayInput = false;
+#endif
+    init(model);
+}
+
+#ifdef USE_CPU
+RetinaFace::RetinaFace(string &model, const CpuAffinity &affinity, string network, float nms, bool grayInput)
+    : network(network), nms_threshold(nms)
+{
+    this->affinity = affinity;
+    this->grayInput = grayInput;
+    init(model);
+}
+
+vector<RetinaFace *> RetinaFace::createPerNumaNode(string &model, string network, float nms)
+{
+    vector<CpuNumaNode> nodes = getNumaNodes();
+    vector<RetinaFace *> instances;
+    for(size_t k = 0; k < nodes.size(); k++) {
+        if(nodes[k].cpus.empty()) {
+            continue;
         }
-        if(boxes[i].y1 < 0) {
-            boxes[i].y1 = 0;
+
+        CpuAffinity affinity;
+        affinity.numThreads = nodes[k].cpus.size();
+        affinity.cpus = nodes[k].cpus;
+        affinity.numaNode = nodes.size() > 1 ? nodes[k].id : -1;
+
+        //在该节点的cpu上创建，权重的首次写入也落在本地内存
+        RetinaFace *instance = NULL;
+        thread builder([&] {
+            bindCurrentThread(affinity.cpus);
+            instance = new RetinaFace(model, affinity, network, nms);
+        });
+        builder.join();
+        instances.push_back(instance);
+    }
+    return instances;
+}
+
+void RetinaFace::setInputBuckets(const vector<cv::Size> &sizes)
+{
+    selectInputBucket(0, 0);
+
+    inputBuckets.clear();
+    for(size_t i = 0; i < sizes.size(); i++) {
+        InputBucket bucket;
+        bucket.width = std::min(maxInputW, (sizes[i].width + 31) / 32 * 32);
+        bucket.height = std::min(maxInputH, (sizes[i].height + 31) / 32 * 32);
+        if(bucket.width <= 0 || bucket.height <= 0 || (bucket.width == maxInputW && bucket.height == maxInputH)) {
+            continue;
         }
-        if(boxes[i].x2 > width - 1) {
-            boxes[i].x2 = width - 1;
+
+        inputBuckets.push_back(bucket);
+    }
+}
+
+//图像letterbox进网络输入后保留的像素数，放不下时按比例缩小
+static double retainedPixels(int width, int height, int netW, int netH)
+{
+    double scale = std::max(1.0, std::max(1.0 * width / netW, 1.0 * height / netH));
+    return (width / scale) * (height / scale);
+}
+
+void RetinaFace::selectInputBucket(int width, int height)
+{
+    //保留的像素不少于最大尺寸的90%时，选面积最小的档位
+    int index = -1;
+    if(width > 0 && height > 0) {
+        double best = retainedPixels(width, height, maxInputW, maxInputH);
+        int area = maxInputW * maxInputH;
+        for(size_t i = 0; i < inputBuckets.size(); i++) {
+            const InputBucket &bucket = inputBuckets[i];
+            if(bucket.width * bucket.height < area &&
+               retainedPixels(width, height, bucket.width, bucket.height) >= 0.9 * best) {
+                index = i;
+                area = bucket.width * bucket.height;
+            }
         }
-        if(boxes[i].y2 > height - 1) {
-            boxes[i].y2 = height -1;
+    }
+    if(index == bucketIndex) {
+        return;
+    }
+
+    if(index < 0) {
+        inferNet->setInputSize(maxInputH, maxInputW);
+    }
+    else {
+        inferNet->setInputSize(inputBuckets[index].height, inputBuckets[index].width);
+    }
+    bucketIndex = index;
+}
+#endif
+
+void RetinaFace::resolveLevels(const vector<vector<anchor_box>> &anchors_fpn)
+{
+    _levels.resize(_feat_stride_fpn.size());
+    for(size_t i = 0; i < _feat_stride_fpn.size(); i++) {
+        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
+        FpnLevel &level = _levels[i];
+        level.stride = _feat_stride_fpn[i];
+        level.anchors = toAnchorShapes(anchors_fpn[i]);
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+        level.score = inferNet->blob_by_name("face_rpn_cls_prob_reshape_" + key);
+        level.bbox = inferNet->blob_by_name("face_rpn_bbox_pred_" + key);
+        level.landmark = inferNet->blob_by_name("face_rpn_landmark_pred_" + key);
+#else
+        level.score = Net_->blob_by_name("face_rpn_cls_prob_reshape_" + key);
+        level.bbox = Net_->blob_by_name("face_rpn_bbox_pred_" + key);
+        level.landmark = Net_->blob_by_name("face_rpn_landmark_pred_" + key);
+#endif
+        if(!level.score || !level.bbox || !level.landmark) {
+            printf("output of %s not found in network.\n", key.c_str());
         }
-//        boxes[i].x1 = std::max<float>(std::min<float>(boxes[i].x1, width - 1), 0);
-//        boxes[i].y1 = std::max<float>(std::min<float>(boxes[i].y1, height - 1), 0);
-//        boxes[i].x2 = std::max<float>(std::min<float>(boxes[i].x2, width - 1), 0);
-//        boxes[i].y2 = std::max<float>(std::min<float>(boxes[i].y2, height - 1), 0);
     }
 }
 
-void clip_boxes(anchor_box &box, int width, int height)
+void RetinaFace::setOrientation(const FrameOrientation &orientation)
+{
+    int rotation = (orientation.rotation % 360 + 360) % 360;
+    if(rotation % 90 != 0) {
+        printf("rotation %d is not a multiple of 90, ignored.\n", orientation.rotation);
+        return;
+    }
+    this->orientation = FrameOrientation(rotation, orientation.mirror);
+}
+
+//转正后图像的点(u, v)在width x height原始帧中的位置
+static void unorientPoint(float u, float v, int width, int height, const FrameOrientation &orientation,
+                          float &x, float &y)
 {
-    //Clip boxes to image boundaries.
-    if(box.x1 < 0) {
-        box.x1 = 0;
+    int rotation = orientation.rotation;
+    int uprightW = (rotation == 90 || rotation == 270) ? height : width;
+    if(orientation.mirror) {
+        u = uprightW - 1 - u;
     }
-    if(box.y1 < 0) {
-        box.y1 = 0;
+    if(rotation == 90) {
+        x = v;
+        y = height - 1 - u;
     }
-    if(box.x2 > width - 1) {
-        box.x2 = width - 1;
+    else if(rotation == 180) {
+        x = width - 1 - u;
+        y = height - 1 - v;
     }
-    if(box.y2 > height - 1) {
-        box.y2 = height -1;
+    else if(rotation == 270) {
+        x = width - 1 - v;
+        y = u;
+    }
+    else {
+        x = u;
+        y = v;
     }
-//    boxes[i].x1 = std::max<float>(std::min<float>(boxes[i].x1, width - 1), 0);
-//    boxes[i].y1 = std::max<float>(std::min<float>(boxes[i].y1, height - 1), 0);
-//    boxes[i].x2 = std::max<float>(std::min<float>(boxes[i].x2, width - 1), 0);
-//    boxes[i].y2 = std::max<float>(std::min<float>(boxes[i].y2, height - 1), 0);
-
 }
 
-//######################################################################
-//retinaface
-//######################################################################
+void RetinaFace::unorientFaces(vector<FaceDetectInfo> &faces, int width, int height) const
+{
+    if(orientation.rotation == 0 && !orientation.mirror) {
+        return;
+    }
 
-RetinaFace::RetinaFace(string &model, string network, float nms)
-    : network(network), nms_threshold(nms)
+    //镜像后检测到的左眼是原始帧中的右眼，左右眼、左右嘴角互换，与unflipFaces一致
+    static const int identity[5] = {0, 1, 2, 3, 4};
+    static const int swapped[5] = {1, 0, 2, 4, 3};
+    const int *order = orientation.mirror ? swapped : identity;
+    for(size_t i = 0; i < faces.size(); i++) {
+        //两个角点映射后重新取左上和右下
+        anchor_box &rect = faces[i].rect;
+        float ax, ay, bx, by;
+        unorientPoint(rect.x1, rect.y1, width, height, orientation, ax, ay);
+        unorientPoint(rect.x2, rect.y2, width, height, orientation, bx, by);
+        rect.x1 = std::min(ax, bx);
+        rect.y1 = std::min(ay, by);
+        rect.x2 = std::max(ax, bx);
+        rect.y2 = std::max(ay, by);
+        FacePts pts = faces[i].pts;
+        for(size_t j = 0; j < 5; j++) {
+            unorientPoint(pts.x[order[j]], pts.y[order[j]], width, height, orientation,
+                          faces[i].pts.x[j], faces[i].pts.y[j]);
+        }
+    }
+}
+
+void RetinaFace::init(string &model)
 {
+    bucketIndex = -1;
+
     //主干网络选择
     int fmc = 3;
 
@@ -272,34 +405,52 @@ RetinaFace::RetinaFace(string &model, string network, float nms)
 
     //加载网络
 #ifdef USE_TENSORRT
-    trtNet = new TrtRetinaFaceNet("retina");
-    trtNet->buildTrtContext(model + "/mnet-deconv-0517.prototxt", model + "/mnet-deconv-0517.caffemodel");
+    inferNet = new TrtRetinaFaceNet("retina");
+    inferNet->buildTrtContext(model + "/mnet-deconv-0517.prototxt", model + "/mnet-deconv-0517.caffemodel");
 
     TrtRetinaFaceNet *acfc = new TrtRetinaFaceNet("retinaww");
     acfc->buildTrtContext(model + "/mnet-deconv-0517.prototxt", model + "/mnet-deconv-0517.caffemodel");
 
-    int maxbatchsize = trtNet->getMaxBatchSize();
-    int channels = trtNet->getChannel();
-    int inputW = trtNet->getNetWidth();
-    int inputH = trtNet->getNetHeight();
+    int maxbatchsize = inferNet->getMaxBatchSize();
+    int channels = inferNet->getChannel();
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
     //
     int inputsize = maxbatchsize * channels * inputW * inputH * sizeof(float);
     cpuBuffers = (float*)malloc(inputsize);
     memset(cpuBuffers, 0, inputsize);
 
-    vector<int> outputW = trtNet->getOutputWidth();
-    vector<int> outputH = trtNet->getOutputHeight();
-
     bool dense_anchor = false;
     vector<vector<anchor_box>> anchors_fpn = generate_anchors_fpn(dense_anchor, cfg);
-    for(size_t i = 0; i < anchors_fpn.size(); i++) {
-        int stride = _feat_stride_fpn[i];
-        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
-        _anchors_fpn[key] = anchors_fpn[i];
-        _num_anchors[key] = anchors_fpn[i].size();
-        //有三组不同输出宽高
-        _anchors[key] = anchors_plane(outputH[i], outputW[i], stride, _anchors_fpn[key]);
+    resolveLevels(anchors_fpn);
+#elif defined(USE_CPU)
+    for(int c = 0; c < 3; c++) {
+        normalizeParam.means[c] = pixel_means[c];
+        normalizeParam.stds[c] = pixel_stds[c];
     }
+    normalizeParam.scale = pixel_scale;
+
+    inferNet = new CpuRetinaFaceNet("retina");
+    inferNet->setAffinity(affinity);
+    //第一层卷积直接读取BGR8(或单通道)图像，归一化合并进它的权重，不再生成fp32输入
+    inferNet->setImage8Input(grayInput ? 1 : 3, normalizeParam);
+    inferNet->buildCpuContext(model + "/mnet.25-symbol.json", model + "/mnet.25-0000.params");
+    //Mixed-Precision-Tool生成的逐层精度配置，不存在时全部fp32
+    inferNet->loadPrecisionConfig(model + "/mnet.25.precision", model + "/mnet.25.table.int8");
+    //第一次运行时逐层测速选择卷积实现，之后直接读取缓存
+    inferNet->autotune(model + "/mnet.25.tune");
+
+    //预处理直接写入网络输入，省掉一次拷贝；第一层不支持uint8输入时cpuBuffersU8为NULL
+    cpuBuffers = inferNet->getInputBuf();
+    cpuBuffersU8 = inferNet->getImage8InputBuf();
+    cpuChannelsU8 = inferNet->getImage8Channels();
+    maxInputW = inferNet->getNetWidth();
+    maxInputH = inferNet->getNetHeight();
+    convertedInputs.resize(inferNet->getMaxBatchSize());
+
+    bool dense_anchor = false;
+    vector<vector<anchor_box>> anchors_fpn = generate_anchors_fpn(dense_anchor, cfg);
+    resolveLevels(anchors_fpn);
 #else
 
 #ifdef CPU_ONLY
@@ -313,11 +464,7 @@ RetinaFace::RetinaFace(string &model, string network, float nms)
 
     bool dense_anchor = false;
     vector<vector<anchor_box>> anchors_fpn = generate_anchors_fpn(dense_anchor, cfg);
-    for(size_t i = 0; i < anchors_fpn.size(); i++) {
-        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
-        _anchors_fpn[key] = anchors_fpn[i];
-        _num_anchors[key] = anchors_fpn[i].size();
-    }
+    resolveLevels(anchors_fpn);
  #endif
 
 #ifdef USE_NPP
@@ -339,96 +486,91 @@ RetinaFace::RetinaFace(string &model, string network, float nms)
 RetinaFace::~RetinaFace()
 {
 #ifdef USE_TENSORRT
-    delete trtNet;
+    delete inferNet;
     free(cpuBuffers);
+#elif defined(USE_CPU)
+    inferNet->destroyCpuContext();
+    delete inferNet;
 #endif
 }
 
-vector<anchor_box> RetinaFace::bbox_pred(vector<anchor_box> anchors, vector<cv::Vec4f> regress)
+//只读JPEG的SOF段得到原图大小，不解码
+static bool readJpegSize(const string &file, int &width, int &height)
 {
-    //"""
-    //  Transform the set of class-agnostic boxes into class-specific boxes
-    //  by applying the predicted offsets (box_deltas)
-    //  :param boxes: !important [N 4]
-    //  :param box_deltas: [N, 4 * num_classes]
-    //  :return: [N 4 * num_classes]
-    //  """
-
-    vector<anchor_box> rects(anchors.size());
-    for(size_t i = 0; i < anchors.size(); i++) {
-        float width = anchors[i].x2 - anchors[i].x1 + 1;
-        float height = anchors[i].y2 - anchors[i].y1 + 1;
-        float ctr_x = anchors[i].x1 + 0.5 * (width - 1.0);
-        float ctr_y = anchors[i].y1 + 0.5 * (height - 1.0);
-
-        float pred_ctr_x = regress[i][0] * width + ctr_x;
-        float pred_ctr_y = regress[i][1] * height + ctr_y;
-        float pred_w = exp(regress[i][2]) * width;
-        float pred_h = exp(regress[i][3]) * height;
-
-        rects[i].x1 = pred_ctr_x - 0.5 * (pred_w - 1.0);
-        rects[i].y1 = pred_ctr_y - 0.5 * (pred_h - 1.0);
-        rects[i].x2 = pred_ctr_x + 0.5 * (pred_w - 1.0);
-        rects[i].y2 = pred_ctr_y + 0.5 * (pred_h - 1.0);
-    }
-
-    return rects;
-}
-
-anchor_box RetinaFace::bbox_pred(anchor_box anchor, cv::Vec4f regress)
-{
-    anchor_box rect;
-
-    float width = anchor.x2 - anchor.x1 + 1;
-    float height = anchor.y2 - anchor.y1 + 1;
-    float ctr_x = anchor.x1 + 0.5 * (width - 1.0);
-    float ctr_y = anchor.y1 + 0.5 * (height - 1.0);
-
-    float pred_ctr_x = regress[0] * width + ctr_x;
-    float pred_ctr_y = regress[1] * height + ctr_y;
-    float pred_w = exp(regress[2]) * width;
-    float pred_h = exp(regress[3]) * height;
-
-    rect.x1 = pred_ctr_x - 0.5 * (pred_w - 1.0);
-    rect.y1 = pred_ctr_y - 0.5 * (pred_h - 1.0);
-    rect.x2 = pred_ctr_x + 0.5 * (pred_w - 1.0);
-    rect.y2 = pred_ctr_y + 0.5 * (pred_h - 1.0);
-
-    return rect;
-}
+    FILE *fp = fopen(file.c_str(), "rb");
+    if(fp == NULL) {
+        return false;
+    }
 
-vector<FacePts> RetinaFace::landmark_pred(vector<anchor_box> anchors, vector<FacePts> facePts)
-{
-    vector<FacePts> pts(anchors.size());
-    for(size_t i = 0; i < anchors.size(); i++) {
-        float width = anchors[i].x2 - anchors[i].x1 + 1;
-        float height = anchors[i].y2 - anchors[i].y1 + 1;
-        float ctr_x = anchors[i].x1 + 0.5 * (width - 1.0);
-        float ctr_y = anchors[i].y1 + 0.5 * (height - 1.0);
-
-        for(size_t j = 0; j < 5; j ++) {
-            pts[i].x[j] = facePts[i].x[j] * width + ctr_x;
-            pts[i].y[j] = facePts[i].y[j] * height + ctr_y;
+    bool found = false;
+    if(fgetc(fp) == 0xFF && fgetc(fp) == 0xD8) {
+        while(!found) {
+            int c = fgetc(fp);
+            while(c == 0xFF) {
+                c = fgetc(fp);
+            }
+            if(c == EOF || c == 0xD9 || c == 0xDA) {
+                break;
+            }
+            int len = (fgetc(fp) << 8) | fgetc(fp);
+            if(len < 2) {
+                break;
+            }
+            //SOF0~SOF15，0xC4(DHT)、0xC8、0xCC(DAC)除外
+            if(c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC) {
+                unsigned char sof[5];
+                if(fread(sof, 1, 5, fp) == 5) {
+                    height = (sof[1] << 8) | sof[2];
+                    width = (sof[3] << 8) | sof[4];
+                    found = width > 0 && height > 0;
+                }
+                break;
+            }
+            fseek(fp, len - 2, SEEK_CUR);
         }
     }
-
-    return pts;
+    fclose(fp);
+    return found;
 }
 
-FacePts RetinaFace::landmark_pred(anchor_box anchor, FacePts facePt)
+Mat RetinaFace::readImage(const string &file, float &decodeScale)
 {
-    FacePts pt;
-    float width = anchor.x2 - anchor.x1 + 1;
-    float height = anchor.y2 - anchor.y1 + 1;
-    float ctr_x = anchor.x1 + 0.5 * (width - 1.0);
-    float ctr_y = anchor.y1 + 0.5 * (height - 1.0);
+    decodeScale = 1.0;
+
+    int width = 0;
+    int height = 0;
+    if(!readJpegSize(file, width, height)) {
+        return cv::imread(file);
+    }
+
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
 
-    for(size_t j = 0; j < 5; j ++) {
-        pt.x[j] = facePt.x[j] * width + ctr_x;
-        pt.y[j] = facePt.y[j] * height + ctr_y;
+    //detect会再缩小scale倍，EXIF旋转90度时宽高互换，两种方向都要保证解码后不小于网络输入
+    float scale = std::min(std::max(1.0f * width / inputW, 1.0f * height / inputH),
+                           std::max(1.0f * height / inputW, 1.0f * width / inputH));
+    int flag = cv::IMREAD_COLOR;
+    if(scale >= 8) {
+        flag = cv::IMREAD_REDUCED_COLOR_8;
+    }
+    else if(scale >= 4) {
+        flag = cv::IMREAD_REDUCED_COLOR_4;
+    }
+    else if(scale >= 2) {
+        flag = cv::IMREAD_REDUCED_COLOR_2;
     }
 
-    return pt;
+    //DCT域缩放，只解码需要的分辨率
+    Mat img = cv::imread(file, flag);
+    if(!img.empty()) {
+        decodeScale = 1.0f * std::max(width, height) / std::max(img.cols, img.rows);
+    }
+    return img;
+#else
+    //caffe按原图大小推理，不缩小
+    return cv::imread(file);
+#endif
 }
 
 bool RetinaFace::CompareBBox(const FaceDetectInfo & a, const FaceDetectInfo & b)
@@ -438,12 +580,20 @@ bool RetinaFace::CompareBBox(const FaceDetectInfo & a, const FaceDetectInfo & b)
 
 std::vector<FaceDetectInfo> RetinaFace::nms(std::vector<FaceDetectInfo>& bboxes, float threshold)
 {
-    std::vector<FaceDetectInfo> bboxes_nms;
+    std::vector<FaceDetectInfo> bboxes_nms = bboxes;
+    nmsInPlace(bboxes_nms, threshold);
+    return bboxes_nms;
+}
+
+void RetinaFace::nmsInPlace(std::vector<FaceDetectInfo>& bboxes, float threshold)
+{
     std::sort(bboxes.begin(), bboxes.end(), CompareBBox);
 
     int32_t select_idx = 0;
     int32_t num_bbox = static_cast<int32_t>(bboxes.size());
-    std::vector<int32_t> mask_merged(num_bbox, 0);
+    int32_t num_keep = 0;
+    nmsMask.assign(num_bbox, 0);
+    std::vector<int32_t> &mask_merged = nmsMask;
     bool all_merged = false;
 
     while (!all_merged) {
@@ -455,7 +605,8 @@ std::vector<FaceDetectInfo> RetinaFace::nms(std::vector<FaceDetectInfo>& bboxes,
             continue;
         }
 
-        bboxes_nms.push_back(bboxes[select_idx]);
+        //保留的框移到前面，select_idx之前的框不会再被读取
+        bboxes[num_keep++] = bboxes[select_idx];
         mask_merged[select_idx] = 1;
 
         anchor_box select_bbox = bboxes[select_idx].rect;
@@ -488,110 +639,163 @@ std::vector<FaceDetectInfo> RetinaFace::nms(std::vector<FaceDetectInfo>& bboxes,
         }
     }
 
-    return bboxes_nms;
+    bboxes.resize(num_keep);
 }
 
-#ifdef USE_TENSORRT
-vector<FaceDetectInfo> RetinaFace::postProcess(int inputW, int inputH, float threshold)
+void RetinaFace::decodeLevel(const FpnLevel &level, const float *score, const float *bbox_delta,
+                             const float *landmark_delta, int width, int height, int clipW, int clipH,
+                             float threshold, vector<FaceDetectInfo> &faceInfo)
 {
-    string name_bbox = "face_rpn_bbox_pred_";
-    string name_score ="face_rpn_cls_prob_reshape_";
-    string name_landmark ="face_rpn_landmark_pred_";
+    //存储顺序 num_anchor * h * w，anchor在解码时按位置现算
+    size_t count = width * height;
+    size_t num_anchor = level.anchors.size();
+
+    for(size_t num = 0; num < num_anchor; num++) {
+        //置信度小于阈值跳过，超过的位置压缩成紧凑列表，只解码列表中的
+        const float *conf = score + count * num;
+        candidates.resize(count);
+        int n = compactAboveThreshold(conf, count, threshold, candidates.data());
+        if(n == 0) {
+            continue;
+        }
 
-    vector<FaceDetectInfo> faceInfo;
-    for(size_t i = 0; i < _feat_stride_fpn.size(); i++) {
-///////////////////////////////////////////////
-        double s1 = (double)getTickCount();
-///////////////////////////////////////////////
-        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
+        FaceDecodePlanes planes;
+        planes.anchor = level.anchors[num];
+        planes.stride = level.stride;
+        planes.gridW = width;
+        for(size_t k = 0; k < 4; k++) {
+            planes.delta[k] = bbox_delta + count * (k + num * 4);
+        }
+        for(size_t k = 0; k < 10; k++) {
+            planes.landmark[k] = landmark_delta + count * (num * 10 + k);
+        }
 
-        string str = name_score + key;
-        TrtBlob* score_blob = trtNet->blob_by_name(str);
-        std::vector<float> score = score_blob->result[0];
-        std::vector<float>::iterator begin = score.begin() + score.size() / 2;
-        std::vector<float>::iterator end = score.end();
-        score = std::vector<float>(begin, end);
+        //回归人脸框(越界处理)和关键点
+        decodeBuffer.resize(14 * n);
+        FaceDecodeResult result;
+        for(int k = 0; k < 4; k++) {
+            result.box[k] = decodeBuffer.data() + k * n;
+        }
+        for(int k = 0; k < 10; k++) {
+            result.landmark[k] = decodeBuffer.data() + (4 + k) * n;
+        }
+        decodeFaces(planes, candidates.data(), n, clipW, clipH, result);
+
+        for(int c = 0; c < n; c++) {
+            FaceDetectInfo tmp;
+            tmp.score = conf[candidates[c]];
+            tmp.rect.x1 = result.box[0][c];
+            tmp.rect.y1 = result.box[1][c];
+            tmp.rect.x2 = result.box[2][c];
+            tmp.rect.y2 = result.box[3][c];
+            for(size_t k = 0; k < 5; k++) {
+                tmp.pts.x[k] = result.landmark[k * 2][c];
+                tmp.pts.y[k] = result.landmark[k * 2 + 1][c];
+            }
+            faceInfo.push_back(tmp);
+        }
+    }
+}
 
-        str = name_bbox + key;
-        TrtBlob* bbox_blob = trtNet->blob_by_name(str);
-        std::vector<float> bbox_delta = bbox_blob->result[0];
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+void RetinaFace::postProcess(int inputW, int inputH, float threshold, vector<FaceDetectInfo> &faceInfo, int batch)
+{
+    faceInfo.clear();
+    for(size_t i = 0; i < _levels.size(); i++) {
+        const FpnLevel &level = _levels[i];
 
-        str = name_landmark + key;
-        TrtBlob* landmark_blob = trtNet->blob_by_name(str);
-        std::vector<float> landmark_delta = landmark_blob->result[0];
+        //直接读取网络输出，不拷贝；score的前一半通道是背景概率
+        const RetinaFaceBlob *score_blob = level.score;
+        const float *score = score_blob->batch(batch) + score_blob->batchStride / 2;
+        const float *bbox_delta = level.bbox->batch(batch);
+        const float *landmark_delta = level.landmark->batch(batch);
 
         int width = score_blob->outputDims.w();
         int height = score_blob->outputDims.h();
-        size_t count = width * height;
-        size_t num_anchor = _num_anchors[key];
-
-///////////////////////////////////////////////
-        s1 = (double)getTickCount() - s1;
-        std::cout << "s1 compute time :" << s1*1000.0 / cv::getTickFrequency() << " ms \n";
-///////////////////////////////////////////////
-
-        for(size_t num = 0; num < num_anchor; num++) {
-            for(size_t j = 0; j < count; j++) {
-                //置信度小于阈值跳过
-                float conf = score[j + count * num];
-                if(conf <= threshold) {
-                    continue;
-                }
-
-                cv::Vec4f regress;
-                float dx = bbox_delta[j + count * (0 + num * 4)];
-                float dy = bbox_delta[j + count * (1 + num * 4)];
-                float dw = bbox_delta[j + count * (2 + num * 4)];
-                float dh = bbox_delta[j + count * (3 + num * 4)];
-                regress = cv::Vec4f(dx, dy, dw, dh);
-
-                //回归人脸框
-                anchor_box rect = bbox_pred(_anchors[key][j + count * num], regress);
-                //越界处理
-                clip_boxes(rect, inputW, inputH);
-
-                FacePts pts;
-                for(size_t k = 0; k < 5; k++) {
-                    pts.x[k] = landmark_delta[j + count * (num * 10 + k * 2)];
-                    pts.y[k] = landmark_delta[j + count * (num * 10 + k * 2 + 1)];
-                }
-                //回归人脸关键点
-                FacePts landmarks = landmark_pred(_anchors[key][j + count * num], pts);
-
-                FaceDetectInfo tmp;
-                tmp.score = conf;
-                tmp.rect = rect;
-                tmp.pts = landmarks;
-                faceInfo.push_back(tmp);
-            }
-        }
+        decodeLevel(level, score, bbox_delta, landmark_delta, width, height, inputW, inputH, threshold, faceInfo);
     }
 
     //排序nms
-    faceInfo = nms(faceInfo, 0.4);
-
-    return faceInfo;
+    nmsInPlace(faceInfo, nms_threshold);
 }
 
-void RetinaFace::detect(const Mat &img, float threshold, float scales)
+#ifdef USE_CPU
+void RetinaFace::preprocessCpu(const Mat &img, float scale, int index, const CpuOrientation &orientation)
 {
-    if(img.empty()) {
-        return;
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+    size_t planeSize = (size_t)inputW * inputH;
+
+    //单通道输入时彩色图先转灰度，三通道输入时灰度图按GRAY2BGR处理
+    //转换结果按批次位置写入各自的缓存图像，尺寸不变时不重新分配，批量预处理并行时互不干扰
+    bool toGray = grayInput && img.channels() == 3;
+    bool toBGR = cpuChannelsU8 == 3 && img.channels() == 1;
+    if(toGray) {
+        cv::cvtColor(img, convertedInputs[index], cv::COLOR_BGR2GRAY);
+    }
+    else if(toBGR) {
+        cv::cvtColor(img, convertedInputs[index], cv::COLOR_GRAY2BGR);
     }
+    const Mat &src = (toGray || toBGR) ? convertedInputs[index] : img;
 
-    //double pre = (double)getTickCount();
+    if(cpuChannelsU8 == 1) {
+        letterboxGray(src.data, src.cols, src.rows, src.step, scale, cpuBuffersU8 + index * planeSize, inputW, inputH,
+                      orientation);
+    }
+    else if(cpuChannelsU8 == 3) {
+        letterboxBGR(src.data, src.cols, src.rows, src.step, scale, cpuBuffersU8 + index * planeSize * 3, inputW, inputH,
+                     orientation);
+    }
+    else if(src.channels() == 1) {
+        letterboxGrayToPlanar(src.data, src.cols, src.rows, src.step, scale,
+                              cpuBuffers + index * planeSize * 3, inputW, inputH, normalizeParam, orientation);
+    }
+    else {
+        //缩放、补边、转RGB、归一化一次完成，直接写入网络输入
+        letterboxBGRToPlanar(src.data, src.cols, src.rows, src.step, scale,
+                             cpuBuffers + index * planeSize * 3, inputW, inputH, normalizeParam, orientation);
+    }
+}
+#endif
 
-    int inputW = trtNet->getNetWidth();
-    int inputH = trtNet->getNetHeight();
+float RetinaFace::preprocess(const Mat &frame)
+{
+    //按转正后的大小选择输入尺寸和缩小倍数
+    bool transpose = orientation.rotation == 90 || orientation.rotation == 270;
+    int width = transpose ? frame.rows : frame.cols;
+    int height = transpose ? frame.cols : frame.rows;
+#ifdef USE_CPU
+    selectInputBucket(width, height);
+    //旋转和镜像在缩放取样时完成
+    const Mat &img = frame;
+#else
+    //其他后端先转正到新的图像，不改动传入的帧
+    Mat img = frame;
+    if(orientation.rotation != 0) {
+        int code = orientation.rotation == 90 ? cv::ROTATE_90_CLOCKWISE :
+                   orientation.rotation == 180 ? cv::ROTATE_180 : cv::ROTATE_90_COUNTERCLOCKWISE;
+        Mat rotated;
+        cv::rotate(frame, rotated, code);
+        img = rotated;
+    }
+    if(orientation.mirror) {
+        Mat flipped;
+        cv::flip(img, flipped, 1);
+        img = flipped;
+    }
+#endif
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
 
     float scale = 1.0;
-    float sw = 1.0 * img.cols / inputW;
-    float sh = 1.0 * img.rows / inputH;
+    float sw = 1.0 * width / inputW;
+    float sh = 1.0 * height / inputH;
     scale = sw > sh ? sw : sh;
     scale = scale > 1.0 ? scale : 1.0;
 
 #ifdef USE_NPP
-    cudaMemcpy(_gpu_data8u.data, img.data, img.cols * img.rows * 3, cudaMemcpyHostToDevice);
+    //按行拷贝，子图(ROI)和带行间隔的图像也不需要先clone
+    cudaMemcpy2D(_gpu_data8u.data, img.cols * 3, img.data, img.step, img.cols * 3, img.rows, cudaMemcpyHostToDevice);
     _gpu_data8u.width = img.cols;
     _gpu_data8u.height = img.rows;
     //注：输入图片大小不一样，使用统一buffer会引入脏数据，所以每次置０
@@ -604,8 +808,14 @@ void RetinaFace::detect(const Mat &img, float threshold, float scales)
 
     convertBGR2RGBfloat(_resize_gpu_data8u.data, _resize_gpu_data32f.data, inputW, inputH, NULL);
 
-    float *inputData = (float*)trtNet->getBuffer(0);
+    float *inputData = (float*)inferNet->getBuffer(0);
     imageSplit(_resize_gpu_data32f.data, inputData, inputW, inputH, NULL);
+#elif defined(USE_CPU)
+    if(img.type() != CV_8UC3 && img.type() != CV_8UC1) {
+        printf("cpu detect needs a BGR8 or gray8 image.\n");
+        return 0;
+    }
+    preprocessCpu(img, scale, 0, CpuOrientation(orientation.rotation, orientation.mirror));
 #else
     cv::Mat resize;
     if(scale > 1) {
@@ -632,7 +842,7 @@ void RetinaFace::detect(const Mat &img, float threshold, float scales)
     vector<Mat> input_channels;
     float* input_data = cpuBuffers;
 
-    for (int i = 0; i < trtNet->getChannel(); ++i) {
+    for (int i = 0; i < inferNet->getChannel(); ++i) {
         Mat channel(inputH, inputW, CV_32FC1, input_data);
         input_channels.push_back(channel);
         input_data += inputW * inputH;
@@ -643,99 +853,28 @@ void RetinaFace::detect(const Mat &img, float threshold, float scales)
     * objects in input_channels. */
     split(resize, input_channels);
 
-    float *inputData = (float*)trtNet->getBuffer(0);
+    float *inputData = (float*)inferNet->getBuffer(0);
     cudaMemcpy(inputData, cpuBuffers, inputW * inputH * 3 * sizeof(float), cudaMemcpyHostToDevice);
 #endif
 
-    //pre = (double)getTickCount() - pre;
-    //std::cout << "pre compute time :" << pre*1000.0 / cv::getTickFrequency() << " ms \n";
-
-    //LOG(INFO) << "Start net_->Forward()";
-    //double t1 = (double)getTickCount();
-    trtNet->doInference(1);
-    //t1 = (double)getTickCount() - t1;
-    //std::cout << "doInference compute time :" << t1*1000.0 / cv::getTickFrequency() << " ms \n";
-    //LOG(INFO) << "Done net_->Forward()";
-
-    //double post = (double)getTickCount();
-    string name_bbox = "face_rpn_bbox_pred_";
-    string name_score ="face_rpn_cls_prob_reshape_";
-    string name_landmark ="face_rpn_landmark_pred_";
-
-    vector<FaceDetectInfo> faceInfo;
-    for(size_t i = 0; i < _feat_stride_fpn.size(); i++) {
-        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
-
-        string str = name_score + key;
-        TrtBlob* score_blob = trtNet->blob_by_name(str);
-        std::vector<float> score = score_blob->result[0];
-        std::vector<float>::iterator begin = score.begin() + score.size() / 2;
-        std::vector<float>::iterator end = score.end();
-        score = std::vector<float>(begin, end);
-
-        str = name_bbox + key;
-        TrtBlob* bbox_blob = trtNet->blob_by_name(str);
-        std::vector<float> bbox_delta = bbox_blob->result[0];
-
-        str = name_landmark + key;
-        TrtBlob* landmark_blob = trtNet->blob_by_name(str);
-        std::vector<float> landmark_delta = landmark_blob->result[0];
-
-        int width = score_blob->outputDims.w();
-        int height = score_blob->outputDims.h();
-        size_t count = width * height;
-        size_t num_anchor = _num_anchors[key];
-
-        for(size_t num = 0; num < num_anchor; num++) {
-            for(size_t j = 0; j < count; j++) {
-                //置信度小于阈值跳过
-                float conf = score[j + count * num];
-                if(conf <= threshold) {
-                    continue;
-                }
+    return scale;
+}
 
-                cv::Vec4f regress;
-                float dx = bbox_delta[j + count * (0 + num * 4)];
-                float dy = bbox_delta[j + count * (1 + num * 4)];
-                float dw = bbox_delta[j + count * (2 + num * 4)];
-                float dh = bbox_delta[j + count * (3 + num * 4)];
-                regress = cv::Vec4f(dx, dy, dw, dh);
-
-                //回归人脸框
-                anchor_box rect = bbox_pred(_anchors[key][j + count * num], regress);
-                //越界处理
-                clip_boxes(rect, inputW, inputH);
-
-                FacePts pts;
-                for(size_t k = 0; k < 5; k++) {
-                    pts.x[k] = landmark_delta[j + count * (num * 10 + k * 2)];
-                    pts.y[k] = landmark_delta[j + count * (num * 10 + k * 2 + 1)];
-                }
-                //回归人脸关键点
-                FacePts landmarks = landmark_pred(_anchors[key][j + count * num], pts);
-
-                FaceDetectInfo tmp;
-                tmp.score = conf;
-                tmp.rect = rect;
-                tmp.pts = landmarks;
-                faceInfo.push_back(tmp);
-            }
-        }
-    }
-    //排序nms
-    faceInfo = nms(faceInfo, nms_threshold);
+void RetinaFace::detect(const Mat &img, float threshold, float scales)
+{
+    //结果已映射回原图，保存在detectFaces
+    detect(img, detectFaces, threshold);
 
-    //post = (double)getTickCount() - post;
-    //std::cout << "post compute time :" << post*1000.0 / cv::getTickFrequency() << " ms \n";
+//    vector<FaceDetectInfo> &faceInfo = detectFaces;
 //    cv::Mat src = img.clone();
 //    for(size_t i = 0; i < faceInfo.size(); i++) {
-//        cv::Rect rect = cv::Rect(cv::Point2f(faceInfo[i].rect.x1 * scale, faceInfo[i].rect.y1 * scale),
-//                                 cv::Point2f(faceInfo[i].rect.x2 * scale, faceInfo[i].rect.y2 * scale));
+//        cv::Rect rect = cv::Rect(cv::Point2f(faceInfo[i].rect.x1, faceInfo[i].rect.y1),
+//                                 cv::Point2f(faceInfo[i].rect.x2, faceInfo[i].rect.y2));
 
 //        cv::rectangle(src, rect, Scalar(0, 0, 255), 2);
 
 //        for(size_t j = 0; j < 5; j++) {
-//            cv::Point2f pt = cv::Point2f(faceInfo[i].pts.x[j] * scale, faceInfo[i].pts.y[j] * scale);
+//            cv::Point2f pt = cv::Point2f(faceInfo[i].pts.x[j], faceInfo[i].pts.y[j]);
 //            cv::circle(src, pt, 1, Scalar(0, 255, 0), 2);
 //        }
 //    }
@@ -746,24 +885,198 @@ void RetinaFace::detect(const Mat &img, float threshold, float scales)
 //    waitKey(0);
 }
 
-void RetinaFace::detectBatchImages(vector<cv::Mat> imgs, float threshold)
+void RetinaFace::detect(const Mat &img, vector<FaceDetectInfo> &faces, float threshold)
 {
-    //预处理
-    int inputW = trtNet->getNetWidth();
-    int inputH = trtNet->getNetHeight();
+    //整张图当作一个区域，映射和转回原始方向与ROI检测相同
+    detect(img, cv::Rect(0, 0, img.cols, img.rows), faces, threshold);
+}
+
+//网络输入坐标映射回整帧：乘以缩小倍数，加上子图在整帧中的位置
+static void mapToFrame(vector<FaceDetectInfo> &faceInfo, float scale, int x, int y)
+{
+    for(size_t i = 0; i < faceInfo.size(); i++) {
+        anchor_box &rect = faceInfo[i].rect;
+        rect.x1 = rect.x1 * scale + x;
+        rect.y1 = rect.y1 * scale + y;
+        rect.x2 = rect.x2 * scale + x;
+        rect.y2 = rect.y2 * scale + y;
+        for(size_t j = 0; j < 5; j++) {
+            faceInfo[i].pts.x[j] = faceInfo[i].pts.x[j] * scale + x;
+            faceInfo[i].pts.y[j] = faceInfo[i].pts.y[j] * scale + y;
+        }
+    }
+}
+
+vector<FaceDetectInfo> RetinaFace::detect(const Mat &frame, const cv::Rect &roi, float threshold)
+{
+    vector<FaceDetectInfo> faceInfo;
+    detect(frame, roi, faceInfo, threshold);
+    return faceInfo;
+}
+
+void RetinaFace::detect(const Mat &frame, const cv::Rect &roi, vector<FaceDetectInfo> &faces, float threshold)
+{
+    faces.clear();
+    cv::Rect area = roi & cv::Rect(0, 0, frame.cols, frame.rows);
+    if(area.width <= 0 || area.height <= 0) {
+        return;
+    }
+
+    //子图与整帧共用数据，预处理按行间隔原地读取
+    float scale = preprocess(frame(area));
+    if(scale == 0) {
+        return;
+    }
+
+    inferNet->doInference(1);
+    postProcess(inferNet->getNetWidth(), inferNet->getNetHeight(), threshold, faces);
+    if(orientation.rotation == 0 && !orientation.mirror) {
+        mapToFrame(faces, scale, area.x, area.y);
+    }
+    else {
+        //先回到转正后的子图坐标，再转回原始方向，最后加上子图位置
+        mapToFrame(faces, scale, 0, 0);
+        unorientFaces(faces, area.width, area.height);
+        mapToFrame(faces, 1, area.x, area.y);
+    }
+}
+
+//分块的起点，步长为tile - overlap，最后一块贴齐图像边缘
+static vector<int> tileOffsets(int size, int tile, int overlap)
+{
+    vector<int> offsets;
+    int step = std::max(1, tile - overlap);
+    for(int x = 0; ; x += step) {
+        if(x + tile >= size) {
+            offsets.push_back(std::max(0, size - tile));
+            break;
+        }
+        offsets.push_back(x);
+    }
+    return offsets;
+}
+
+//a与b的交集占a的比例
+static float coveredRatio(const anchor_box &a, const anchor_box &b)
+{
+    float w = std::min(a.x2, b.x2) - std::max(a.x1, b.x1) + 1;
+    float h = std::min(a.y2, b.y2) - std::max(a.y1, b.y1) + 1;
+    if(w <= 0 || h <= 0) {
+        return 0;
+    }
+    return w * h / ((a.x2 - a.x1 + 1) * (a.y2 - a.y1 + 1));
+}
+
+vector<FaceDetectInfo> RetinaFace::detectTiles(const Mat &img, const TileConfig &config, float threshold)
+{
+#ifdef USE_CPU
+    selectInputBucket(0, 0);
+#endif
+    vector<FaceDetectInfo> faceInfo;
+    if(img.empty()) {
+        return faceInfo;
+    }
+
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+    int tileW = config.tileWidth > 0 ? config.tileWidth : inputW;
+    int tileH = config.tileHeight > 0 ? config.tileHeight : inputH;
+    int overlap = std::max(0, config.overlap);
+    //重叠不小于块时步长为0，块数不受控制
+    if(overlap >= std::min(tileW, tileH)) {
+        printf("tile overlap %d must be smaller than the tile %dx%d, use %d.\n",
+               overlap, tileW, tileH, std::min(tileW, tileH) / 2);
+        overlap = std::min(tileW, tileH) / 2;
+    }
+    tileW = std::min(tileW, img.cols);
+    tileH = std::min(tileH, img.rows);
+    int maxBatch = inferNet->getMaxBatchSize();
+    int batchSize = config.batchSize > 0 ? std::min(config.batchSize, maxBatch) : maxBatch;
+
+    vector<cv::Rect> tiles;
+    vector<int> xs = tileOffsets(img.cols, tileW, overlap);
+    vector<int> ys = tileOffsets(img.rows, tileH, overlap);
+    for(size_t y = 0; y < ys.size(); y++) {
+        for(size_t x = 0; x < xs.size(); x++) {
+            tiles.push_back(cv::Rect(xs[x], ys[y], tileW, tileH));
+        }
+    }
+
+    vector<FaceDetectInfo> tileFaces;
+    vector<FaceDetectInfo> truncated;
+    for(size_t first = 0; first < tiles.size(); first += batchSize) {
+        int count = std::min(tiles.size() - first, (size_t)batchSize);
+
+        //每块都是原图的子图，不拷贝
+        vector<Mat> views;
+        for(int i = 0; i < count; i++) {
+            views.push_back(img(tiles[first + i]));
+        }
+        vector<float> scales = preprocessBatch(views);
+        if(scales.empty()) {
+            return faceInfo;
+        }
+        inferNet->doInference(count);
+
+        for(int i = 0; i < count; i++) {
+            const cv::Rect &tile = tiles[first + i];
+            postProcess(inputW, inputH, threshold, tileFaces, i);
+            mapToFrame(tileFaces, scales[i], tile.x, tile.y);
+
+            //贴着块内侧边缘的框是被接缝截断的人脸，完整的那个一般由相邻块检测，先放到一边
+            //块缩小后框只裁剪到网络输入，内容边缘映射回来会差几个像素，容差按缩小倍数放大
+            float margin = std::ceil(scales[i]) * 2;
+            for(size_t j = 0; j < tileFaces.size(); j++) {
+                const anchor_box &rect = tileFaces[j].rect;
+                if((tile.x > 0 && rect.x1 <= tile.x + margin) || (tile.y > 0 && rect.y1 <= tile.y + margin) ||
+                   (tile.x + tile.width < img.cols && rect.x2 >= tile.x + tile.width - margin) ||
+                   (tile.y + tile.height < img.rows && rect.y2 >= tile.y + tile.height - margin)) {
+                    truncated.push_back(tileFaces[j]);
+                    continue;
+                }
+                faceInfo.push_back(tileFaces[j]);
+            }
+        }
+    }
+
+    //比重叠还大的人脸在每一块里都被截断，没有块包含完整的它；这时保留截断框中最大的一个
+    std::sort(truncated.begin(), truncated.end(), [](const FaceDetectInfo &a, const FaceDetectInfo &b) {
+        return (a.rect.x2 - a.rect.x1) * (a.rect.y2 - a.rect.y1) > (b.rect.x2 - b.rect.x1) * (b.rect.y2 - b.rect.y1);
+    });
+    for(size_t i = 0; i < truncated.size(); i++) {
+        //截断框是人脸的一部分，大半落在已有的框里就是同一张脸
+        bool covered = false;
+        for(size_t j = 0; j < faceInfo.size() && !covered; j++) {
+            covered = coveredRatio(truncated[i].rect, faceInfo[j].rect) > 0.5;
+        }
+        if(!covered) {
+            faceInfo.push_back(truncated[i]);
+        }
+    }
+
+    //重叠区域两块都检测到的人脸用一次nms合并
+    nmsInPlace(faceInfo, nms_threshold);
+
+    return faceInfo;
+}
+
+vector<float> RetinaFace::preprocessBatch(vector<cv::Mat> imgs)
+{
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
 
     vector<float> scales(imgs.size(), 1.0);
 
-    double t2 = (double)getTickCount();
 #ifdef USE_NPP
-    float *inputData = (float*)trtNet->getBuffer(0);
+    float *inputData = (float*)inferNet->getBuffer(0);
     for(size_t i = 0; i < imgs.size(); i++) {
         float sw = 1.0 * imgs[i].cols / inputW;
         float sh = 1.0 * imgs[i].rows / inputH;
         scales[i] = sw > sh ? sw : sh;
         scales[i] = scales[i] > 1.0 ? scales[i] : 1.0;
 
-        cudaMemcpy(_gpu_data8u.data, imgs[i].data, imgs[i].cols * imgs[i].rows * 3, cudaMemcpyHostToDevice);
+        cudaMemcpy2D(_gpu_data8u.data, imgs[i].cols * 3, imgs[i].data, imgs[i].step, imgs[i].cols * 3, imgs[i].rows,
+                     cudaMemcpyHostToDevice);
         _gpu_data8u.width = imgs[i].cols;
         _gpu_data8u.height = imgs[i].rows;
 
@@ -781,6 +1094,25 @@ void RetinaFace::detectBatchImages(vector<cv::Mat> imgs, float threshold)
         inputData += inputW * inputH * 3;
     }
     cudaDeviceSynchronize();
+#elif defined(USE_CPU)
+    //同preprocess，类型不对时不写入网络输入，返回空的缩放系数
+    for(size_t i = 0; i < imgs.size(); i++) {
+        if(imgs[i].type() != CV_8UC3 && imgs[i].type() != CV_8UC1) {
+            printf("cpu detect needs BGR8 or gray8 images, image %d is not.\n", (int)i);
+            return vector<float>();
+        }
+    }
+    //每张图写入自己的位置，互不相关，交给推理线程池并行
+    parallelFor(inferNet->getThreadPool(), imgs.size(), [&](int begin, int end, int) {
+        for(int i = begin; i < end; i++) {
+            float sw = 1.0 * imgs[i].cols / inputW;
+            float sh = 1.0 * imgs[i].rows / inputH;
+            scales[i] = sw > sh ? sw : sh;
+            scales[i] = scales[i] > 1.0 ? scales[i] : 1.0;
+
+            preprocessCpu(imgs[i], scales[i], i);
+        }
+    });
 #else
     for(size_t i = 0; i < imgs.size(); i++) {
         float sw = 1.0 * imgs[i].cols / inputW;
@@ -815,7 +1147,7 @@ void RetinaFace::detectBatchImages(vector<cv::Mat> imgs, float threshold)
     float* input_data = (float *)cpuBuffers;
     for(size_t j = 0; j < imgs.size(); j++) {
         vector<Mat> input_chans;
-        for (int i = 0; i < trtNet->getChannel(); ++i) {
+        for (int i = 0; i < inferNet->getChannel(); ++i) {
             Mat channel(inputH, inputW, CV_32FC1, input_data);
             input_chans.push_back(channel);
             input_data += inputW * inputH;
@@ -830,91 +1162,197 @@ void RetinaFace::detectBatchImages(vector<cv::Mat> imgs, float threshold)
         split(imgs[j], input_channels[j]);
     }
     
-    float *inputData = (float*)trtNet->getBuffer(0);
+    float *inputData = (float*)inferNet->getBuffer(0);
     cudaMemcpy(inputData, cpuBuffers, imgs.size() * inputW * inputH * 3 * sizeof(float), cudaMemcpyHostToDevice);
 #endif
+
+    return scales;
+}
+
+//翻转图像上的检测结果映射回未翻转的坐标，width为翻转区域的宽
+//左右眼、左右嘴角互换，与insightface的flip测试一致
+static void unflipFaces(vector<FaceDetectInfo> &faceInfo, int width)
+{
+    for(size_t i = 0; i < faceInfo.size(); i++) {
+        anchor_box &rect = faceInfo[i].rect;
+        float x1 = rect.x1;
+        rect.x1 = width - 1 - rect.x2;
+        rect.x2 = width - 1 - x1;
+
+        FacePts pts = faceInfo[i].pts;
+        static const int order[5] = {1, 0, 2, 4, 3};
+        for(size_t j = 0; j < 5; j++) {
+            faceInfo[i].pts.x[j] = width - 1 - pts.x[order[j]];
+            faceInfo[i].pts.y[j] = pts.y[order[j]];
+        }
+    }
+}
+
+#ifdef USE_CPU
+void RetinaFace::preprocessPyramidCpu(const Mat &img, const vector<float> &shrink, bool flip, vector<int> &levelW)
+{
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+    size_t planeSize = (size_t)inputW * inputH;
+    int perLevel = flip ? 2 : 1;
+
+    for(size_t k = 0; k < shrink.size(); k++) {
+        int slot = k * perLevel;
+        int width, height;
+        letterboxSize(img.cols, img.rows, shrink[k], inputW, inputH, width, height);
+        levelW[k] = width;
+
+        if(k == 0 || cpuChannelsU8 == 0) {
+            preprocessCpu(img, shrink[k], slot);
+        }
+        else {
+            //由上一层已经缩小的图像再缩小，整个金字塔只读一次原图
+            int prevW, prevH;
+            letterboxSize(img.cols, img.rows, shrink[k - 1], inputW, inputH, prevW, prevH);
+            int type = cpuChannelsU8 == 1 ? CV_8UC1 : CV_8UC3;
+            Mat prev(prevH, prevW, type, cpuBuffersU8 + (slot - perLevel) * planeSize * cpuChannelsU8,
+                     inputW * cpuChannelsU8);
+            preprocessCpu(prev, shrink[k] / shrink[k - 1], slot);
+        }
+
+        if(flip) {
+            if(cpuChannelsU8 > 0) {
+                flipLetterbox(cpuBuffersU8 + slot * planeSize * cpuChannelsU8,
+                              cpuBuffersU8 + (slot + 1) * planeSize * cpuChannelsU8,
+                              width, height, cpuChannelsU8, inputW, inputH);
+            }
+            else {
+                flipLetterboxPlanar(cpuBuffers + slot * planeSize * 3, cpuBuffers + (slot + 1) * planeSize * 3,
+                                    width, height, inputW, inputH);
+            }
+        }
+    }
+}
+#endif
+
+vector<FaceDetectInfo> RetinaFace::detectPyramid(const Mat &img, const vector<float> &scales, float threshold, bool flip)
+{
+#ifdef USE_CPU
+    selectInputBucket(0, 0);
+#endif
+    vector<FaceDetectInfo> faceInfo;
+    if(img.empty()) {
+        return faceInfo;
+    }
+
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+    float sw = 1.0 * img.cols / inputW;
+    float sh = 1.0 * img.rows / inputH;
+    float base = sw > sh ? sw : sh;
+    base = base > 1.0 ? base : 1.0;
+
+    //从大到小排列，每层由上一层缩小；大于1的放不进网络输入，按1处理
+    vector<float> factors;
+    for(size_t i = 0; i < scales.size(); i++) {
+        if(scales[i] > 0) {
+            factors.push_back(std::min(scales[i], 1.0f));
+        }
+    }
+    std::sort(factors.begin(), factors.end(), std::greater<float>());
+    factors.erase(std::unique(factors.begin(), factors.end()), factors.end());
+
+    int perLevel = flip ? 2 : 1;
+    size_t maxLevels = inferNet->getMaxBatchSize() / perLevel;
+    if(factors.size() > maxLevels) {
+        printf("pyramid has %zu levels, only the largest %zu fit in one batch.\n", factors.size(), maxLevels);
+        factors.resize(maxLevels);
+    }
+    if(factors.empty()) {
+        return faceInfo;
+    }
+
+    //每层相对原图的缩小倍数，和网络输入中图像区域的宽(翻转用)
+    vector<float> shrink(factors.size());
+    vector<int> levelW(factors.size());
+    for(size_t k = 0; k < factors.size(); k++) {
+        shrink[k] = base / factors[k];
+    }
+
+#ifdef USE_CPU
+    if(img.type() != CV_8UC3 && img.type() != CV_8UC1) {
+        printf("cpu detect needs a BGR8 or gray8 image.\n");
+        return faceInfo;
+    }
+    preprocessPyramidCpu(img, shrink, flip, levelW);
+#else
+    vector<Mat> levels;
+    for(size_t k = 0; k < factors.size(); k++) {
+        Mat level;
+        const Mat &prev = k == 0 ? img : levels[(k - 1) * perLevel];
+        float relative = k == 0 ? shrink[0] : shrink[k] / shrink[k - 1];
+        if(relative > 1) {
+            cv::resize(prev, level, cv::Size(), 1 / relative, 1 / relative);
+        }
+        else {
+            level = prev;
+        }
+        levelW[k] = level.cols;
+        levels.push_back(level);
+        if(flip) {
+            Mat flipped;
+            cv::flip(level, flipped, 1);
+            levels.push_back(flipped);
+        }
+    }
+    preprocessBatch(levels);
+#endif
+
+    //所有层一次推理
+    inferNet->doInference(factors.size() * perLevel);
+
+    vector<FaceDetectInfo> levelFaces;
+    for(size_t k = 0; k < factors.size(); k++) {
+        for(int f = 0; f < perLevel; f++) {
+            postProcess(inputW, inputH, threshold, levelFaces, k * perLevel + f);
+            if(f == 1) {
+                unflipFaces(levelFaces, levelW[k]);
+            }
+            mapToFrame(levelFaces, shrink[k], 0, 0);
+            faceInfo.insert(faceInfo.end(), levelFaces.begin(), levelFaces.end());
+        }
+    }
+
+    //各层和翻转的结果一起nms
+    nmsInPlace(faceInfo, nms_threshold);
+
+    return faceInfo;
+}
+
+void RetinaFace::detectBatchImages(vector<cv::Mat> imgs, float threshold)
+{
+#ifdef USE_CPU
+    //批量里各张图共用一个输入尺寸
+    selectInputBucket(0, 0);
+#endif
+    //预处理
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+
+    double t2 = (double)getTickCount();
+    vector<float> scales = preprocessBatch(imgs);
+    if(scales.size() != imgs.size()) {
+        return;
+    }
     t2 = (double)getTickCount() - t2;
     //std::cout << "pre process compute time :" << t2*1000.0 / cv::getTickFrequency() << " ms \n";
 
     //LOG(INFO) << "Start net_->Forward()";
     double t1 = (double)getTickCount();
-    trtNet->doInference(imgs.size());
+    inferNet->doInference(imgs.size());
     t1 = (double)getTickCount() - t1;
     //std::cout << "doInference compute time :" << t1*1000.0 / cv::getTickFrequency() << " ms \n";
     //LOG(INFO) << "Done net_->Forward()";
 
     double post = (double)getTickCount();
-    string name_bbox = "face_rpn_bbox_pred_";
-    string name_score ="face_rpn_cls_prob_reshape_";
-    string name_landmark ="face_rpn_landmark_pred_";
-
-    vector<vector<FaceDetectInfo>> faceInfos;
+    vector<vector<FaceDetectInfo>> faceInfos(imgs.size());
     for(size_t batch = 0; batch < imgs.size(); batch++) {
-        vector<FaceDetectInfo> faceInfo;
-        for(size_t i = 0; i < _feat_stride_fpn.size(); i++) {
-            string key = "stride" + std::to_string(_feat_stride_fpn[i]);
-            string str = name_score + key;
-            TrtBlob* score_blob = trtNet->blob_by_name(str);
-            std::vector<float> score = score_blob->result[batch];
-            std::vector<float>::iterator begin = score.begin() + score.size() / 2;
-            std::vector<float>::iterator end = score.end();
-            score = std::vector<float>(begin, end);
-
-            str = name_bbox + key;
-            TrtBlob* bbox_blob = trtNet->blob_by_name(str);
-            std::vector<float> bbox_delta = bbox_blob->result[batch];
-
-            str = name_landmark + key;
-            TrtBlob* landmark_blob = trtNet->blob_by_name(str);
-            std::vector<float> landmark_delta = landmark_blob->result[batch];
-
-            int width = score_blob->outputDims.w();
-            int height = score_blob->outputDims.h();
-            size_t count = width * height;
-            size_t num_anchor = _num_anchors[key];
-
-            for(size_t num = 0; num < num_anchor; num++) {
-                for(size_t j = 0; j < count; j++) {
-                    //置信度小于阈值跳过
-                    float conf = score[j + count * num];
-                    if(conf <= threshold) {
-                        continue;
-                    }
-
-                    cv::Vec4f regress;
-                    float dx = bbox_delta[j + count * (0 + num * 4)];
-                    float dy = bbox_delta[j + count * (1 + num * 4)];
-                    float dw = bbox_delta[j + count * (2 + num * 4)];
-                    float dh = bbox_delta[j + count * (3 + num * 4)];
-                    regress = cv::Vec4f(dx, dy, dw, dh);
-
-                    //回归人脸框
-                    anchor_box rect = bbox_pred(_anchors[key][j + count * num], regress);
-                    //越界处理
-                    clip_boxes(rect, inputW, inputH);
-
-                    FacePts pts;
-                    for(size_t k = 0; k < 5; k++) {
-                        pts.x[k] = landmark_delta[j + count * (num * 10 + k * 2)];
-                        pts.y[k] = landmark_delta[j + count * (num * 10 + k * 2 + 1)];
-                    }
-                    //回归人脸关键点
-                    FacePts landmarks = landmark_pred(_anchors[key][j + count * num], pts);
-
-                    FaceDetectInfo tmp;
-                    tmp.score = conf;
-                    tmp.rect = rect;
-                    tmp.pts = landmarks;
-                    faceInfo.push_back(tmp);
-                }
-            }  
-        }
-
-        faceInfos.push_back(faceInfo);
-    }
-    //排序nms
-    for(size_t batch = 0; batch < imgs.size(); batch++){
-        faceInfos[batch] = nms(faceInfos[batch], nms_threshold);
+        postProcess(inputW, inputH, threshold, faceInfos[batch], batch);
     }
 
     post = (double)getTickCount() - post;
@@ -991,84 +1429,20 @@ void RetinaFace::detect(Mat img, float threshold, float scales)
     //LOG(INFO) << "Done net_->Forward()";
 
     double post = (double)getTickCount();
-    string name_bbox = "face_rpn_bbox_pred_";
-    string name_score ="face_rpn_cls_prob_reshape_";
-    string name_landmark ="face_rpn_landmark_pred_";
 
     vector<FaceDetectInfo> faceInfo;
-    for(size_t i = 0; i < _feat_stride_fpn.size(); i++) {
-///////////////////////////////////////////////
-        double s1 = (double)getTickCount();
-///////////////////////////////////////////////
-        string key = "stride" + std::to_string(_feat_stride_fpn[i]);
-        int stride = _feat_stride_fpn[i];
-
-        string str = name_score + key;
-        const boost::shared_ptr<Blob<float>> score_blob = Net_->blob_by_name(str);
-        const float* scoreB = score_blob->cpu_data() + score_blob->count() / 2;
-        const float* scoreE = scoreB + score_blob->count() / 2;
-        std::vector<float> score = std::vector<float>(scoreB, scoreE);
-
-        str = name_bbox + key;
-        const boost::shared_ptr<Blob<float>> bbox_blob = Net_->blob_by_name(str);
-        const float* bboxB = bbox_blob->cpu_data();
-        const float* bboxE = bboxB + bbox_blob->count();
-        std::vector<float> bbox_delta = std::vector<float>(bboxB, bboxE);
-
-        str = name_landmark + key;
-        const boost::shared_ptr<Blob<float>> landmark_blob = Net_->blob_by_name(str);
-        const float* landmarkB = landmark_blob->cpu_data();
-        const float* landmarkE = landmarkB + landmark_blob->count();
-        std::vector<float> landmark_delta = std::vector<float>(landmarkB, landmarkE);
+    for(size_t i = 0; i < _levels.size(); i++) {
+        const FpnLevel &level = _levels[i];
+
+        //直接读取blob的数据，不拷贝
+        const Blob<float> *score_blob = level.score.get();
+        const float* score = score_blob->cpu_data() + score_blob->count() / 2;
+        const float* bbox_delta = level.bbox->cpu_data();
+        const float* landmark_delta = level.landmark->cpu_data();
 
         int width = score_blob->width();
         int height = score_blob->height();
-        size_t count = width * height;
-        size_t num_anchor = _num_anchors[key];
-
-///////////////////////////////////////////////
-        s1 = (double)getTickCount() - s1;
-        std::cout << "s1 compute time :" << s1*1000.0 / cv::getTickFrequency() << " ms \n";
-///////////////////////////////////////////////
-
-        //存储顺序 h * w * num_anchor
-        vector<anchor_box> anchors = anchors_plane(height, width, stride, _anchors_fpn[key]);
-
-        for(size_t num = 0; num < num_anchor; num++) {
-            for(size_t j = 0; j < count; j++) {
-                //置信度小于阈值跳过
-                float conf = score[j + count * num];
-                if(conf <= threshold) {
-                    continue;
-                }
-
-                cv::Vec4f regress;
-                float dx = bbox_delta[j + count * (0 + num * 4)];
-                float dy = bbox_delta[j + count * (1 + num * 4)];
-                float dw = bbox_delta[j + count * (2 + num * 4)];
-                float dh = bbox_delta[j + count * (3 + num * 4)];
-                regress = cv::Vec4f(dx, dy, dw, dh);
-
-                //回归人脸框
-                anchor_box rect = bbox_pred(anchors[j + count * num], regress);
-                //越界处理
-                clip_boxes(rect, ws, hs);
-
-                FacePts pts;
-                for(size_t k = 0; k < 5; k++) {
-                    pts.x[k] = landmark_delta[j + count * (num * 10 + k * 2)];
-                    pts.y[k] = landmark_delta[j + count * (num * 10 + k * 2 + 1)];
-                }
-                //回归人脸关键点
-                FacePts landmarks = landmark_pred(anchors[j + count * num], pts);
-
-                FaceDetectInfo tmp;
-                tmp.score = conf;
-                tmp.rect = rect;
-                tmp.pts = landmarks;
-                faceInfo.push_back(tmp);
-            }
-        }
+        decodeLevel(level, score, bbox_delta, landmark_delta, width, height, ws, hs, threshold, faceInfo);
     }
 
     //排序nms
@@ -1092,3 +1466,88 @@ void RetinaFace::detect(Mat img, float threshold, float scales)
     waitKey(0);
 }
 #endif
+
+void RetinaFace::detect(const YUV420Frame &frame, vector<FaceDetectInfo> &faces, float threshold)
+{
+    faces.clear();
+    if(frame.y == NULL || frame.u == NULL || frame.width <= 0 || frame.height <= 0) {
+        return;
+    }
+    if(frame.format == kYUV420I420 && frame.v == NULL) {
+        printf("I420 frame needs the v plane.\n");
+        return;
+    }
+
+#ifdef USE_CPU
+    CpuOrientation cpuOrientation(orientation.rotation, orientation.mirror);
+    int width, height;
+    orientedSize(frame.width, frame.height, cpuOrientation, width, height);
+    selectInputBucket(width, height);
+    int inputW = inferNet->getNetWidth();
+    int inputH = inferNet->getNetHeight();
+
+    float sw = 1.0 * width / inputW;
+    float sh = 1.0 * height / inputH;
+    float scale = sw > sh ? sw : sh;
+    scale = scale > 1.0 ? scale : 1.0;
+
+    CpuYUV420Image image;
+    image.y = frame.y;
+    image.u = frame.u;
+    image.v = frame.format == kYUV420NV12 ? frame.u + 1 : frame.v;
+    image.yStride = frame.yStride;
+    image.uvStride = frame.uvStride;
+    image.uvStep = frame.format == kYUV420NV12 ? 2 : 1;
+    image.width = frame.width;
+    image.height = frame.height;
+
+    //YUV转RGB、缩放、补边、归一化一次完成；单通道输入只读取亮度平面
+    if(cpuChannelsU8 == 1) {
+        letterboxYUV420ToGray(image, scale, cpuBuffersU8, inputW, inputH, cpuOrientation);
+    }
+    else if(cpuChannelsU8 == 3) {
+        letterboxYUV420ToBGR(image, scale, cpuBuffersU8, inputW, inputH, cpuOrientation);
+    }
+    else {
+        letterboxYUV420ToPlanar(image, scale, cpuBuffers, inputW, inputH, normalizeParam, cpuOrientation);
+    }
+
+    inferNet->doInference(1);
+    postProcess(inputW, inputH, threshold, faces);
+    //先回到转正后的帧坐标，再转回原始方向
+    mapToFrame(faces, scale, 0, 0);
+    unorientFaces(faces, frame.width, frame.height);
+#else
+    //cvtColor的YUV420布局要求宽高都是偶数，奇数时色度行放不进width字节
+    if(frame.width % 2 != 0 || frame.height % 2 != 0) {
+        printf("YUV420 frame %dx%d must have even width and height.\n", frame.width, frame.height);
+        return;
+    }
+
+    //拼成cvtColor需要的连续布局
+    int chromaH = frame.height / 2;
+    int chromaW = frame.width / 2;
+    Mat yuv(frame.height + chromaH, frame.width, CV_8UC1);
+    for(int r = 0; r < frame.height; r++) {
+        memcpy(yuv.ptr(r), frame.y + r * frame.yStride, frame.width);
+    }
+    uchar *chroma = yuv.ptr(frame.height);
+    for(int r = 0; r < chromaH; r++) {
+        if(frame.format == kYUV420NV12) {
+            memcpy(chroma + r * frame.width, frame.u + r * frame.uvStride, frame.width);
+        }
+        else {
+            memcpy(chroma + r * chromaW, frame.u + r * frame.uvStride, chromaW);
+            memcpy(chroma + (chromaH + r) * chromaW, frame.v + r * frame.uvStride, chromaW);
+        }
+    }
+
+    Mat bgr;
+    cvtColor(yuv, bgr, frame.format == kYUV420NV12 ? cv::COLOR_YUV2BGR_NV12 : cv::COLOR_YUV2BGR_I420);
+#ifdef USE_TENSORRT
+    detect(bgr, faces, threshold);
+#else
+    detect(bgr, threshold);
+#endif
+#endif
+}
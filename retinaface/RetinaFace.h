@@ -4,13 +4,31 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <stdint.h>
 #include <opencv2/opencv.hpp>
+#include "facedecode.h"
+#ifdef USE_CPU
+#include "cpu/cpuretinafacenet.h"
+#include "cpu/cpupreprocess.h"
+#else
 #include <caffe/caffe.hpp>
 #include "tensorrt/trtretinafacenet.h"
+#endif
 
 using namespace cv;
 using namespace std;
+#ifndef USE_CPU
 using namespace caffe;
+#endif
+
+//tensorRT和CPU推理后端接口一致，后处理共用一份代码
+#ifdef USE_CPU
+typedef CpuRetinaFaceNet RetinaFaceNet;
+typedef CpuBlob RetinaFaceBlob;
+#else
+typedef TrtRetinaFaceNet RetinaFaceNet;
+typedef TrtBlob RetinaFaceBlob;
+#endif
 
 struct anchor_win
 {
@@ -41,6 +59,34 @@ struct FaceDetectInfo
     FacePts pts;
 };
 
+//相机输出的YUV420帧，色度平面宽高各为一半
+enum YUV420Format
+{
+    kYUV420NV12,    //Y平面 + UV交错平面，u指向UV平面，v不用
+    kYUV420I420     //Y、U、V三个平面
+};
+
+struct YUV420Frame
+{
+    YUV420Format format;
+    const uint8_t *y;
+    const uint8_t *u;
+    const uint8_t *v;
+    int yStride;        //每行字节数
+    int uvStride;
+    int width;
+    int height;
+};
+
+//相机安装方向：把帧顺时针旋转rotation度(0/90/180/270，同cv::rotate)，再按mirror水平镜像，得到正向图像
+struct FrameOrientation
+{
+    int rotation;
+    bool mirror;
+
+    FrameOrientation(int rotation = 0, bool mirror = false) : rotation(rotation), mirror(mirror) {}
+};
+
 struct anchor_cfg
 {
 public:
@@ -60,32 +106,210 @@ public:
     }
 };
 
+//分块检测参数
+struct TileConfig
+{
+    int tileWidth;      //块的宽高，0表示网络输入大小；比网络输入大时块会被缩小
+    int tileHeight;
+    int overlap;        //相邻块重叠的像素，应大于要检测的最大人脸；不小于块的宽高时按块的一半处理
+    int batchSize;      //每次推理的块数，0表示网络的maxBatchSize
+
+    TileConfig()
+    {
+        tileWidth = 0;
+        tileHeight = 0;
+        overlap = 128;
+        batchSize = 0;
+    }
+};
+
 class RetinaFace
 {
 public:
     RetinaFace(string &model, string network = "net3", float nms = 0.4);
+#ifdef USE_CPU
+   /**
+    *	@brief  RetinaFace	            指定推理线程和NUMA节点
+    *   @param  affinity		        线程数、绑定的cpu、内存节点
+    *   @param  grayInput		        输入为单通道(灰度/红外)图像，第一层卷积的权重按输入通道求和，
+    *                                   直接读取一个平面，结果与复制成三通道相同
+    *   @return
+    *
+    *   @note                           grayInput时detect传入CV_8UC1图像，YUV420帧只读取亮度平面
+    */
+    RetinaFace(string &model, const CpuAffinity &affinity, string network = "net3", float nms = 0.4,
+               bool grayInput = false);
+
+   /**
+    *	@brief  setInputBuckets	        预设几种网络输入尺寸，每张图选最贴合的一种，少算补边
+    *   @param  sizes		            如{320x320, 384x224, 224x384, 640x352}，宽高向上取整到32的倍数，不超过最大输入
+    *   @return
+    *
+    *   @note                           anchor在解码时按位置现算，与输入尺寸无关；单张检测(detect、ROI、YUV420)按图选择，
+    *                                   批量、分块、金字塔使用最大尺寸；传空列表恢复固定尺寸
+    */
+    void setInputBuckets(const vector<cv::Size> &sizes);
+
+   /**
+    *	@brief  createPerNumaNode	    每个NUMA节点创建一个实例，线程绑定到该节点的cpu，内存分配在该节点
+    *   @return                         按节点号顺序，每个有cpu的节点一个实例；实例用new创建，所有权交给调用者，
+    *                                   用完后逐个delete
+    *
+    *   @note                           多路服务器上按节点分发请求，避免跨节点访问内存
+    */
+    static vector<RetinaFace *> createPerNumaNode(string &model, string network = "net3", float nms = 0.4);
+#endif
     ~RetinaFace();
 
+   /**
+    *	@brief  readImage	            读取图片，JPEG按网络输入大小在解码时直接缩小1/2、1/4或1/8
+    *   @param  file		            图片路径
+    *   @param  decodeScale		        原图大小 / 返回图像大小，检测框乘以它映射回原图
+    *   @return                         BGR图像，失败时为空
+    *
+    *   @note                           解码后的图像不小于网络输入，detect的缩放只剩最后一步
+    *                                   非JPEG图片按原大小读取，decodeScale为1
+    */
+    Mat readImage(const string &file, float &decodeScale);
+
+   /**
+    *	@brief  setOrientation	        设置输入帧的方向，之后的单张检测(detect、ROI、YUV420)按转正后的图像检测
+    *   @param  orientation		        旋转角度(0/90/180/270)和镜像
+    *   @return
+    *
+    *   @note                           CPU后端在缩放取样时完成旋转和镜像，不需要先cv::rotate；其他后端先转正再预处理
+    *                                   检测框和关键点映射回原始帧的坐标；镜像时左右眼、左右嘴角互换，
+    *                                   与detectPyramid的翻转一致，关键点顺序与直接检测原始帧相同
+    *                                   批量、分块、金字塔检测不受影响
+    */
+    void setOrientation(const FrameOrientation &orientation);
+
     void detectBatchImages(vector<cv::Mat> imgs, float threshold=0.5);
     void detect(const Mat &img, float threshold=0.5, float scales=1.0);
+
+   /**
+    *	@brief  detect	                检测NV12/I420相机帧，不需要先转成BGR
+    *   @param  frame		            YUV420帧，各平面可以带行间隔；I420需要u和v，NV12只用u
+    *   @param  faces		            输出，人脸框和关键点已映射回帧的坐标(按setOrientation转回原始方向)；
+    *                                   原有内容被替换，反复传入同一个vector时复用它的容量
+    *   @param  threshold		        置信度阈值
+    *   @return
+    *
+    *   @note                           CPU后端把YUV转RGB合并进缩放，只转换缩小后的像素；其他后端先cvtColor，
+    *                                   要求宽高都是偶数
+    *                                   caffe后端的detect只显示结果，faces为空
+    */
+    void detect(const YUV420Frame &frame, vector<FaceDetectInfo> &faces, float threshold=0.5);
+
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+   /**
+    *	@brief  detect	                检测一张图像
+    *   @param  img		                图像，本身也可以是带行间隔的子图
+    *   @param  faces		            输出，人脸框和关键点已映射回img的坐标；原有内容被替换，反复传入同一个vector时复用它的容量
+    *   @param  threshold		        置信度阈值
+    *   @return
+    *
+    *   @note                           按setOrientation设置的方向检测，结果映射回原始方向
+    */
+    void detect(const Mat &img, vector<FaceDetectInfo> &faces, float threshold=0.5);
+
+   /**
+    *	@brief  detect	                只检测整帧中的一块区域，按行间隔原地读取，不需要先clone
+    *   @param  frame		            整帧图像，本身也可以是带行间隔的子图
+    *   @param  roi		                检测区域，超出图像的部分被裁掉
+    *   @param  threshold		        置信度阈值
+    *   @return                         人脸框和关键点，已映射回整帧坐标
+    *
+    *   @note                           适合只关心固定区域的场景(如门口相机)；YUV420帧的区域直接偏移平面指针即可
+    */
+    vector<FaceDetectInfo> detect(const Mat &frame, const cv::Rect &roi, float threshold=0.5);
+
+   /**
+    *	@brief  detect	                同上，结果写入faces
+    *   @param  faces		            输出，原有内容被替换；反复传入同一个vector时复用它的容量
+    *   @return
+    *
+    *   @note                           同一输入尺寸第一次调用之后，整个检测过程不再分配堆内存
+    */
+    void detect(const Mat &frame, const cv::Rect &roi, vector<FaceDetectInfo> &faces, float threshold=0.5);
+
+   /**
+    *	@brief  detectTiles	            大图分成有重叠的网络大小的块，按批量检测后合并
+    *   @param  img		                任意大小的图像
+    *   @param  config		            块大小、重叠、批量
+    *   @param  threshold		        置信度阈值
+    *   @return                         整图坐标的检测结果
+    *
+    *   @note                           不缩小整图，全景图里的小脸也能检出；块是原图的子图，不拷贝
+    *                                   接缝处被截断的框由相邻块的完整检测代替，重叠区域的重复检测用一次nms合并
+    *                                   比重叠大、没有块包含完整的人脸保留最大的截断框
+    */
+    vector<FaceDetectInfo> detectTiles(const Mat &img, const TileConfig &config, float threshold=0.5);
+
+   /**
+    *	@brief  detectPyramid	        多尺度测试：各尺度和翻转图放在同一批量里一次推理，结果一起nms
+    *   @param  img		                图像
+    *   @param  scales		            相对于缩放到网络输入大小的倍数，如{1.0, 0.5, 0.25}，大于1按1处理
+    *   @param  threshold		        置信度阈值
+    *   @param  flip		            每个尺度再加一张水平翻转图
+    *   @return                         原图坐标的检测结果
+    *
+    *   @note                           每层由上一层缩小得到，原图只读一次
+    *                                   层数(翻转时乘2)超过maxBatchSize时只保留最大的几层
+    */
+    vector<FaceDetectInfo> detectPyramid(const Mat &img, const vector<float> &scales, float threshold=0.5,
+                                         bool flip=false);
+#endif
 private:
-    vector<FaceDetectInfo> postProcess(int inputW, int inputH, float threshold);
-    anchor_box bbox_pred(anchor_box anchor, cv::Vec4f regress);
-    vector<anchor_box> bbox_pred(vector<anchor_box> anchors, vector<cv::Vec4f> regress);
-    vector<FacePts> landmark_pred(vector<anchor_box> anchors, vector<FacePts> facePts);
-    FacePts landmark_pred(anchor_box anchor, FacePts facePt);
+    void init(string &model);
+    //第batch张网络输出的检测结果(已nms)写入faceInfo，网络输入坐标；不拷贝网络输出，faceInfo的容量复用
+    void postProcess(int inputW, int inputH, float threshold, vector<FaceDetectInfo> &faceInfo, int batch = 0);
     static bool CompareBBox(const FaceDetectInfo &a, const FaceDetectInfo &b);
     std::vector<FaceDetectInfo> nms(std::vector<FaceDetectInfo> &bboxes, float threshold);
+    //原地nms，保留的框按分数从高到低移到前面，标记数组复用nmsMask
+    void nmsInPlace(std::vector<FaceDetectInfo> &bboxes, float threshold);
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+    //按orientation转正、缩放补边写入网络输入，返回缩小倍数，图像格式不支持时返回0
+    float preprocess(const Mat &frame);
+    //多张图依次写入网络输入，返回每张的缩小倍数，有图像格式不支持时返回空
+    vector<float> preprocessBatch(vector<cv::Mat> imgs);
+#endif
+#ifdef USE_CPU
+    //缩放补边后写入第index张网络输入，按第一层读取的格式(BGR8/单通道/fp32)选择实现
+    void preprocessCpu(const Mat &img, float scale, int index, const CpuOrientation &orientation = CpuOrientation());
+    //金字塔各层(和翻转图)依次写入网络输入，levelW返回各层图像区域的宽
+    void preprocessPyramidCpu(const Mat &img, const vector<float> &shrink, bool flip, vector<int> &levelW);
+    //按图像大小切换到最贴合的输入档位，width <= 0时切换到最大尺寸
+    void selectInputBucket(int width, int height);
+#endif
+    //按层生成anchor形状并解析三个输出，网络加载后调用一次
+    void resolveLevels(const vector<vector<anchor_box>> &anchors_fpn);
+    //转正后的检测结果映射回width x height的原始帧
+    void unorientFaces(vector<FaceDetectInfo> &faces, int width, int height) const;
 private:
+#ifndef USE_CPU
     boost::shared_ptr<Net<float> > Net_;
+#endif
     
-    TrtRetinaFaceNet *trtNet;
+    RetinaFaceNet *inferNet;
     float *cpuBuffers;
+#ifdef USE_CPU
+    CpuAffinity affinity;
+    CpuNormalizeParam normalizeParam;   //由pixel_means/pixel_stds/pixel_scale得到
+    bool grayInput;
+    uint8_t *cpuBuffersU8;              //第一层直接读取的uint8输入，BGR8或单通道
+    int cpuChannelsU8;                  //uint8输入的通道数，第一层不支持时为0，使用cpuBuffers
+    vector<Mat> convertedInputs;        //图像通道数与网络输入不符时按批次位置转换后的图像，大小不变时复用内存
+    int maxInputW;                      //最大输入尺寸，内存按它分配
+    int maxInputH;
+#endif
 
     float pixel_means[3] = {0.0, 0.0, 0.0};
     float pixel_stds[3] = {1.0, 1.0, 1.0};
     float pixel_scale = 1.0;
 
+    FrameOrientation orientation;       //单张检测时输入帧的方向
+
     int ctx_id;
     string network;
     float decay4;
@@ -97,13 +321,45 @@ private:
     vector<anchor_cfg> cfg;
 
     vector<int> _feat_stride_fpn;
-    //每一层fpn的anchor形状
-    map<string, vector<anchor_box>> _anchors_fpn;
-    //每一层所有点的anchor
-    map<string, vector<anchor_box>> _anchors;
-    //每一层fpn有几种形状的anchor
-    //也就是ratio个数乘以scales个数
-    map<string, int> _num_anchors;
+
+    //一层fpn检测需要的全部信息，init时解析好，检测时按下标访问，不再拼接字符串和查表
+    struct FpnLevel
+    {
+        int stride;
+        //各种anchor在网格(0, 0)处的中心和宽高，其余位置解码时按步长平移
+        //个数即ratio个数乘以scales个数
+        vector<AnchorShape> anchors;
+#if defined(USE_TENSORRT) || defined(USE_CPU)
+        //inferNet的输出，地址固定，形状和数据在每次doInference后更新
+        RetinaFaceBlob *score;
+        RetinaFaceBlob *bbox;
+        RetinaFaceBlob *landmark;
+#else
+        boost::shared_ptr<Blob<float> > score;
+        boost::shared_ptr<Blob<float> > bbox;
+        boost::shared_ptr<Blob<float> > landmark;
+#endif
+    };
+    //与_feat_stride_fpn一一对应
+    vector<FpnLevel> _levels;
+    //一层一张图的网络输出：超过阈值的候选解码后追加到faceInfo，框裁剪到clipW x clipH内
+    void decodeLevel(const FpnLevel &level, const float *score, const float *bbox_delta, const float *landmark_delta,
+                     int width, int height, int clipW, int clipH, float threshold, vector<FaceDetectInfo> &faceInfo);
+
+    //检测用的缓冲，容量在第一次检测后固定，之后不再分配内存
+    vector<FaceDetectInfo> detectFaces;
+    vector<int32_t> nmsMask;
+    vector<int> candidates;             //一层一种anchor中超过阈值的位置
+    vector<float> decodeBuffer;         //候选解码结果，14个SoA数组
+
+    //预设的输入尺寸，bucketIndex为当前使用的档位，-1表示最大尺寸
+    struct InputBucket
+    {
+        int width;
+        int height;
+    };
+    vector<InputBucket> inputBuckets;
+    int bucketIndex;
 
 #ifdef USE_NPP
     typedef struct GPUImg {
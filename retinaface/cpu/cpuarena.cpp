@@ -0,0 +1,242 @@
+#include "cpuarena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef USE_ALLOC_COUNT
+#include <errno.h>
+#include <atomic>
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+static const size_t hugePageSize = 2 << 20;
+static const size_t alignment = 64;
+
+static size_t roundUp(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+//不依赖libnuma，直接调用mbind
+static bool bindToNode(void *addr, size_t size, int node)
+{
+#ifdef SYS_mbind
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long mask[1024 / bits];
+    if(node < 0 || node >= 1024) {
+        return false;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] |= 1UL << (node % bits);
+    return syscall(SYS_mbind, addr, size, MPOL_BIND, mask, 1024, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+CpuArena::CpuArena(size_t blockSize, int numaNode)
+    : blockSize(roundUp(blockSize, hugePageSize)), current(-1), numaNode(numaNode)
+{
+}
+
+CpuArena::~CpuArena()
+{
+    for(size_t i = 0; i < blocks.size(); i++) {
+        munmap(blocks[i].base, blocks[i].size);
+    }
+}
+
+int CpuArena::newBlock(size_t minSize)
+{
+    size_t size = roundUp(minSize, hugePageSize);
+    Block block;
+    block.size = size;
+    block.used = 0;
+    block.hugeTlb = false;
+    block.base = (char *)MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    block.base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    block.hugeTlb = block.base != MAP_FAILED;
+#endif
+
+    if(block.base == MAP_FAILED) {
+        //多申请一个大页，把起始地址对齐到2MB，内核才能用大页映射
+        size_t mapSize = size + hugePageSize;
+        char *raw = (char *)mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED) {
+            printf("arena mmap %zu bytes failed.\n", mapSize);
+            return -1;
+        }
+        char *aligned = (char *)roundUp((uintptr_t)raw, hugePageSize);
+        if(aligned > raw) {
+            munmap(raw, aligned - raw);
+        }
+        if(raw + mapSize > aligned + size) {
+            munmap(aligned + size, raw + mapSize - (aligned + size));
+        }
+        block.base = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(block.base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    //必须在第一次写之前绑定，否则页已经分配在当前线程所在的节点上
+    if(numaNode >= 0 && !bindToNode(block.base, size, numaNode)) {
+        printf("arena mbind to node %d failed.\n", numaNode);
+    }
+
+    //申请时就写一遍，让内核在这里完成缺页并合并大页，推理时不再缺页
+    memset(block.base, 0, size);
+
+    blocks.push_back(block);
+    return blocks.size() - 1;
+}
+
+void *CpuArena::allocate(size_t bytes)
+{
+    bytes = roundUp(std::max(bytes, (size_t)1), alignment);
+
+    //大的张量单独占一块，小的从当前块顺序分配，不回头找空隙
+    int index = current;
+    if(bytes >= blockSize / 4) {
+        index = newBlock(bytes);
+    }
+    else if(current < 0 || blocks[current].size - blocks[current].used < bytes) {
+        index = current = newBlock(blockSize);
+    }
+    if(index < 0) {
+        return NULL;
+    }
+
+    Block &block = blocks[index];
+    void *ptr = block.base + block.used;
+    block.used += bytes;
+    return ptr;
+}
+
+float *CpuArena::allocateFloats(size_t count)
+{
+    return (float *)allocate(count * sizeof(float));
+}
+
+CpuArenaStats CpuArena::getStats() const
+{
+    CpuArenaStats stats;
+    memset(&stats, 0, sizeof(stats));
+    for(size_t i = 0; i < blocks.size(); i++) {
+        stats.reservedBytes += blocks[i].size;
+        stats.usedBytes += blocks[i].used;
+        if(blocks[i].hugeTlb) {
+            stats.hugeTlbBytes += blocks[i].size;
+        }
+    }
+
+    //smaps里每个映射先是地址范围一行，后面是各项统计
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool inArena = false;
+    while(getline(smaps, line)) {
+        uintptr_t begin, end;
+        if(sscanf(line.c_str(), "%lx-%lx ", &begin, &end) == 2 && line.find(':') > line.find(' ')) {
+            inArena = false;
+            for(size_t i = 0; i < blocks.size(); i++) {
+                uintptr_t base = (uintptr_t)blocks[i].base;
+                if(!blocks[i].hugeTlb && begin < base + blocks[i].size && end > base) {
+                    inArena = true;
+                }
+            }
+            continue;
+        }
+        if(inArena && line.compare(0, 14, "AnonHugePages:") == 0) {
+            size_t kb = strtoul(line.c_str() + 14, NULL, 10);
+            stats.transparentHugeBytes += kb << 10;
+        }
+    }
+
+    return stats;
+}
+
+void CpuArena::printStats() const
+{
+    CpuArenaStats stats = getStats();
+    size_t huge = stats.hugeTlbBytes + stats.transparentHugeBytes;
+    printf("cpu arena: %.1fMB used, %.1fMB reserved, %.1fMB on huge pages (hugetlb %.1fMB, thp %.1fMB).\n",
+           stats.usedBytes / 1048576.0, stats.reservedBytes / 1048576.0, huge / 1048576.0,
+           stats.hugeTlbBytes / 1048576.0, stats.transparentHugeBytes / 1048576.0);
+}
+
+#ifdef USE_ALLOC_COUNT
+static std::atomic<unsigned long long> heapAllocations(0);
+
+//glibc导出的原始实现，替换后的分配函数计数后转给它们
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+}
+
+//在malloc一级计数，可执行文件中的定义优先于libc，OpenCV(fastMalloc)和operator new的分配也都经过这里
+extern "C" void *malloc(size_t size) noexcept
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) noexcept
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void *memalign(size_t align, size_t size) noexcept
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(align, size);
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t size) noexcept
+{
+    return memalign(align, size);
+}
+
+extern "C" int posix_memalign(void **p, size_t align, size_t size) noexcept
+{
+    if(align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *mem = memalign(align, size);
+    if(mem == NULL) {
+        return ENOMEM;
+    }
+    *p = mem;
+    return 0;
+}
+
+unsigned long long getHeapAllocationCount()
+{
+    return heapAllocations.load(std::memory_order_relaxed);
+}
+#else
+unsigned long long getHeapAllocationCount()
+{
+    return 0;
+}
+#endif
@@ -0,0 +1,78 @@
+#ifndef CPUARENA_H
+#define CPUARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+struct CpuArenaStats
+{
+    size_t reservedBytes;           //向系统申请的总大小
+    size_t usedBytes;               //已分配出去的大小
+    size_t hugeTlbBytes;            //MAP_HUGETLB得到的大页
+    size_t transparentHugeBytes;    //madvise后内核实际合并成透明大页的部分，来自/proc/self/smaps
+};
+
+//张量和权重用的内存池，按2MB大页申请，分配出去的内存64字节对齐
+//只分配不释放，析构时整体归还；网络按maxBatchSize分配一次，之后每次推理都复用
+class CpuArena
+{
+public:
+   /**
+    *	@brief  CpuArena	            构造
+    *   @param  blockSize		        每次向系统申请的最小大小，会向上取整到2MB
+    *   @param  numaNode		        内存绑定到该NUMA节点(mbind)，-1表示不绑定
+    *   @return
+    *
+    *   @note
+    */
+    CpuArena(size_t blockSize = 32 << 20, int numaNode = -1);
+    ~CpuArena();
+
+   /**
+    *	@brief  allocate	            分配内存
+    *   @param  bytes		            字节数
+    *   @return                         64字节对齐的地址，失败返回NULL
+    *
+    *   @note                           先尝试MAP_HUGETLB，系统没有预留大页时用普通内存加madvise(MADV_HUGEPAGE)
+    */
+    void *allocate(size_t bytes);
+
+    //按float个数分配
+    float *allocateFloats(size_t count);
+
+    CpuArenaStats getStats() const;
+
+    //打印统计信息
+    void printStats() const;
+
+private:
+    struct Block
+    {
+        char *base;
+        size_t size;
+        size_t used;
+        bool hugeTlb;
+    };
+
+    //申请至少minSize的新块，返回下标，失败返回-1
+    int newBlock(size_t minSize);
+
+private:
+    size_t blockSize;
+    vector<Block> blocks;
+    int current;                    //小块分配使用的块
+    int numaNode;
+};
+
+/**
+*	@brief  getHeapAllocationCount	进程启动以来堆分配的次数，用来检查检测热路径是否还在分配内存
+*   @return                         编译时没有定义USE_ALLOC_COUNT时始终返回0
+*
+*   @note                           USE_ALLOC_COUNT时替换malloc/calloc/realloc/memalign/posix_memalign(加原子计数后调用glibc的实现)，
+*                                   operator new和OpenCV的cv::Mat分配都会计入；依赖glibc，只用于测试
+*/
+unsigned long long getHeapAllocationCount();
+
+#endif // CPUARENA_H
@@ -0,0 +1,369 @@
+#include "cpuconvkernels.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//mnet.25的前几层分辨率大、通道少，通用实现里的循环和边界判断比乘加还多
+//这里把通道数、卷积核、步长作为模板参数，内层循环在编译期完全展开
+//-O2下编译器不会向量化这些循环，AVX2下直接用intrinsics，每次算8个输出像素
+
+//把一行输入补零，并按步长拆成S个相位：phases[s][j] = row[(j * S + s - pad) * STEP]
+//之后卷积核的每一列都是对某个相位的连续读取，不需要判断边界，步长2也能连续读取
+//STEP是同一通道相邻像素的间隔，交错排列的BGR8输入为3，顺便转成float
+//row为NULL时(上下padding)整行填padValue
+template<int S, int STEP, typename T>
+static inline void splitRow(const T *row, int inW, int pad, float padValue, int phaseLen, float *phases)
+{
+    for(int s = 0; s < S; s++) {
+        float *dst = phases + s * phaseLen;
+        if(row == NULL) {
+            std::fill(dst, dst + phaseLen, padValue);
+            continue;
+        }
+        for(int j = 0; j < phaseLen; j++) {
+            int x = j * S + s - pad;
+            dst[j] = (x >= 0 && x < inW) ? (float)row[x * STEP] : padValue;
+        }
+    }
+}
+
+//相位缓冲每个线程一份，反复使用，稳定后不再分配内存
+static float *phaseBuffer(size_t size)
+{
+    static thread_local vector<float> buffer;
+    if(buffer.size() < size) {
+        buffer.resize(size);
+    }
+    return buffer.data();
+}
+
+//######################################################################
+//depthwise
+//######################################################################
+
+template<int K, int S>
+static void depthwiseConv(const CpuConvShape &shape, const float *input, const float *weights, float *output)
+{
+    const int inH = shape.inH;
+    const int inW = shape.inW;
+    const int outH = shape.outH;
+    const int outW = shape.outW;
+    const int pad = shape.pad;
+    const int phaseLen = outW + (K - 1) / S;
+
+    //K行输入，每行S个相位
+    float *phases = phaseBuffer(K * S * phaseLen);
+
+    for(int c = 0; c < shape.inC; c++) {
+        const float *in = input + c * inH * inW;
+        float *out = output + c * outH * outW;
+        const float *w = weights + c * K * K;
+
+        for(int oh = 0; oh < outH; oh++) {
+            for(int kh = 0; kh < K; kh++) {
+                int ih = oh * S - pad + kh;
+                const float *row = (ih >= 0 && ih < inH) ? in + ih * inW : NULL;
+                splitRow<S, 1>(row, inW, pad, 0, phaseLen, phases + kh * S * phaseLen);
+            }
+
+            float *o = out + oh * outW;
+            int ow = 0;
+#ifdef __AVX2__
+            __m256 wv[K * K];
+            for(int k = 0; k < K * K; k++) {
+                wv[k] = _mm256_set1_ps(w[k]);
+            }
+            for(; ow + 8 <= outW; ow += 8) {
+                __m256 acc = _mm256_setzero_ps();
+                for(int kh = 0; kh < K; kh++) {
+                    for(int kw = 0; kw < K; kw++) {
+                        const float *src = phases + (kh * S + kw % S) * phaseLen + kw / S + ow;
+                        acc = _mm256_fmadd_ps(wv[kh * K + kw], _mm256_loadu_ps(src), acc);
+                    }
+                }
+                _mm256_storeu_ps(o + ow, acc);
+            }
+#endif
+            for(; ow < outW; ow++) {
+                float sum = 0;
+                for(int kh = 0; kh < K; kh++) {
+                    for(int kw = 0; kw < K; kw++) {
+                        sum += w[kh * K + kw] * phases[(kh * S + kw % S) * phaseLen + kw / S + ow];
+                    }
+                }
+                o[ow] = sum;
+            }
+        }
+    }
+}
+
+//######################################################################
+//pointwise
+//######################################################################
+
+//1x1卷积，一次算OB个输出通道的16个像素，累加器留在寄存器里，IC在编译期确定使累加完全展开
+template<int IC, int OB>
+static void pointwiseConv(const CpuConvShape &shape, const float *input, const float *weights, float *output)
+{
+    const int spatial = shape.outH * shape.outW;
+
+    int oc = 0;
+    for(; oc + OB <= shape.outC; oc += OB) {
+        const float *w = weights + oc * IC;
+        int p = 0;
+#ifdef __AVX2__
+        for(; p + 16 <= spatial; p += 16) {
+            __m256 acc[OB][2];
+            for(int b = 0; b < OB; b++) {
+                acc[b][0] = acc[b][1] = _mm256_setzero_ps();
+            }
+            for(int ic = 0; ic < IC; ic++) {
+                const float *in = input + ic * spatial + p;
+                __m256 x0 = _mm256_loadu_ps(in);
+                __m256 x1 = _mm256_loadu_ps(in + 8);
+                for(int b = 0; b < OB; b++) {
+                    __m256 wv = _mm256_set1_ps(w[b * IC + ic]);
+                    acc[b][0] = _mm256_fmadd_ps(wv, x0, acc[b][0]);
+                    acc[b][1] = _mm256_fmadd_ps(wv, x1, acc[b][1]);
+                }
+            }
+            for(int b = 0; b < OB; b++) {
+                _mm256_storeu_ps(output + (oc + b) * spatial + p, acc[b][0]);
+                _mm256_storeu_ps(output + (oc + b) * spatial + p + 8, acc[b][1]);
+            }
+        }
+#endif
+        for(; p < spatial; p++) {
+            for(int b = 0; b < OB; b++) {
+                float sum = 0;
+                for(int ic = 0; ic < IC; ic++) {
+                    sum += w[b * IC + ic] * input[ic * spatial + p];
+                }
+                output[(oc + b) * spatial + p] = sum;
+            }
+        }
+    }
+    for(; oc < shape.outC; oc++) {
+        for(int p = 0; p < spatial; p++) {
+            float sum = 0;
+            for(int ic = 0; ic < IC; ic++) {
+                sum += weights[oc * IC + ic] * input[ic * spatial + p];
+            }
+            output[oc * spatial + p] = sum;
+        }
+    }
+}
+
+//######################################################################
+//direct
+//######################################################################
+
+//输入通道很少的普通卷积(第一层)，不需要im2col
+//每个输出行先把IC*K行输入拆分好，一次读取供OB个输出通道使用
+//输入可以是NCHW的float，也可以是HWC交错排列的uint8(STEP = IC)，padValues为NULL时补0
+template<int IC, int K, int S, int OB, typename T, int STEP>
+static void directConvImpl(const CpuConvShape &shape, const T *input, const float *weights,
+                           const float *padValues, float *output)
+{
+    const int inH = shape.inH;
+    const int inW = shape.inW;
+    const int outH = shape.outH;
+    const int outW = shape.outW;
+    const int pad = shape.pad;
+    const int phaseLen = outW + (K - 1) / S;
+    const int outSpatial = outH * outW;
+    const int taps = IC * K * K;
+
+    float *phases = phaseBuffer(IC * K * S * phaseLen);
+
+    for(int oh = 0; oh < outH; oh++) {
+        for(int ic = 0; ic < IC; ic++) {
+            for(int kh = 0; kh < K; kh++) {
+                int ih = oh * S - pad + kh;
+                size_t offset = STEP == 1 ? (size_t)(ic * inH + ih) * inW : (size_t)ih * inW * IC + ic;
+                const T *row = (ih >= 0 && ih < inH) ? input + offset : NULL;
+                float padValue = padValues ? padValues[ic] : 0;
+                splitRow<S, STEP>(row, inW, pad, padValue, phaseLen, phases + (ic * K + kh) * S * phaseLen);
+            }
+        }
+
+        int oc = 0;
+        for(; oc + OB <= shape.outC; oc += OB) {
+            const float *w = weights + oc * taps;
+            int ow = 0;
+#ifdef __AVX2__
+            for(; ow + 8 <= outW; ow += 8) {
+                __m256 acc[OB];
+                for(int b = 0; b < OB; b++) {
+                    acc[b] = _mm256_setzero_ps();
+                }
+                for(int ic = 0; ic < IC; ic++) {
+                    for(int kh = 0; kh < K; kh++) {
+                        for(int kw = 0; kw < K; kw++) {
+                            const float *src = phases + ((ic * K + kh) * S + kw % S) * phaseLen + kw / S + ow;
+                            __m256 x = _mm256_loadu_ps(src);
+                            int t = (ic * K + kh) * K + kw;
+                            for(int b = 0; b < OB; b++) {
+                                acc[b] = _mm256_fmadd_ps(_mm256_set1_ps(w[b * taps + t]), x, acc[b]);
+                            }
+                        }
+                    }
+                }
+                for(int b = 0; b < OB; b++) {
+                    _mm256_storeu_ps(output + (oc + b) * outSpatial + oh * outW + ow, acc[b]);
+                }
+            }
+#endif
+            for(; ow < outW; ow++) {
+                for(int b = 0; b < OB; b++) {
+                    float sum = 0;
+                    for(int ic = 0; ic < IC; ic++) {
+                        for(int kh = 0; kh < K; kh++) {
+                            for(int kw = 0; kw < K; kw++) {
+                                const float *src = phases + ((ic * K + kh) * S + kw % S) * phaseLen + kw / S;
+                                sum += w[b * taps + (ic * K + kh) * K + kw] * src[ow];
+                            }
+                        }
+                    }
+                    output[(oc + b) * outSpatial + oh * outW + ow] = sum;
+                }
+            }
+        }
+
+        //剩余不足OB的输出通道
+        for(; oc < shape.outC; oc++) {
+            const float *w = weights + oc * taps;
+            for(int ow = 0; ow < outW; ow++) {
+                float sum = 0;
+                for(int ic = 0; ic < IC; ic++) {
+                    for(int kh = 0; kh < K; kh++) {
+                        for(int kw = 0; kw < K; kw++) {
+                            const float *src = phases + ((ic * K + kh) * S + kw % S) * phaseLen + kw / S;
+                            sum += w[(ic * K + kh) * K + kw] * src[ow];
+                        }
+                    }
+                }
+                output[oc * outSpatial + oh * outW + ow] = sum;
+            }
+        }
+    }
+}
+
+template<int IC, int K, int S, int OB>
+static void directConv(const CpuConvShape &shape, const float *input, const float *weights, float *output)
+{
+    directConvImpl<IC, K, S, OB, float, 1>(shape, input, weights, NULL, output);
+}
+
+//第一层直接读取BGR8图像，归一化已经合并进权重，padding填归一化后为0的像素值
+template<int K, int S, int OB>
+static void directConvBGR8(const CpuConvShape &shape, const uint8_t *input, const float *weights,
+                           const float *padValues, float *output)
+{
+    directConvImpl<3, K, S, OB, uint8_t, 3>(shape, input, weights, padValues, output);
+}
+
+//第一层直接读取单通道图像，三个输入通道的权重已经求和成一个
+template<int K, int S, int OB>
+static void directConvGray8(const CpuConvShape &shape, const uint8_t *input, const float *weights,
+                            const float *padValues, float *output)
+{
+    directConvImpl<1, K, S, OB, uint8_t, 1>(shape, input, weights, padValues, output);
+}
+
+//######################################################################
+//kernel table
+//######################################################################
+
+enum ConvKernelType
+{
+    kDepthwiseKernel,
+    kPointwiseKernel,
+    kDirectKernel
+};
+
+struct ConvKernelEntry
+{
+    ConvKernelType type;
+    int inChannels;         //depthwise与通道数无关，填0
+    int kernel;
+    int stride;
+    CpuConvKernel kernelFunc;
+};
+
+//mnet.25中出现的形状：
+//conv0              3->8, 3x3, stride 2
+//conv1,3,...,25     depthwise 3x3, stride 1/2
+//conv2,4,...,26     1x1, 输入8/16/32/64/128/256
+static const ConvKernelEntry convKernelTable[] = {
+    {kDirectKernel,     3,   3, 2, directConv<3, 3, 2, 8>},
+    {kDirectKernel,     3,   3, 1, directConv<3, 3, 1, 8>},
+    {kDepthwiseKernel,  0,   3, 1, depthwiseConv<3, 1>},
+    {kDepthwiseKernel,  0,   3, 2, depthwiseConv<3, 2>},
+    {kPointwiseKernel,  8,   1, 1, pointwiseConv<8, 4>},
+    {kPointwiseKernel,  16,  1, 1, pointwiseConv<16, 4>},
+    {kPointwiseKernel,  32,  1, 1, pointwiseConv<32, 4>},
+    {kPointwiseKernel,  64,  1, 1, pointwiseConv<64, 4>},
+    {kPointwiseKernel,  128, 1, 1, pointwiseConv<128, 4>},
+    {kPointwiseKernel,  256, 1, 1, pointwiseConv<256, 4>},
+};
+
+CpuConvKernel findConvKernel(const CpuConvParam &param, int inChannels)
+{
+    if(param.kernel_h != param.kernel_w || param.stride_h != param.stride_w || param.pad_h != param.pad_w ||
+       param.dilate_h != 1 || param.dilate_w != 1) {
+        return NULL;
+    }
+
+    ConvKernelType type;
+    if(param.group > 1 && param.group == inChannels && param.group == param.num_output) {
+        type = kDepthwiseKernel;
+        inChannels = 0;
+    }
+    else if(param.group != 1) {
+        return NULL;
+    }
+    else if(param.kernel_h == 1 && param.pad_h == 0) {
+        type = kPointwiseKernel;
+    }
+    else {
+        type = kDirectKernel;
+    }
+
+    for(size_t i = 0; i < sizeof(convKernelTable) / sizeof(convKernelTable[0]); i++) {
+        const ConvKernelEntry &entry = convKernelTable[i];
+        if(entry.type == type && entry.inChannels == inChannels &&
+           entry.kernel == param.kernel_h && entry.stride == param.stride_h) {
+            return entry.kernelFunc;
+        }
+    }
+    return NULL;
+}
+
+CpuConvKernel8U findConvKernel8U(const CpuConvParam &param, int inChannels, int imageChannels)
+{
+    if(inChannels != 3 || param.group != 1 || param.kernel_h != 3 || param.kernel_w != 3 ||
+       param.stride_h != param.stride_w || param.pad_h != param.pad_w || param.dilate_h != 1 || param.dilate_w != 1) {
+        return NULL;
+    }
+    if(imageChannels == 3) {
+        if(param.stride_h == 2) {
+            return directConvBGR8<3, 2, 8>;
+        }
+        if(param.stride_h == 1) {
+            return directConvBGR8<3, 1, 8>;
+        }
+    }
+    else if(imageChannels == 1) {
+        if(param.stride_h == 2) {
+            return directConvGray8<3, 2, 8>;
+        }
+        if(param.stride_h == 1) {
+            return directConvGray8<3, 1, 8>;
+        }
+    }
+    return NULL;
+}
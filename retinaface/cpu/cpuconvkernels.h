@@ -0,0 +1,40 @@
+#ifndef CPUCONVKERNELS_H
+#define CPUCONVKERNELS_H
+
+#include "cpulayers.h"
+
+//单张图的卷积形状
+struct CpuConvShape
+{
+    int inC;
+    int inH;
+    int inW;
+    int outC;
+    int outH;
+    int outW;
+    int pad;
+};
+
+/**
+ *	@brief  findConvKernel	            查找通道数、卷积核和步长都在编译期确定的特化卷积
+ *   @param  param		                卷积参数
+ *   @param  inChannels		            输入通道数
+ *   @return                             没有匹配的特化版本时返回NULL，使用通用实现
+ *
+ *   @note                               只覆盖mnet.25用到的形状，其他模型走通用实现
+ */
+CpuConvKernel findConvKernel(const CpuConvParam &param, int inChannels);
+
+/**
+ *	@brief  findConvKernel8U	        查找直接读取uint8图像的第一层卷积
+ *   @param  param		                卷积参数
+ *   @param  inChannels		            输入通道数，必须为3
+ *   @param  imageChannels		        图像通道数，3为BGR8交错排列，1为单通道(灰度/红外)
+ *   @return                             只支持3x3 stride 1/2，不支持时返回NULL
+ *
+ *   @note                               BGR8时权重按BGR顺序排列，单通道时权重已按输入通道求和，
+ *                                       归一化需预先合并进权重和bias
+ */
+CpuConvKernel8U findConvKernel8U(const CpuConvParam &param, int inChannels, int imageChannels);
+
+#endif // CPUCONVKERNELS_H
@@ -0,0 +1,1278 @@
+#include "cpulayers.h"
+#include "cpuconvkernels.h"
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//######################################################################
+//tensor
+//######################################################################
+
+CpuTensor::CpuTensor(const string &name)
+    : name(name), num(0), channels(0), height(0), width(0), data(NULL), arena(NULL), capacity(0)
+{
+}
+
+void CpuTensor::setArena(CpuArena *arena)
+{
+    this->arena = arena;
+}
+
+void CpuTensor::reshape(int n, int c, int h, int w)
+{
+    num = n;
+    channels = c;
+    height = h;
+    width = w;
+
+    size_t cnt = count();
+    if(arena != NULL) {
+        //arena不能释放，变大时旧的内存直接丢弃
+        if(capacity < cnt || data == NULL) {
+            data = arena->allocateFloats(cnt);
+            capacity = cnt;
+        }
+        return;
+    }
+
+    if(storage.size() < cnt) {
+        storage.resize(cnt);
+    }
+    data = storage.data();
+}
+
+void CpuTensor::shareData(const CpuTensor *other, int n, int c, int h, int w)
+{
+    num = n;
+    channels = c;
+    height = h;
+    width = w;
+
+    assert(count() == other->count());
+    data = other->data;
+}
+
+void CpuTensor::setShape(int n, int c, int h, int w)
+{
+    num = n;
+    channels = c;
+    height = h;
+    width = w;
+}
+
+size_t CpuTensor::count() const
+{
+    return (size_t)num * channels * height * width;
+}
+
+size_t CpuTensor::count(int axis) const
+{
+    int dims[4] = {num, channels, height, width};
+    size_t cnt = 1;
+    for(int i = axis; i < 4; i++) {
+        cnt *= dims[i];
+    }
+    return cnt;
+}
+
+CpuLayer::CpuLayer(const string &name, const string &type)
+    : name(name), type(type), threadPool(NULL)
+{
+}
+
+CpuLayer::~CpuLayer()
+{
+}
+
+void CpuLayer::setArena(CpuArena *)
+{
+}
+
+void CpuLayer::setThreadPool(CpuThreadPool *pool)
+{
+    threadPool = pool;
+}
+
+//######################################################################
+//convolution
+//######################################################################
+
+template<typename T>
+static void im2col(const T *data_im, int channels, int height, int width,
+                   const CpuConvParam &p, int out_h, int out_w, T *data_col)
+{
+    for(int c = 0; c < channels; c++) {
+        for(int kh = 0; kh < p.kernel_h; kh++) {
+            for(int kw = 0; kw < p.kernel_w; kw++) {
+                int in_row = kh * p.dilate_h - p.pad_h;
+                for(int oh = 0; oh < out_h; oh++) {
+                    if(in_row < 0 || in_row >= height) {
+                        memset(data_col, 0, out_w * sizeof(T));
+                        data_col += out_w;
+                    }
+                    else {
+                        const T *row = data_im + in_row * width;
+                        int in_col = kw * p.dilate_w - p.pad_w;
+                        for(int ow = 0; ow < out_w; ow++) {
+                            *(data_col++) = (in_col >= 0 && in_col < width) ? row[in_col] : 0;
+                            in_col += p.stride_w;
+                        }
+                    }
+                    in_row += p.stride_h;
+                }
+            }
+        }
+        data_im += height * width;
+    }
+}
+
+//C(MxN) = A(MxK) * B(KxN)，行主序
+//按列分块使B的一块常驻缓存，每次算4行C，B的每个元素读一次用4次
+template<int blockN>
+static void sgemmBlock(int M, int N, int K, const float *A, const float *B, float *C)
+{
+    for(int jb = 0; jb < N; jb += blockN) {
+        int nb = std::min(blockN, N - jb);
+        int i = 0;
+        for(; i + 4 <= M; i += 4) {
+            float acc[4][blockN];
+            memset(acc, 0, sizeof(acc));
+            const float *a0 = A + i * K;
+            const float *a1 = a0 + K;
+            const float *a2 = a1 + K;
+            const float *a3 = a2 + K;
+            for(int k = 0; k < K; k++) {
+                const float * __restrict b = B + k * N + jb;
+                float v0 = a0[k], v1 = a1[k], v2 = a2[k], v3 = a3[k];
+                for(int j = 0; j < nb; j++) {
+                    acc[0][j] += v0 * b[j];
+                    acc[1][j] += v1 * b[j];
+                    acc[2][j] += v2 * b[j];
+                    acc[3][j] += v3 * b[j];
+                }
+            }
+            for(int r = 0; r < 4; r++) {
+                memcpy(C + (i + r) * N + jb, acc[r], nb * sizeof(float));
+            }
+        }
+        for(; i < M; i++) {
+            float * __restrict c = C + i * N + jb;
+            const float *a = A + i * K;
+            memset(c, 0, nb * sizeof(float));
+            for(int k = 0; k < K; k++) {
+                float av = a[k];
+                const float * __restrict b = B + k * N + jb;
+                for(int j = 0; j < nb; j++) {
+                    c[j] += av * b[j];
+                }
+            }
+        }
+    }
+}
+
+//最优分块与缓存大小和N有关，由autotune选择
+static void sgemm(int M, int N, int K, const float *A, const float *B, float *C, int blockN = 64)
+{
+    switch(blockN) {
+    case 32:
+        sgemmBlock<32>(M, N, K, A, B, C);
+        break;
+    case 128:
+        sgemmBlock<128>(M, N, K, A, B, C);
+        break;
+    default:
+        sgemmBlock<64>(M, N, K, A, B, C);
+        break;
+    }
+}
+
+//int8版本，C(MxN) = scale(M) * (A(MxK) * B(KxN))，用int32累加
+//B按相邻两行交错打包成int16，AVX2下用madd一次完成两个k的乘加
+static const int igemmBlockN = 64;
+
+static void igemm(int M, int N, int K, const int8_t *A, const int8_t *B, const float *scale, float *C, int16_t *pack)
+{
+    int Kp = (K + 1) / 2;
+    for(int jb = 0; jb < N; jb += igemmBlockN) {
+        int nb = std::min(igemmBlockN, N - jb);
+
+        for(int kp = 0; kp < Kp; kp++) {
+            const int8_t *b0 = B + 2 * kp * N + jb;
+            const int8_t *b1 = 2 * kp + 1 < K ? b0 + N : NULL;
+            int16_t *p = pack + kp * igemmBlockN * 2;
+            for(int j = 0; j < nb; j++) {
+                p[2 * j] = b0[j];
+                p[2 * j + 1] = b1 ? b1[j] : 0;
+            }
+            for(int j = nb; j < igemmBlockN; j++) {
+                p[2 * j] = p[2 * j + 1] = 0;
+            }
+        }
+
+        for(int i = 0; i < M; i += 4) {
+            int rows = std::min(4, M - i);
+            for(int jj = 0; jj < nb; jj += 16) {
+                int32_t acc[4][16];
+#ifdef __AVX2__
+                __m256i vacc[4][2];
+                for(int r = 0; r < 4; r++) {
+                    vacc[r][0] = vacc[r][1] = _mm256_setzero_si256();
+                }
+                for(int kp = 0; kp < Kp; kp++) {
+                    const int16_t *p = pack + kp * igemmBlockN * 2 + jj * 2;
+                    __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+                    __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 16));
+                    int k = 2 * kp;
+                    for(int r = 0; r < rows; r++) {
+                        const int8_t *a = A + (i + r) * K + k;
+                        int16_t hi = k + 1 < K ? a[1] : 0;
+                        int32_t pair = (uint16_t)(int16_t)a[0] | ((int32_t)(uint16_t)hi << 16);
+                        __m256i av = _mm256_set1_epi32(pair);
+                        vacc[r][0] = _mm256_add_epi32(vacc[r][0], _mm256_madd_epi16(av, b0));
+                        vacc[r][1] = _mm256_add_epi32(vacc[r][1], _mm256_madd_epi16(av, b1));
+                    }
+                }
+                for(int r = 0; r < rows; r++) {
+                    _mm256_storeu_si256((__m256i *)acc[r], vacc[r][0]);
+                    _mm256_storeu_si256((__m256i *)(acc[r] + 8), vacc[r][1]);
+                }
+#else
+                memset(acc, 0, sizeof(acc));
+                for(int kp = 0; kp < Kp; kp++) {
+                    const int16_t * __restrict p = pack + kp * igemmBlockN * 2 + jj * 2;
+                    int k = 2 * kp;
+                    for(int r = 0; r < rows; r++) {
+                        const int8_t *a = A + (i + r) * K + k;
+                        int32_t a0 = a[0];
+                        int32_t a1 = k + 1 < K ? a[1] : 0;
+                        for(int j = 0; j < 16; j++) {
+                            acc[r][j] += a0 * p[2 * j] + a1 * p[2 * j + 1];
+                        }
+                    }
+                }
+#endif
+                int n = std::min(16, nb - jj);
+                for(int r = 0; r < rows; r++) {
+                    float *c = C + (i + r) * N + jb + jj;
+                    for(int j = 0; j < n; j++) {
+                        c[j] = acc[r][j] * scale[i + r];
+                    }
+                }
+            }
+        }
+    }
+}
+
+//先截断再四舍五入，写成这样编译器可以向量化
+static inline int8_t quantize(float v, float invScale)
+{
+    v = std::max(-127.0f, std::min(127.0f, v * invScale));
+    return (int8_t)(int)(v + (v >= 0 ? 0.5f : -0.5f));
+}
+
+CpuConvolutionLayer::CpuConvolutionLayer(const string &name, const CpuConvParam &param)
+    : CpuLayer(name, "Convolution"), param(param), fusedReLU(false), pointwise(false), specializedKernel(NULL),
+      arenaWeights(NULL), image8Input(NULL), image8Channels(0), image8Kernel(NULL), algo(kConvAlgoDefault), activeAlgo(kConvAlgoDefault), gemmBlockN(64), precision(kCpuFP32), inputScale(0)
+{
+}
+
+void CpuConvolutionLayer::setWeights(const vector<float> &weights, const vector<float> &bias)
+{
+    this->weights = weights;
+    this->bias = bias;
+    winogradWeights.clear();
+    arenaWeights = NULL;
+}
+
+void CpuConvolutionLayer::foldBatchNorm(const vector<float> &scale, const vector<float> &shift)
+{
+    assert((int)scale.size() == param.num_output && (int)shift.size() == param.num_output);
+
+    if(bias.empty()) {
+        bias.resize(param.num_output, 0);
+    }
+
+    size_t perOutput = weights.size() / param.num_output;
+    for(int o = 0; o < param.num_output; o++) {
+        float *w = weights.data() + o * perOutput;
+        for(size_t i = 0; i < perOutput; i++) {
+            w[i] *= scale[o];
+        }
+        bias[o] = bias[o] * scale[o] + shift[o];
+    }
+    winogradWeights.clear();
+    arenaWeights = NULL;
+}
+
+void CpuConvolutionLayer::setFusedReLU(bool relu)
+{
+    fusedReLU = relu;
+}
+
+void CpuConvolutionLayer::setPrecision(CpuPrecision precision, float inputScale)
+{
+    this->precision = precision;
+    this->inputScale = inputScale;
+
+    if(precision == kCpuINT8) {
+        assert(inputScale > 0);
+
+        //权重按输出通道对称量化
+        size_t perOutput = weights.size() / param.num_output;
+        int8Weights.resize(weights.size());
+        outputScales.resize(param.num_output);
+        for(int o = 0; o < param.num_output; o++) {
+            const float *w = weights.data() + o * perOutput;
+            float amax = 0;
+            for(size_t i = 0; i < perOutput; i++) {
+                amax = std::max(amax, fabsf(w[i]));
+            }
+            float wScale = amax > 0 ? amax / 127.0f : 1.0f;
+            for(size_t i = 0; i < perOutput; i++) {
+                int8Weights[o * perOutput + i] = quantize(w[i], 1.0f / wScale);
+            }
+            //反量化系数
+            outputScales[o] = wScale * inputScale;
+        }
+    }
+    else {
+        vector<int8_t>().swap(int8Weights);
+        vector<int8_t>().swap(int8Input);
+        vector<int8_t>().swap(int8ColBuffer);
+        vector<vector<int16_t> >().swap(int8PackBuffers);
+    }
+}
+
+void CpuConvolutionLayer::setArena(CpuArena *arena)
+{
+    arenaWeights = arena->allocateFloats(weights.size());
+    if(arenaWeights != NULL) {
+        memcpy(arenaWeights, weights.data(), weights.size() * sizeof(float));
+    }
+}
+
+const float *CpuConvolutionLayer::weightData() const
+{
+    return arenaWeights != NULL ? arenaWeights : weights.data();
+}
+
+CpuPrecision CpuConvolutionLayer::getPrecision() const
+{
+    return precision;
+}
+
+void CpuConvolutionLayer::setAlgorithm(CpuConvAlgo algo, int gemmBlockN)
+{
+    this->algo = algo;
+    this->gemmBlockN = gemmBlockN;
+}
+
+CpuConvAlgo CpuConvolutionLayer::getAlgorithm() const
+{
+    return algo;
+}
+
+int CpuConvolutionLayer::getGemmBlockN() const
+{
+    return gemmBlockN;
+}
+
+vector<CpuConvAlgo> CpuConvolutionLayer::getCandidateAlgorithms() const
+{
+    int channels = bottoms[0]->channels;
+    bool depthwise = param.group > 1 && param.group == channels && param.group == param.num_output;
+    bool dilated = param.dilate_h != 1 || param.dilate_w != 1;
+
+    vector<CpuConvAlgo> algos;
+    if(findConvKernel(param, channels) != NULL) {
+        algos.push_back(kConvAlgoSpecialized);
+    }
+    if(depthwise) {
+        algos.push_back(kConvAlgoDirect);
+    }
+    else {
+        algos.push_back(kConvAlgoGemm);
+    }
+    if(param.group == 1 && param.kernel_h == 3 && param.kernel_w == 3 &&
+       param.stride_h == 1 && param.stride_w == 1 && !dilated) {
+        algos.push_back(kConvAlgoWinograd);
+    }
+    return algos;
+}
+
+void CpuConvolutionLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    assert(bottom->channels % param.group == 0);
+
+    int out_h = (bottom->height + 2 * param.pad_h - (param.dilate_h * (param.kernel_h - 1) + 1)) / param.stride_h + 1;
+    int out_w = (bottom->width + 2 * param.pad_w - (param.dilate_w * (param.kernel_w - 1) + 1)) / param.stride_w + 1;
+    tops[0]->reshape(bottom->num, param.num_output, out_h, out_w);
+
+    //确定实现方式，指定的方式不可用时回到默认
+    vector<CpuConvAlgo> candidates = getCandidateAlgorithms();
+    activeAlgo = algo;
+    if(std::find(candidates.begin(), candidates.end(), activeAlgo) == candidates.end()) {
+        activeAlgo = candidates[0];
+    }
+    specializedKernel = activeAlgo == kConvAlgoSpecialized ? findConvKernel(param, bottom->channels) : NULL;
+
+    if(precision == kCpuFP32 && activeAlgo == kConvAlgoWinograd) {
+        if(winogradWeights.empty()) {
+            transformWinogradWeights();
+        }
+        size_t tiles = (size_t)((out_h + 1) / 2) * ((out_w + 1) / 2);
+        if(winogradInput.size() < 16 * bottom->channels * tiles) {
+            winogradInput.resize(16 * bottom->channels * tiles);
+        }
+        if(winogradOutput.size() < 16 * param.num_output * tiles) {
+            winogradOutput.resize(16 * param.num_output * tiles);
+        }
+    }
+
+    //1x1卷积直接用输入做GEMM，不需要im2col
+    pointwise = param.kernel_h == 1 && param.kernel_w == 1 && param.stride_h == 1 &&
+                param.stride_w == 1 && param.pad_h == 0 && param.pad_w == 0;
+    if(!pointwise && !isDepthwise() && (precision == kCpuINT8 || activeAlgo == kConvAlgoGemm)) {
+        //所有group一次im2col，线程按输出通道划分时共用
+        size_t colSize = (size_t)bottom->channels * param.kernel_h * param.kernel_w * out_h * out_w;
+        if(precision == kCpuINT8) {
+            if(int8ColBuffer.size() < colSize) {
+                int8ColBuffer.resize(colSize);
+            }
+        }
+        else if(colBuffer.size() < colSize) {
+            colBuffer.resize(colSize);
+        }
+    }
+
+    if(precision == kCpuINT8) {
+        if(int8Input.size() < bottom->count(1)) {
+            int8Input.resize(bottom->count(1));
+        }
+        size_t K = (bottom->channels / param.group) * param.kernel_h * param.kernel_w;
+        int threads = threadPool ? threadPool->getNumThreads() : 1;
+        int8PackBuffers.resize(threads);
+        for(int t = 0; t < threads; t++) {
+            int8PackBuffers[t].resize((K + 1) / 2 * igemmBlockN * 2);
+        }
+    }
+}
+
+bool CpuConvolutionLayer::setImage8Input(const uint8_t *data, int imageChannels, const CpuNormalizeParam &norm)
+{
+    image8Input = NULL;
+    if(data == NULL) {
+        return true;
+    }
+
+    int inC = bottoms[0]->channels;
+    image8Kernel = findConvKernel8U(param, inC, imageChannels);
+    if(image8Kernel == NULL) {
+        return false;
+    }
+
+    //x_rgb[c] = (p_bgr[2 - c] / scale - mean[2 - c]) / std[2 - c]
+    //= p_bgr[2 - c] / (scale * std[2 - c]) - mean[2 - c] / std[2 - c]，前一项进权重，后一项进bias
+    //单通道时p_bgr[j]都是同一个像素，三个通道的权重直接相加
+    int kernelSize = param.kernel_h * param.kernel_w;
+    image8Weights.assign((size_t)param.num_output * imageChannels * kernelSize, 0.0f);
+    image8Bias.resize(param.num_output);
+    for(int o = 0; o < param.num_output; o++) {
+        float b = bias.empty() ? 0 : bias[o];
+        for(int c = 0; c < inC; c++) {
+            int j = inC - 1 - c;
+            const float *w = weights.data() + (o * inC + c) * kernelSize;
+            float *dst = image8Weights.data() + (o * imageChannels + (imageChannels == 1 ? 0 : j)) * kernelSize;
+            for(int k = 0; k < kernelSize; k++) {
+                dst[k] += w[k] / (norm.scale * norm.stds[j]);
+                b -= w[k] * norm.means[j] / norm.stds[j];
+            }
+        }
+        image8Bias[o] = b;
+    }
+
+    //padding要等于归一化后的0，像素值为mean * scale，不一定是整数，所以放在float的相位缓冲里补
+    //单通道只有一个padding值，三个mean相同时(mnet.25都为0)是精确的，否则取平均，只影响边上一圈
+    image8PadValues.resize(imageChannels);
+    if(imageChannels == 1) {
+        image8PadValues[0] = (norm.means[0] + norm.means[1] + norm.means[2]) / 3 * norm.scale;
+    }
+    else {
+        for(int j = 0; j < inC; j++) {
+            image8PadValues[j] = norm.means[j] * norm.scale;
+        }
+    }
+
+    image8Channels = imageChannels;
+    image8Input = data;
+    return true;
+}
+
+void CpuConvolutionLayer::forwardImage8()
+{
+    const CpuTensor *bottom = bottoms[0];
+    CpuTensor *top = tops[0];
+    int outSpatial = top->height * top->width;
+    int perOutput = image8Weights.size() / param.num_output;
+    size_t imageSize = (size_t)bottom->height * bottom->width * image8Channels;
+
+    for(int n = 0; n < bottom->num; n++) {
+        const uint8_t *input = image8Input + n * imageSize;
+        float *output = top->data + n * top->count(1);
+
+        parallelFor(threadPool, param.num_output, [&](int begin, int end, int) {
+            CpuConvShape shape;
+            shape.inC = image8Channels;
+            shape.inH = bottom->height;
+            shape.inW = bottom->width;
+            shape.outC = end - begin;
+            shape.outH = top->height;
+            shape.outW = top->width;
+            shape.pad = param.pad_h;
+            image8Kernel(shape, input, image8Weights.data() + begin * perOutput, image8PadValues.data(),
+                         output + begin * outSpatial);
+            addBiasReLU(output, begin, end);
+        }, 4);
+    }
+}
+
+void CpuConvolutionLayer::forward()
+{
+    if(image8Input != NULL) {
+        forwardImage8();
+        return;
+    }
+
+    const CpuTensor *bottom = bottoms[0];
+    CpuTensor *top = tops[0];
+
+    for(int n = 0; n < bottom->num; n++) {
+        const float *input = bottom->data + n * bottom->count(1);
+        float *output = top->data + n * top->count(1);
+
+        //im2col、量化等对整个输入做一次，之后按输出通道分给各线程，每段是4的倍数
+        prepareInput(input);
+        parallelFor(threadPool, param.num_output, [&](int begin, int end, int thread) {
+            forwardChannels(input, output, begin, end, thread);
+            addBiasReLU(output, begin, end);
+        }, 4);
+    }
+}
+
+void CpuConvolutionLayer::prepareInput(const float *input)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inC = bottom->channels / param.group;
+    int inSpatial = bottom->height * bottom->width;
+    size_t colSize = (size_t)inC * param.kernel_h * param.kernel_w * top->height * top->width;
+
+    if(precision == kCpuINT8) {
+        size_t inCount = bottom->count(1);
+        float invScale = 1.0f / inputScale;
+        for(size_t i = 0; i < inCount; i++) {
+            int8Input[i] = quantize(input[i], invScale);
+        }
+        if(!isDepthwise() && !pointwise) {
+            for(int g = 0; g < param.group; g++) {
+                im2col(int8Input.data() + g * inC * inSpatial, inC, bottom->height, bottom->width, param,
+                       top->height, top->width, int8ColBuffer.data() + g * colSize);
+            }
+        }
+    }
+    else if(activeAlgo == kConvAlgoGemm && !pointwise) {
+        for(int g = 0; g < param.group; g++) {
+            im2col(input + g * inC * inSpatial, inC, bottom->height, bottom->width, param,
+                   top->height, top->width, colBuffer.data() + g * colSize);
+        }
+    }
+    else if(activeAlgo == kConvAlgoWinograd) {
+        transformWinogradInput(input);
+    }
+}
+
+void CpuConvolutionLayer::forwardChannels(const float *input, float *output, int begin, int end, int thread)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    if(precision == kCpuINT8) {
+        forwardInt8(output, begin, end, thread);
+    }
+    else if(activeAlgo == kConvAlgoSpecialized) {
+        int inSpatial = bottom->height * bottom->width;
+        int outSpatial = top->height * top->width;
+        int perOutput = weights.size() / param.num_output;
+
+        CpuConvShape shape;
+        shape.inC = bottom->channels;
+        shape.inH = bottom->height;
+        shape.inW = bottom->width;
+        shape.outC = end - begin;
+        shape.outH = top->height;
+        shape.outW = top->width;
+        shape.pad = param.pad_h;
+
+        //depthwise的输出通道只依赖同一个输入通道
+        const float *in = input;
+        if(isDepthwise()) {
+            in += begin * inSpatial;
+            shape.inC = end - begin;
+        }
+        specializedKernel(shape, in, weightData() + begin * perOutput, output + begin * outSpatial);
+    }
+    else if(activeAlgo == kConvAlgoDirect) {
+        forwardDepthwise(input, output, begin, end);
+    }
+    else if(activeAlgo == kConvAlgoWinograd) {
+        forwardWinograd(output, begin, end);
+    }
+    else {
+        forwardGemm(input, output, begin, end);
+    }
+}
+
+void CpuConvolutionLayer::addBiasReLU(float *output, int begin, int end)
+{
+    int spatial = tops[0]->height * tops[0]->width;
+    const vector<float> &biasData = image8Input != NULL ? image8Bias : bias;
+    for(int o = begin; o < end; o++) {
+        float *out = output + o * spatial;
+        float b = biasData.empty() ? 0 : biasData[o];
+        if(fusedReLU) {
+            for(int i = 0; i < spatial; i++) {
+                out[i] = std::max(out[i] + b, 0.0f);
+            }
+        }
+        else if(b != 0) {
+            for(int i = 0; i < spatial; i++) {
+                out[i] += b;
+            }
+        }
+    }
+}
+
+bool CpuConvolutionLayer::isDepthwise() const
+{
+    const CpuTensor *bottom = bottoms[0];
+    return param.group > 1 && param.group == bottom->channels && param.group == param.num_output;
+}
+
+void CpuConvolutionLayer::forwardGemm(const float *input, float *output, int begin, int end)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inC = bottom->channels / param.group;
+    int outC = param.num_output / param.group;
+    int inSpatial = bottom->height * bottom->width;
+    int outSpatial = top->height * top->width;
+    int K = inC * param.kernel_h * param.kernel_w;
+
+    //[begin, end)可能跨多个group
+    for(int g = begin / outC; g <= (end - 1) / outC; g++) {
+        int first = std::max(begin, g * outC);
+        int last = std::min(end, (g + 1) * outC);
+        const float *col = pointwise ? input + g * inC * inSpatial : colBuffer.data() + (size_t)g * K * outSpatial;
+
+        sgemm(last - first, outSpatial, K, weightData() + first * K, col, output + first * outSpatial, gemmBlockN);
+    }
+}
+
+void CpuConvolutionLayer::forwardDepthwise(const float *input, float *output, int begin, int end)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inH = bottom->height;
+    int inW = bottom->width;
+    int outH = top->height;
+    int outW = top->width;
+    int kernelSize = param.kernel_h * param.kernel_w;
+
+    for(int c = begin; c < end; c++) {
+        const float *in = input + c * inH * inW;
+        const float *w = weightData() + c * kernelSize;
+        float *out = output + c * outH * outW;
+
+        for(int oh = 0; oh < outH; oh++) {
+            for(int ow = 0; ow < outW; ow++) {
+                float sum = 0;
+                for(int kh = 0; kh < param.kernel_h; kh++) {
+                    int ih = oh * param.stride_h - param.pad_h + kh * param.dilate_h;
+                    if(ih < 0 || ih >= inH) {
+                        continue;
+                    }
+                    for(int kw = 0; kw < param.kernel_w; kw++) {
+                        int iw = ow * param.stride_w - param.pad_w + kw * param.dilate_w;
+                        if(iw < 0 || iw >= inW) {
+                            continue;
+                        }
+                        sum += in[ih * inW + iw] * w[kh * param.kernel_w + kw];
+                    }
+                }
+                out[oh * outW + ow] = sum;
+            }
+        }
+    }
+}
+
+//Winograd F(2x2, 3x3)：U = G g G^T，存成16个 num_output x channels 的矩阵
+void CpuConvolutionLayer::transformWinogradWeights()
+{
+    static const float G[4][3] = {{1, 0, 0}, {0.5f, 0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0, 0, 1}};
+
+    int inC = bottoms[0]->channels;
+    int outC = param.num_output;
+    winogradWeights.resize(16 * outC * inC);
+
+    for(int oc = 0; oc < outC; oc++) {
+        for(int ic = 0; ic < inC; ic++) {
+            const float *g = weights.data() + (oc * inC + ic) * 9;
+            float t[4][3];
+            for(int i = 0; i < 4; i++) {
+                for(int j = 0; j < 3; j++) {
+                    t[i][j] = G[i][0] * g[j] + G[i][1] * g[3 + j] + G[i][2] * g[6 + j];
+                }
+            }
+            for(int i = 0; i < 4; i++) {
+                for(int j = 0; j < 4; j++) {
+                    float u = t[i][0] * G[j][0] + t[i][1] * G[j][1] + t[i][2] * G[j][2];
+                    winogradWeights[((i * 4 + j) * outC + oc) * inC + ic] = u;
+                }
+            }
+        }
+    }
+}
+
+//输入每个4x4块做 V = B^T d B，16个位置各做一次GEMM，再做 Y = A^T M A 得到2x2输出
+//乘法次数是im2col的1/2.25
+void CpuConvolutionLayer::transformWinogradInput(const float *input)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inC = bottom->channels;
+    int inH = bottom->height;
+    int inW = bottom->width;
+    int tilesH = (top->height + 1) / 2;
+    int tilesW = (top->width + 1) / 2;
+    int tiles = tilesH * tilesW;
+
+    float *V = winogradInput.data();
+
+    for(int ic = 0; ic < inC; ic++) {
+        const float *in = input + ic * inH * inW;
+        for(int ty = 0; ty < tilesH; ty++) {
+            for(int tx = 0; tx < tilesW; tx++) {
+                float d[4][4];
+                for(int i = 0; i < 4; i++) {
+                    int y = ty * 2 - param.pad_h + i;
+                    for(int j = 0; j < 4; j++) {
+                        int x = tx * 2 - param.pad_w + j;
+                        d[i][j] = (y >= 0 && y < inH && x >= 0 && x < inW) ? in[y * inW + x] : 0;
+                    }
+                }
+
+                float t[4][4];
+                for(int j = 0; j < 4; j++) {
+                    t[0][j] = d[0][j] - d[2][j];
+                    t[1][j] = d[1][j] + d[2][j];
+                    t[2][j] = d[2][j] - d[1][j];
+                    t[3][j] = d[1][j] - d[3][j];
+                }
+
+                float *v = V + ic * tiles + ty * tilesW + tx;
+                size_t step = (size_t)inC * tiles;
+                for(int i = 0; i < 4; i++) {
+                    v[(i * 4 + 0) * step] = t[i][0] - t[i][2];
+                    v[(i * 4 + 1) * step] = t[i][1] + t[i][2];
+                    v[(i * 4 + 2) * step] = t[i][2] - t[i][1];
+                    v[(i * 4 + 3) * step] = t[i][1] - t[i][3];
+                }
+            }
+        }
+    }
+}
+
+void CpuConvolutionLayer::forwardWinograd(float *output, int begin, int end)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inC = bottom->channels;
+    int outC = param.num_output;
+    int outH = top->height;
+    int outW = top->width;
+    int tilesH = (outH + 1) / 2;
+    int tilesW = (outW + 1) / 2;
+    int tiles = tilesH * tilesW;
+
+    const float *V = winogradInput.data();
+    float *M = winogradOutput.data();
+
+    //每个位置只算[begin, end)这几行
+    for(int k = 0; k < 16; k++) {
+        sgemm(end - begin, tiles, inC, winogradWeights.data() + (k * outC + begin) * inC, V + k * inC * tiles,
+              M + (k * outC + begin) * tiles, gemmBlockN);
+    }
+
+    size_t step = (size_t)outC * tiles;
+    for(int oc = begin; oc < end; oc++) {
+        float *out = output + oc * outH * outW;
+        for(int ty = 0; ty < tilesH; ty++) {
+            for(int tx = 0; tx < tilesW; tx++) {
+                const float *m = M + oc * tiles + ty * tilesW + tx;
+                float s[2][4];
+                for(int j = 0; j < 4; j++) {
+                    s[0][j] = m[j * step] + m[(4 + j) * step] + m[(8 + j) * step];
+                    s[1][j] = m[(4 + j) * step] - m[(8 + j) * step] - m[(12 + j) * step];
+                }
+                for(int i = 0; i < 2; i++) {
+                    int y = ty * 2 + i;
+                    if(y >= outH) {
+                        break;
+                    }
+                    out[y * outW + tx * 2] = s[i][0] + s[i][1] + s[i][2];
+                    if(tx * 2 + 1 < outW) {
+                        out[y * outW + tx * 2 + 1] = s[i][1] - s[i][2] - s[i][3];
+                    }
+                }
+            }
+        }
+    }
+}
+
+//输入已经在prepareInput中量化(和im2col)
+void CpuConvolutionLayer::forwardInt8(float *output, int begin, int end, int thread)
+{
+    const CpuTensor *bottom = bottoms[0];
+    const CpuTensor *top = tops[0];
+
+    int inH = bottom->height;
+    int inW = bottom->width;
+    int outH = top->height;
+    int outW = top->width;
+
+    if(isDepthwise()) {
+        int kernelSize = param.kernel_h * param.kernel_w;
+        for(int c = begin; c < end; c++) {
+            const int8_t *in = int8Input.data() + c * inH * inW;
+            const int8_t *w = int8Weights.data() + c * kernelSize;
+            float *out = output + c * outH * outW;
+
+            for(int oh = 0; oh < outH; oh++) {
+                for(int ow = 0; ow < outW; ow++) {
+                    int32_t sum = 0;
+                    for(int kh = 0; kh < param.kernel_h; kh++) {
+                        int ih = oh * param.stride_h - param.pad_h + kh * param.dilate_h;
+                        if(ih < 0 || ih >= inH) {
+                            continue;
+                        }
+                        for(int kw = 0; kw < param.kernel_w; kw++) {
+                            int iw = ow * param.stride_w - param.pad_w + kw * param.dilate_w;
+                            if(iw < 0 || iw >= inW) {
+                                continue;
+                            }
+                            sum += in[ih * inW + iw] * w[kh * param.kernel_w + kw];
+                        }
+                    }
+                    out[oh * outW + ow] = sum * outputScales[c];
+                }
+            }
+        }
+        return;
+    }
+
+    int inC = bottom->channels / param.group;
+    int outC = param.num_output / param.group;
+    int K = inC * param.kernel_h * param.kernel_w;
+
+    for(int g = begin / outC; g <= (end - 1) / outC; g++) {
+        int first = std::max(begin, g * outC);
+        int last = std::min(end, (g + 1) * outC);
+        const int8_t *col = pointwise ? int8Input.data() + g * inC * inH * inW
+                                      : int8ColBuffer.data() + (size_t)g * K * outH * outW;
+
+        igemm(last - first, outH * outW, K, int8Weights.data() + first * K, col,
+              outputScales.data() + first, output + first * outH * outW, int8PackBuffers[thread].data());
+    }
+}
+
+//######################################################################
+//batchnorm
+//######################################################################
+
+CpuBatchNormLayer::CpuBatchNormLayer(const string &name, const vector<float> &scale, const vector<float> &shift)
+    : CpuLayer(name, "BatchNorm"), scale(scale), shift(shift)
+{
+}
+
+void CpuBatchNormLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    assert((int)scale.size() == bottom->channels);
+    tops[0]->reshape(bottom->num, bottom->channels, bottom->height, bottom->width);
+}
+
+void CpuBatchNormLayer::forward()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int spatial = bottom->height * bottom->width;
+
+    for(int n = 0; n < bottom->num; n++) {
+        for(int c = 0; c < bottom->channels; c++) {
+            size_t offset = (size_t)(n * bottom->channels + c) * spatial;
+            const float *in = bottom->data + offset;
+            float *out = tops[0]->data + offset;
+            for(int i = 0; i < spatial; i++) {
+                out[i] = in[i] * scale[c] + shift[c];
+            }
+        }
+    }
+}
+
+//######################################################################
+//activation
+//######################################################################
+
+CpuActivationLayer::CpuActivationLayer(const string &name, const string &actType)
+    : CpuLayer(name, "Activation"), actType(actType)
+{
+}
+
+void CpuActivationLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    tops[0]->reshape(bottom->num, bottom->channels, bottom->height, bottom->width);
+}
+
+void CpuActivationLayer::forward()
+{
+    const float *in = bottoms[0]->data;
+    float *out = tops[0]->data;
+    size_t cnt = bottoms[0]->count();
+
+    if(actType == "relu") {
+        for(size_t i = 0; i < cnt; i++) {
+            out[i] = std::max(in[i], 0.0f);
+        }
+    }
+    else if(actType == "sigmoid") {
+        for(size_t i = 0; i < cnt; i++) {
+            out[i] = 1.0f / (1.0f + expf(-in[i]));
+        }
+    }
+    else if(actType == "tanh") {
+        for(size_t i = 0; i < cnt; i++) {
+            out[i] = tanhf(in[i]);
+        }
+    }
+    else {
+        assert(false);
+    }
+}
+
+//######################################################################
+//upsampling
+//######################################################################
+
+CpuUpSamplingLayer::CpuUpSamplingLayer(const string &name, const string &sampleType, int scale,
+                                       const vector<float> &bilinearWeights)
+    : CpuLayer(name, "UpSampling"), sampleType(sampleType), scale(scale), weights(bilinearWeights)
+{
+    //与MXNet UpSampling(bilinear)对应的反卷积参数
+    kernel = 2 * scale - scale % 2;
+    pad = (int)ceil((scale - 1) / 2.0);
+}
+
+void CpuUpSamplingLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    tops[0]->reshape(bottom->num, bottom->channels, bottom->height * scale, bottom->width * scale);
+
+    //没有权重时使用MXNet Bilinear初始化的卷积核
+    if(sampleType == "bilinear" && weights.empty()) {
+        int f = (int)ceil(kernel / 2.0);
+        float c = (2 * f - 1 - f % 2) / (2.0f * f);
+        vector<float> kern(kernel * kernel);
+        for(int y = 0; y < kernel; y++) {
+            for(int x = 0; x < kernel; x++) {
+                kern[y * kernel + x] = (1 - fabs(x / (float)f - c)) * (1 - fabs(y / (float)f - c));
+            }
+        }
+        for(int ch = 0; ch < bottom->channels; ch++) {
+            weights.insert(weights.end(), kern.begin(), kern.end());
+        }
+    }
+}
+
+void CpuUpSamplingLayer::forward()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int spatial = bottom->height * bottom->width;
+    int outSpatial = spatial * scale * scale;
+
+    for(int n = 0; n < bottom->num; n++) {
+        for(int c = 0; c < bottom->channels; c++) {
+            const float *in = bottom->data + (size_t)(n * bottom->channels + c) * spatial;
+            float *out = tops[0]->data + (size_t)(n * bottom->channels + c) * outSpatial;
+            if(sampleType == "nearest") {
+                forwardNearest(in, out, bottom->height, bottom->width);
+            }
+            else {
+                forwardBilinear(in, out, weights.data() + c * kernel * kernel, bottom->height, bottom->width);
+            }
+        }
+    }
+}
+
+void CpuUpSamplingLayer::forwardNearest(const float *input, float *output, int height, int width)
+{
+    int outW = width * scale;
+    for(int h = 0; h < height; h++) {
+        float *row = output + h * scale * outW;
+        const float *in = input + h * width;
+        for(int w = 0; w < width; w++) {
+            for(int s = 0; s < scale; s++) {
+                row[w * scale + s] = in[w];
+            }
+        }
+        //其余行直接复制第一行
+        for(int s = 1; s < scale; s++) {
+            memcpy(row + s * outW, row, outW * sizeof(float));
+        }
+    }
+}
+
+void CpuUpSamplingLayer::forwardBilinear(const float *input, float *output, const float *weight,
+                                         int height, int width)
+{
+    int outH = height * scale;
+    int outW = width * scale;
+    memset(output, 0, outH * outW * sizeof(float));
+
+    for(int ih = 0; ih < height; ih++) {
+        for(int iw = 0; iw < width; iw++) {
+            float v = input[ih * width + iw];
+            for(int kh = 0; kh < kernel; kh++) {
+                int oh = ih * scale - pad + kh;
+                if(oh < 0 || oh >= outH) {
+                    continue;
+                }
+                for(int kw = 0; kw < kernel; kw++) {
+                    int ow = iw * scale - pad + kw;
+                    if(ow < 0 || ow >= outW) {
+                        continue;
+                    }
+                    output[oh * outW + ow] += v * weight[kh * kernel + kw];
+                }
+            }
+        }
+    }
+}
+
+//######################################################################
+//crop
+//######################################################################
+
+CpuCropLayer::CpuCropLayer(const string &name, int offsetH, int offsetW, int cropH, int cropW, bool centerCrop)
+    : CpuLayer(name, "Crop"), offsetH(offsetH), offsetW(offsetW), cropH(cropH), cropW(cropW),
+      centerCrop(centerCrop), beginH(0), beginW(0)
+{
+}
+
+void CpuCropLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int h = cropH;
+    int w = cropW;
+    if(bottoms.size() > 1) {
+        h = bottoms[1]->height;
+        w = bottoms[1]->width;
+    }
+    assert(h <= bottom->height && w <= bottom->width);
+
+    if(centerCrop) {
+        beginH = (bottom->height - h) / 2;
+        beginW = (bottom->width - w) / 2;
+    }
+    else {
+        beginH = offsetH;
+        beginW = offsetW;
+    }
+    assert(beginH + h <= bottom->height && beginW + w <= bottom->width);
+
+    tops[0]->reshape(bottom->num, bottom->channels, h, w);
+}
+
+void CpuCropLayer::forward()
+{
+    const CpuTensor *bottom = bottoms[0];
+    CpuTensor *top = tops[0];
+
+    for(int nc = 0; nc < bottom->num * bottom->channels; nc++) {
+        const float *in = bottom->data + (size_t)nc * bottom->height * bottom->width;
+        float *out = top->data + (size_t)nc * top->height * top->width;
+        for(int h = 0; h < top->height; h++) {
+            memcpy(out + h * top->width, in + (h + beginH) * bottom->width + beginW, top->width * sizeof(float));
+        }
+    }
+}
+
+//######################################################################
+//eltwise add
+//######################################################################
+
+CpuEltwiseAddLayer::CpuEltwiseAddLayer(const string &name)
+    : CpuLayer(name, "Eltwise")
+{
+}
+
+void CpuEltwiseAddLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    for(size_t i = 1; i < bottoms.size(); i++) {
+        assert(bottoms[i]->count() == bottom->count());
+    }
+    tops[0]->reshape(bottom->num, bottom->channels, bottom->height, bottom->width);
+}
+
+void CpuEltwiseAddLayer::forward()
+{
+    size_t cnt = bottoms[0]->count();
+    float *out = tops[0]->data;
+    memcpy(out, bottoms[0]->data, cnt * sizeof(float));
+    for(size_t b = 1; b < bottoms.size(); b++) {
+        const float *in = bottoms[b]->data;
+        for(size_t i = 0; i < cnt; i++) {
+            out[i] += in[i];
+        }
+    }
+}
+
+//######################################################################
+//concat
+//######################################################################
+
+CpuConcatLayer::CpuConcatLayer(const string &name, int axis)
+    : CpuLayer(name, "Concat"), axis(axis)
+{
+}
+
+void CpuConcatLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int dims[4] = {bottom->num, bottom->channels, bottom->height, bottom->width};
+    for(size_t i = 1; i < bottoms.size(); i++) {
+        int d[4] = {bottoms[i]->num, bottoms[i]->channels, bottoms[i]->height, bottoms[i]->width};
+        dims[axis] += d[axis];
+    }
+    tops[0]->reshape(dims[0], dims[1], dims[2], dims[3]);
+}
+
+void CpuConcatLayer::forward()
+{
+    CpuTensor *top = tops[0];
+    size_t outer = top->count() / top->count(axis);
+    float *out = top->data;
+
+    for(size_t o = 0; o < outer; o++) {
+        for(size_t i = 0; i < bottoms.size(); i++) {
+            size_t inner = bottoms[i]->count(axis);
+            memcpy(out, bottoms[i]->data + o * inner, inner * sizeof(float));
+            out += inner;
+        }
+    }
+}
+
+//######################################################################
+//softmax
+//######################################################################
+
+CpuSoftmaxLayer::CpuSoftmaxLayer(const string &name)
+    : CpuLayer(name, "Softmax")
+{
+}
+
+void CpuSoftmaxLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    tops[0]->reshape(bottom->num, bottom->channels, bottom->height, bottom->width);
+}
+
+void CpuSoftmaxLayer::forward()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int channels = bottom->channels;
+    int spatial = bottom->height * bottom->width;
+
+    for(int n = 0; n < bottom->num; n++) {
+        const float *in = bottom->data + n * bottom->count(1);
+        float *out = tops[0]->data + n * bottom->count(1);
+        for(int i = 0; i < spatial; i++) {
+            float maxVal = in[i];
+            for(int c = 1; c < channels; c++) {
+                maxVal = std::max(maxVal, in[c * spatial + i]);
+            }
+            float sum = 0;
+            for(int c = 0; c < channels; c++) {
+                out[c * spatial + i] = expf(in[c * spatial + i] - maxVal);
+                sum += out[c * spatial + i];
+            }
+            for(int c = 0; c < channels; c++) {
+                out[c * spatial + i] /= sum;
+            }
+        }
+    }
+}
+
+//######################################################################
+//reshape
+//######################################################################
+
+CpuReshapeLayer::CpuReshapeLayer(const string &name, const vector<int> &shape)
+    : CpuLayer(name, "Reshape"), shape(shape)
+{
+    assert(shape.size() <= 4);
+}
+
+void CpuReshapeLayer::reshape()
+{
+    const CpuTensor *bottom = bottoms[0];
+    int in[4] = {bottom->num, bottom->channels, bottom->height, bottom->width};
+    int out[4] = {1, 1, 1, 1};
+
+    int inferIndex = -1;
+    size_t known = 1;
+    for(size_t i = 0; i < shape.size(); i++) {
+        if(shape[i] == 0) {
+            out[i] = in[i];
+        }
+        else if(shape[i] == -1) {
+            assert(inferIndex < 0);
+            inferIndex = i;
+            continue;
+        }
+        else {
+            out[i] = shape[i];
+        }
+        known *= out[i];
+    }
+    if(inferIndex >= 0) {
+        out[inferIndex] = bottom->count() / known;
+    }
+
+    tops[0]->shareData(bottom, out[0], out[1], out[2], out[3]);
+}
+
+void CpuReshapeLayer::forward()
+{
+    //共享内存，无需计算
+}
@@ -0,0 +1,371 @@
+#ifndef CPULAYERS_H
+#define CPULAYERS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "cpuarena.h"
+#include "cputhreadpool.h"
+#include "cpupreprocess.h"
+
+using namespace std;
+
+//NCHW排列的张量，数据由storage或arena持有，也可以共享其他张量的内存
+class CpuTensor
+{
+public:
+    CpuTensor(const string &name);
+
+   /**
+    *	@brief  setArena	            之后reshape从arena分配内存
+    *   @param  arena		            为NULL时使用storage
+    *   @return
+    *
+    *   @note                           需在第一次reshape之前调用
+    */
+    void setArena(CpuArena *arena);
+
+   /**
+    *	@brief  reshape	                设置形状并分配内存
+    *   @param  n,c,h,w		            形状
+    *   @return
+    *
+    *   @note                           内存只增不减，batch变小时不会重新分配
+    */
+    void reshape(int n, int c, int h, int w);
+
+   /**
+    *	@brief  shareData	            设置形状并共享other的内存
+    *   @param  other		            被共享的张量
+    *   @return
+    *
+    *   @note                           other的元素个数必须与新形状一致
+    */
+    void shareData(const CpuTensor *other, int n, int c, int h, int w);
+
+    //只设置形状不分配内存，数据由使用者从别处读取(例如第一层直接读取BGR8图像)
+    void setShape(int n, int c, int h, int w);
+
+    size_t count() const;
+    size_t count(int axis) const;
+
+public:
+    string name;
+    int num;
+    int channels;
+    int height;
+    int width;
+    float *data;
+
+private:
+    vector<float> storage;
+    CpuArena *arena;
+    size_t capacity;
+};
+
+enum CpuPrecision
+{
+    kCpuFP32,
+    kCpuINT8
+};
+
+class CpuLayer
+{
+public:
+    CpuLayer(const string &name, const string &type);
+    virtual ~CpuLayer();
+
+    //根据输入形状计算输出形状并分配输出内存
+    virtual void reshape() = 0;
+    virtual void forward() = 0;
+
+    //把权重复制到arena，默认没有权重
+    virtual void setArena(CpuArena *arena);
+
+    //forward可以用的线程池，为NULL时单线程，在reshape之前设置
+    void setThreadPool(CpuThreadPool *pool);
+
+public:
+    string name;
+    string type;
+    vector<CpuTensor *> bottoms;
+    vector<CpuTensor *> tops;
+
+protected:
+    CpuThreadPool *threadPool;
+};
+
+//fp32卷积的实现方式，autotune时逐层测速选择
+enum CpuConvAlgo
+{
+    kConvAlgoDefault,       //有特化版本用特化版本，否则depthwise用direct，其他用gemm
+    kConvAlgoGemm,          //im2col + sgemm，分块大小可调
+    kConvAlgoDirect,        //逐像素直接计算，只用于depthwise
+    kConvAlgoWinograd,      //F(2x2, 3x3)，只用于3x3 stride 1的普通卷积
+    kConvAlgoSpecialized    //cpuconvkernels中编译期特化的版本
+};
+
+struct CpuConvParam
+{
+    int num_output;
+    int kernel_h;
+    int kernel_w;
+    int stride_h;
+    int stride_w;
+    int pad_h;
+    int pad_w;
+    int dilate_h;
+    int dilate_w;
+    int group;
+
+    CpuConvParam()
+    {
+        num_output = 0;
+        kernel_h = kernel_w = 1;
+        stride_h = stride_w = 1;
+        pad_h = pad_w = 0;
+        dilate_h = dilate_w = 1;
+        group = 1;
+    }
+};
+
+//编译期特化的卷积实现，见cpuconvkernels.h
+//output不含bias，bias和relu由调用方统一处理
+struct CpuConvShape;
+typedef void (*CpuConvKernel)(const CpuConvShape &shape, const float *input, const float *weights, float *output);
+typedef void (*CpuConvKernel8U)(const CpuConvShape &shape, const uint8_t *input, const float *weights,
+                                const float *padValues, float *output);
+
+class CpuConvolutionLayer : public CpuLayer
+{
+public:
+    CpuConvolutionLayer(const string &name, const CpuConvParam &param);
+
+   /**
+    *	@brief  setWeights	            设置卷积权重
+    *   @param  weights		            num_output * (channels / group) * kh * kw
+    *   @param  bias		            可以为空
+    *   @return
+    *
+    *   @note
+    */
+    void setWeights(const vector<float> &weights, const vector<float> &bias);
+
+   /**
+    *	@brief  foldBatchNorm	        把BatchNorm(以及Scale)合并进卷积
+    *   @param  scale		            每个输出通道的乘数
+    *   @param  shift		            每个输出通道的偏移
+    *   @return
+    *
+    *   @note                           y = scale * conv(x) + shift
+    */
+    void foldBatchNorm(const vector<float> &scale, const vector<float> &shift);
+
+    //卷积后直接做relu
+    void setFusedReLU(bool relu);
+
+   /**
+    *	@brief  setPrecision	        设置计算精度
+    *   @param  precision		        kCpuFP32或kCpuINT8
+    *   @param  inputScale		        INT8时输入张量的量化系数(amax / 127)，来自校准表
+    *   @return
+    *
+    *   @note                           权重按输出通道对称量化，累加用int32
+    */
+    void setPrecision(CpuPrecision precision, float inputScale = 0);
+    CpuPrecision getPrecision() const;
+
+   /**
+    *	@brief  setAlgorithm	        设置fp32时的实现方式
+    *   @param  algo		            不适用于当前卷积时按kConvAlgoDefault处理
+    *   @param  gemmBlockN		        kConvAlgoGemm/kConvAlgoWinograd时sgemm的列分块，32/64/128
+    *   @return
+    *
+    *   @note                           设置后需要重新reshape
+    */
+    void setAlgorithm(CpuConvAlgo algo, int gemmBlockN = 64);
+    CpuConvAlgo getAlgorithm() const;
+    int getGemmBlockN() const;
+
+    //当前输入形状下可用的实现方式
+    vector<CpuConvAlgo> getCandidateAlgorithms() const;
+
+   /**
+    *	@brief  setImage8Input	        直接读取uint8图像，不再读取输入张量
+    *   @param  data		            maxBatchSize张 H x W x imageChannels 的图像，NULL表示恢复读取输入张量
+    *   @param  imageChannels		    3为BGR8交错排列；1为单通道(灰度/红外)，等价于把它复制成三个通道
+    *   @param  norm		            输入归一化，合并进权重和bias
+    *   @return                         卷积形状不支持时返回false
+    *
+    *   @note                           只用于输入层之后的第一个卷积，需在权重确定(BatchNorm合并)之后调用
+    *                                   该层始终按fp32计算，精度和实现方式的设置不起作用
+    *                                   单通道时三个输入通道的权重求和成一个，计算量和输入读取都是三分之一
+    */
+    bool setImage8Input(const uint8_t *data, int imageChannels, const CpuNormalizeParam &norm);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+    virtual void setArena(CpuArena *arena) override;
+
+private:
+    //整个输入只做一次的准备：量化、im2col、winograd输入变换
+    void prepareInput(const float *input);
+    //计算输出通道[begin, end)，thread是parallelFor的线程序号
+    void forwardChannels(const float *input, float *output, int begin, int end, int thread);
+    void addBiasReLU(float *output, int begin, int end);
+    void forwardImage8();
+    bool isDepthwise() const;
+
+    void forwardGemm(const float *input, float *output, int begin, int end);
+    void forwardDepthwise(const float *input, float *output, int begin, int end);
+    void forwardWinograd(float *output, int begin, int end);
+    void forwardInt8(float *output, int begin, int end, int thread);
+    void transformWinogradWeights();
+    void transformWinogradInput(const float *input);
+    const float *weightData() const;
+
+private:
+    CpuConvParam param;
+    bool fusedReLU;
+    vector<float> weights;
+    vector<float> bias;
+    vector<float> colBuffer;        //group * K * outSpatial
+    bool pointwise;
+    CpuConvKernel specializedKernel;
+    float *arenaWeights;            //weights在arena中的副本，fp32前向时使用
+
+    const uint8_t *image8Input;
+    int image8Channels;
+    CpuConvKernel8U image8Kernel;
+    vector<float> image8Weights;    //BGR顺序(单通道时按通道求和)，除以scale * std
+    vector<float> image8Bias;       //bias减去均值的贡献
+    vector<float> image8PadValues;  //归一化后为0的像素值，即means * scale
+
+    CpuConvAlgo algo;
+    CpuConvAlgo activeAlgo;         //reshape时根据algo和形状确定
+    int gemmBlockN;
+    vector<float> winogradWeights;  //16 * num_output * channels
+    vector<float> winogradInput;    //16 * channels * tiles
+    vector<float> winogradOutput;   //16 * num_output * tiles
+
+    CpuPrecision precision;
+    float inputScale;
+    vector<int8_t> int8Weights;
+    vector<float> outputScales;
+    vector<int8_t> int8Input;
+    vector<int8_t> int8ColBuffer;
+    vector<vector<int16_t> > int8PackBuffers;   //每个线程一个
+};
+
+//无法合并进卷积时单独计算 y = scale * x + shift
+class CpuBatchNormLayer : public CpuLayer
+{
+public:
+    CpuBatchNormLayer(const string &name, const vector<float> &scale, const vector<float> &shift);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    vector<float> scale;
+    vector<float> shift;
+};
+
+class CpuActivationLayer : public CpuLayer
+{
+public:
+    CpuActivationLayer(const string &name, const string &actType);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    string actType;
+};
+
+//nearest直接复制像素，bilinear等价于固定权重的depthwise反卷积
+class CpuUpSamplingLayer : public CpuLayer
+{
+public:
+    CpuUpSamplingLayer(const string &name, const string &sampleType, int scale,
+                       const vector<float> &bilinearWeights = vector<float>());
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    void forwardNearest(const float *input, float *output, int height, int width);
+    void forwardBilinear(const float *input, float *output, const float *weight, int height, int width);
+
+private:
+    string sampleType;
+    int scale;
+    int kernel;
+    int pad;
+    vector<float> weights;
+};
+
+//两个输入时裁剪到第二个输入的大小，一个输入时裁剪到h_w
+class CpuCropLayer : public CpuLayer
+{
+public:
+    CpuCropLayer(const string &name, int offsetH, int offsetW, int cropH, int cropW, bool centerCrop);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    int offsetH;
+    int offsetW;
+    int cropH;
+    int cropW;
+    bool centerCrop;
+    int beginH;
+    int beginW;
+};
+
+class CpuEltwiseAddLayer : public CpuLayer
+{
+public:
+    CpuEltwiseAddLayer(const string &name);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+};
+
+class CpuConcatLayer : public CpuLayer
+{
+public:
+    CpuConcatLayer(const string &name, int axis);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    int axis;
+};
+
+//mode=channel，在通道维度上做softmax
+class CpuSoftmaxLayer : public CpuLayer
+{
+public:
+    CpuSoftmaxLayer(const string &name);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+};
+
+//MXNet reshape语义：0表示保持该维，-1表示自动推断，输出共享输入内存
+class CpuReshapeLayer : public CpuLayer
+{
+public:
+    CpuReshapeLayer(const string &name, const vector<int> &shape);
+
+    virtual void reshape() override;
+    virtual void forward() override;
+
+private:
+    vector<int> shape;
+};
+
+#endif // CPULAYERS_H
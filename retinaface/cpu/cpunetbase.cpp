@@ -0,0 +1,573 @@
+#include "cpunetbase.h"
+#include "mxnetloader.h"
+#include "timer.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+uint32_t CpuNetBase::getBatchSize() const
+{
+    return batchSize;
+}
+
+uint32_t CpuNetBase::getMaxBatchSize() const
+{
+    return maxBatchSize;
+}
+
+int CpuNetBase::getNetWidth() const
+{
+    return netWidth;
+}
+
+int CpuNetBase::getNetHeight() const
+{
+    return netHeight;
+}
+
+int CpuNetBase::getChannel() const
+{
+    return channel;
+}
+
+float *&CpuNetBase::getInputBuf()
+{
+    return inputBuffer;
+}
+
+void CpuNetBase::setImage8Input(int imageChannels, const CpuNormalizeParam &norm)
+{
+    image8Channels = imageChannels;
+    image8Norm = norm;
+}
+
+uint8_t *CpuNetBase::getImage8InputBuf()
+{
+    return image8InputBuffer;
+}
+
+int CpuNetBase::getImage8Channels() const
+{
+    return image8InputBuffer != NULL ? image8Channels : 0;
+}
+
+CpuNetBase::CpuNetBase(string netWorkName)
+{
+    maxBatchSize = 1;
+
+    batchSize = 0;
+    channel = 0;
+    netWidth = 0;
+    netHeight = 0;
+    maxNetWidth = 0;
+    maxNetHeight = 0;
+
+    inputBuffer = NULL;
+    inputTensor = NULL;
+    this->netWorkName = netWorkName;
+
+    profiler = new CpuProfiler();
+    enableCpuProfiler = false;
+    foldLayers = true;
+    arena = NULL;
+    threadPool = NULL;
+    image8Channels = 0;
+    image8InputBuffer = NULL;
+}
+
+CpuNetBase::~CpuNetBase()
+{
+    delete profiler;
+
+    for(size_t i = 0; i < layers.size(); i++) {
+        delete layers[i];
+    }
+    for(size_t i = 0; i < tensors.size(); i++) {
+        delete tensors[i];
+    }
+    delete threadPool;
+    delete arena;
+}
+
+void CpuNetBase::setAffinity(const CpuAffinity &affinity)
+{
+    this->affinity = affinity;
+}
+
+CpuThreadPool *CpuNetBase::getThreadPool()
+{
+    return threadPool;
+}
+
+void CpuNetBase::buildCpuContext(const std::string &symbolfile, const std::string &paramsfile)
+{
+    symbolFile = symbolfile;
+    paramsFile = paramsfile;
+
+    MXNetLoader loader;
+    loader.setFoldLayers(foldLayers);
+    if(!loader.loadSymbol(symbolfile) || !loader.loadParams(paramsfile)) {
+        printf("load mxnet model failed, exit!\n");
+        exit(0);
+    }
+
+    if(!loader.createNet(layers, tensors, inputTensor)) {
+        printf("create cpu net failed, exit!\n");
+        exit(0);
+    }
+
+    printf("batchSize:%d, channel:%d, netHeight:%d, netWidth:%d.\n", maxBatchSize, channel, netHeight, netWidth);
+    maxNetWidth = netWidth;
+    maxNetHeight = netHeight;
+
+    //张量和卷积权重放在大页内存上，减少TLB miss；指定节点时内存也绑定到该节点
+    arena = new CpuArena(32 << 20, affinity.numaNode);
+    int numThreads = affinity.numThreads > 0 ? affinity.numThreads : std::max<int>(1, affinity.cpus.size());
+    //单线程时直接在调用线程上计算
+    threadPool = numThreads > 1 ? new CpuThreadPool(numThreads, affinity.cpus) : NULL;
+    printf("cpu threads:%d, numa node:%d.\n", numThreads, affinity.numaNode);
+    for(size_t i = 0; i < tensors.size(); i++) {
+        tensors[i]->setArena(arena);
+    }
+    for(size_t i = 0; i < layers.size(); i++) {
+        layers[i]->setArena(arena);
+        layers[i]->setThreadPool(threadPool);
+    }
+
+    //第一层卷积直接读取uint8图像，fp32输入张量只有形状
+    if(image8Channels > 0) {
+        CpuConvolutionLayer *first = NULL;
+        int consumers = 0;
+        for(size_t i = 0; i < layers.size(); i++) {
+            for(size_t j = 0; j < layers[i]->bottoms.size(); j++) {
+                if(layers[i]->bottoms[j] == inputTensor) {
+                    first = dynamic_cast<CpuConvolutionLayer *>(layers[i]);
+                    consumers++;
+                }
+            }
+        }
+
+        inputTensor->setShape(maxBatchSize, channel, netHeight, netWidth);
+        uint8_t *buffer = (uint8_t *)arena->allocate((size_t)maxBatchSize * netHeight * netWidth * image8Channels);
+        if(consumers == 1 && first != NULL && first->setImage8Input(buffer, image8Channels, image8Norm)) {
+            image8InputBuffer = buffer;
+            printf("%s reads %d channel uint8 input directly.\n", first->name.c_str(), image8Channels);
+        }
+        else {
+            printf("uint8 input needs a single 3x3 convolution on the input, use fp32 input.\n");
+            image8Channels = 0;
+        }
+    }
+
+    //按最大批量分配一次，之后输入地址不变
+    reshape(maxBatchSize);
+    inputBuffer = image8Channels > 0 ? NULL : inputTensor->data;
+    arena->printStats();
+
+    allocateMemory();
+}
+
+void CpuNetBase::destroyCpuContext()
+{
+    releaseMemory();
+}
+
+bool CpuNetBase::setInputSize(int height, int width)
+{
+    if(height <= 0 || width <= 0 || height > maxNetHeight || width > maxNetWidth) {
+        printf("input size %dx%d exceeds %dx%d.\n", width, height, maxNetWidth, maxNetHeight);
+        return false;
+    }
+    if(height == netHeight && width == netWidth) {
+        return true;
+    }
+
+    //各张量的容量按最大尺寸分配过，变小时不会重新分配
+    netHeight = height;
+    netWidth = width;
+    reshape(batchSize > 0 ? batchSize : maxBatchSize);
+    return true;
+}
+
+void CpuNetBase::reshape(int batchSize)
+{
+    assert(batchSize > 0 && batchSize <= (int)maxBatchSize);
+
+    this->batchSize = batchSize;
+    if(image8Channels > 0) {
+        inputTensor->setShape(batchSize, channel, netHeight, netWidth);
+    }
+    else {
+        inputTensor->reshape(batchSize, channel, netHeight, netWidth);
+    }
+    for(size_t i = 0; i < layers.size(); i++) {
+        layers[i]->reshape();
+    }
+}
+
+void CpuNetBase::forward()
+{
+    if(!enableCpuProfiler) {
+        for(size_t i = 0; i < layers.size(); i++) {
+            layers[i]->forward();
+        }
+        return;
+    }
+
+    RK::Timer timer;
+    for(size_t i = 0; i < layers.size(); i++) {
+        timer.reset();
+        layers[i]->forward();
+        profiler->reportLayerTime(layers[i]->name.c_str(), timer.elapsedMicroSeconds() / 1000.0f);
+    }
+}
+
+bool CpuNetBase::loadCalibrationTable(const string &calibrationTable)
+{
+    ifstream input(calibrationTable);
+    if(!input.good()) {
+        return false;
+    }
+
+    calibrationScales.clear();
+    string line;
+    //第一行是TRT-5102-EntropyCalibration2
+    getline(input, line);
+    while(getline(input, line)) {
+        size_t pos = line.rfind(':');
+        if(pos == string::npos) {
+            continue;
+        }
+
+        string name = line.substr(0, pos);
+        uint32_t hex = strtoul(line.c_str() + pos + 1, NULL, 16);
+        float scale;
+        memcpy(&scale, &hex, sizeof(scale));
+        calibrationScales[name] = scale;
+    }
+
+    return !calibrationScales.empty();
+}
+
+int CpuNetBase::setLayerPrecision(const string &layerName, CpuPrecision precision)
+{
+    bool prefix = !layerName.empty() && layerName[layerName.size() - 1] == '*';
+    string key = prefix ? layerName.substr(0, layerName.size() - 1) : layerName;
+
+    int count = 0;
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->type != "Convolution") {
+            continue;
+        }
+        if(prefix ? layers[i]->name.compare(0, key.size(), key) != 0 : layers[i]->name != key) {
+            continue;
+        }
+
+        CpuConvolutionLayer *conv = static_cast<CpuConvolutionLayer *>(layers[i]);
+        if(precision == kCpuINT8) {
+            map<string, float>::iterator it = calibrationScales.find(conv->bottoms[0]->name);
+            if(it == calibrationScales.end() || it->second <= 0) {
+                printf("layer %s has no calibration scale, keep fp32.\n", conv->name.c_str());
+                continue;
+            }
+            conv->setPrecision(kCpuINT8, it->second);
+        }
+        else {
+            conv->setPrecision(kCpuFP32);
+        }
+        count++;
+    }
+
+    //重新分配int8缓冲
+    if(count > 0 && batchSize > 0) {
+        reshape(batchSize);
+    }
+
+    return count;
+}
+
+CpuPrecision CpuNetBase::getLayerPrecision(const string &layerName)
+{
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->name == layerName && layers[i]->type == "Convolution") {
+            return static_cast<CpuConvolutionLayer *>(layers[i])->getPrecision();
+        }
+    }
+    return kCpuFP32;
+}
+
+vector<string> CpuNetBase::getLayerNames(const string &type)
+{
+    vector<string> names;
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(type.empty() || layers[i]->type == type) {
+            names.push_back(layers[i]->name);
+        }
+    }
+    return names;
+}
+
+bool CpuNetBase::loadPrecisionConfig(const string &configFile, const string &calibrationTable)
+{
+    ifstream input(configFile);
+    if(!input.good()) {
+        printf("Can not open precision config, use fp32 infer mode.\n");
+        return false;
+    }
+
+    if(!loadCalibrationTable(calibrationTable)) {
+        printf("Can not open CalibrationTable, use fp32 infer mode.\n");
+        return false;
+    }
+
+    int int8Layers = 0;
+    string line;
+    while(getline(input, line)) {
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        istringstream iss(line);
+        string name, mode;
+        if(!(iss >> name >> mode)) {
+            continue;
+        }
+
+        if(mode == "INT8") {
+            int8Layers += setLayerPrecision(name, kCpuINT8);
+        }
+        else if(mode == "FP32") {
+            setLayerPrecision(name, kCpuFP32);
+        }
+        else {
+            printf("unknown precision %s for layer %s.\n", mode.c_str(), name.c_str());
+        }
+    }
+
+    printf("mixed precision: %d int8 layers.\n", int8Layers);
+    return true;
+}
+
+bool CpuNetBase::savePrecisionConfig(const string &configFile)
+{
+    ofstream output(configFile);
+    if(!output.good()) {
+        return false;
+    }
+
+    output << "# layer_name precision" << endl;
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->type != "Convolution") {
+            continue;
+        }
+        CpuConvolutionLayer *conv = static_cast<CpuConvolutionLayer *>(layers[i]);
+        output << conv->name << " " << (conv->getPrecision() == kCpuINT8 ? "INT8" : "FP32") << endl;
+    }
+
+    return true;
+}
+
+static string getCpuModelName()
+{
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while(getline(cpuinfo, line)) {
+        if(line.compare(0, 10, "model name") == 0) {
+            size_t pos = line.find(':');
+            if(pos != string::npos) {
+                return line.substr(pos + 2);
+            }
+        }
+    }
+    return "unknown";
+}
+
+//文件大小和修改时间，模型文件被替换后缓存随之失效
+static string getFileStamp(const string &path)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        return "missing";
+    }
+    char stamp[64];
+    snprintf(stamp, sizeof(stamp), "%lld %lld", (long long)st.st_size, (long long)st.st_mtime);
+    return stamp;
+}
+
+static const char *convAlgoNames[] = {"default", "gemm", "direct", "winograd", "specialized"};
+
+bool CpuNetBase::autotune(const string &tuneFile)
+{
+    //缓存头：cpu型号、输入大小、模型文件、逐层精度、线程数，任何一项变化都重新调优
+    vector<string> header;
+    header.push_back("# cpu: " + getCpuModelName());
+    char buf[64];
+    snprintf(buf, sizeof(buf), "# input: %dx%dx%d", channel, netHeight, netWidth);
+    header.push_back(buf);
+    header.push_back("# model: " + getFileStamp(symbolFile) + " " + getFileStamp(paramsFile));
+    //按层名和精度做FNV-1a哈希，混合精度配置改变时不同
+    uint64_t precisionHash = 14695981039346656037ULL;
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->type != "Convolution") {
+            continue;
+        }
+        CpuConvolutionLayer *conv = static_cast<CpuConvolutionLayer *>(layers[i]);
+        string key = conv->name + (conv->getPrecision() == kCpuINT8 ? ":int8;" : ":fp32;");
+        for(size_t c = 0; c < key.size(); c++) {
+            precisionHash = (precisionHash ^ (uint8_t)key[c]) * 1099511628211ULL;
+        }
+    }
+    snprintf(buf, sizeof(buf), "# precision: %016llx", (unsigned long long)precisionHash);
+    header.push_back(buf);
+    snprintf(buf, sizeof(buf), "# threads: %d", threadPool ? threadPool->getNumThreads() : 1);
+    header.push_back(buf);
+
+    ifstream input(tuneFile);
+    if(input.good()) {
+        bool matched = true;
+        for(size_t i = 0; i < header.size() && matched; i++) {
+            string cached;
+            matched = getline(input, cached) && cached == header[i];
+        }
+        if(matched) {
+            printf("Using cached cpu tuning.\n");
+            string line;
+            while(getline(input, line)) {
+                istringstream iss(line);
+                string name, algoName;
+                int blockN = 64;
+                if(line.empty() || line[0] == '#' || !(iss >> name >> algoName >> blockN)) {
+                    continue;
+                }
+                for(size_t i = 0; i < layers.size(); i++) {
+                    if(layers[i]->name != name || layers[i]->type != "Convolution") {
+                        continue;
+                    }
+                    for(int a = 0; a <= kConvAlgoSpecialized; a++) {
+                        if(algoName == convAlgoNames[a]) {
+                            static_cast<CpuConvolutionLayer *>(layers[i])->setAlgorithm((CpuConvAlgo)a, blockN);
+                        }
+                    }
+                }
+            }
+            reshape(batchSize);
+            return true;
+        }
+    }
+
+    printf("Create cpu tuning cache.\n");
+
+    //按单张图测速，先跑一遍使每层输入都是真实的形状
+    int tuneBatchSize = batchSize;
+    reshape(1);
+    forward();
+
+    const int blockNs[] = {32, 64, 128};
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->type != "Convolution") {
+            continue;
+        }
+        CpuConvolutionLayer *conv = static_cast<CpuConvolutionLayer *>(layers[i]);
+        if(conv->getPrecision() != kCpuFP32) {
+            continue;
+        }
+
+        CpuConvAlgo bestAlgo = kConvAlgoDefault;
+        int bestBlockN = 64;
+        int64_t bestTime = -1;
+        vector<CpuConvAlgo> algos = conv->getCandidateAlgorithms();
+        for(size_t a = 0; a < algos.size(); a++) {
+            bool tiled = algos[a] == kConvAlgoGemm || algos[a] == kConvAlgoWinograd;
+            for(int b = 0; b < (tiled ? 3 : 1); b++) {
+                int blockN = tiled ? blockNs[b] : 64;
+                conv->setAlgorithm(algos[a], blockN);
+                conv->reshape();
+                conv->forward();
+
+                //取3次中最快的一次，减少抖动
+                int64_t time = -1;
+                for(int r = 0; r < 3; r++) {
+                    RK::Timer timer;
+                    conv->forward();
+                    int64_t t = timer.elapsedNanoSeconds();
+                    time = (time < 0 || t < time) ? t : time;
+                }
+                if(bestTime < 0 || time < bestTime) {
+                    bestTime = time;
+                    bestAlgo = algos[a];
+                    bestBlockN = blockN;
+                }
+            }
+        }
+
+        conv->setAlgorithm(bestAlgo, bestBlockN);
+        conv->reshape();
+    }
+
+    reshape(tuneBatchSize);
+
+    ofstream output(tuneFile);
+    if(!output.good()) {
+        printf("Can not write cpu tuning cache %s.\n", tuneFile.c_str());
+        return false;
+    }
+    for(size_t i = 0; i < header.size(); i++) {
+        output << header[i] << endl;
+    }
+    for(size_t i = 0; i < layers.size(); i++) {
+        if(layers[i]->type != "Convolution") {
+            continue;
+        }
+        CpuConvolutionLayer *conv = static_cast<CpuConvolutionLayer *>(layers[i]);
+        output << conv->name << " " << convAlgoNames[conv->getAlgorithm()] << " " << conv->getGemmBlockN() << endl;
+    }
+
+    return false;
+}
+
+void CpuNetBase::setCpuProfilerEnabled(const bool &enableCpuProfiler)
+{
+    this->enableCpuProfiler = enableCpuProfiler;
+}
+
+CpuProfiler *CpuNetBase::getProfiler()
+{
+    return profiler;
+}
+
+CpuTensor *CpuNetBase::tensor_by_name(const string &name)
+{
+    for(size_t i = 0; i < tensors.size(); i++) {
+        if(tensors[i]->name == name) {
+            return tensors[i];
+        }
+    }
+    return NULL;
+}
+
+CpuArenaStats CpuNetBase::getArenaStats() const
+{
+    if(arena == NULL) {
+        CpuArenaStats stats;
+        memset(&stats, 0, sizeof(stats));
+        return stats;
+    }
+    return arena->getStats();
+}
+
+void CpuNetBase::setFoldLayers(const bool &foldLayers)
+{
+    this->foldLayers = foldLayers;
+}
+
+const vector<CpuTensor *> &CpuNetBase::getTensors() const
+{
+    return tensors;
+}
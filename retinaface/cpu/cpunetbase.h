@@ -0,0 +1,338 @@
+#ifndef CPUNETBASE_H
+#define CPUNETBASE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "cpulayers.h"
+#include "cpuutility.h"
+
+using namespace std;
+
+//与tensorRT的DimsCHW接口保持一致，方便共用后处理代码
+class CpuDims
+{
+public:
+    CpuDims(int c = 0, int h = 0, int w = 0)
+    {
+        d[0] = c;
+        d[1] = h;
+        d[2] = w;
+    }
+
+    int c() const { return d[0]; }
+    int h() const { return d[1]; }
+    int w() const { return d[2]; }
+
+private:
+    int d[3];
+};
+
+//推理线程和内存的位置，默认单线程、不绑定
+struct CpuAffinity
+{
+    int numThreads;         //工作线程数，<=0时取cpus的个数
+    vector<int> cpus;       //线程绑定的cpu，为空时不绑定
+    int numaNode;           //张量和权重内存绑定的节点，-1表示不绑定
+
+    CpuAffinity() : numThreads(1), numaNode(-1) {}
+};
+
+class CpuNetBase
+{
+public:
+   /**
+    *	@brief  getMaxBatchSize	        获取max批量处理数
+    *   @return                         返回max批量处理数
+    *
+    *   @note
+    */
+    uint32_t getMaxBatchSize() const;
+
+   /**
+    *	@brief  getBatchSize	        获取批量处理数
+    *   @return                         返回批量处理数
+    *
+    *   @note
+    */
+    uint32_t getBatchSize() const;
+
+   /**
+    *	@brief  getNetWidth	            获取网络宽度
+    *   @return                         返回网络宽度
+    *
+    *   @note
+    */
+    int getNetWidth() const;
+
+   /**
+    *	@brief  getNetHeight	        获取网络高度
+    *   @return                         返回网络高度
+    *
+    *   @note
+    */
+    int getNetHeight() const;
+
+   /**
+    *	@brief  getChannel	            获取网络通道数
+    *   @return                         返回网络通道数
+    *
+    *   @note
+    */
+    int getChannel() const;
+
+   /**
+    *	@brief  getInputBuf	            获取输入地址，大小为maxBatchSize张图
+    *   @return                         返回地址指针
+    *
+    *   @note                           直接写入该地址可以省掉一次拷贝
+    */
+    float*& getInputBuf();
+
+   /**
+    *	@brief  setImage8Input	         输入改为uint8图像，第一层卷积直接读取
+    *   @param  imageChannels		     3为BGR8交错排列；1为单通道(灰度/红外)，第一层三个通道的权重求和
+    *   @param  norm		             输入归一化，合并进第一层卷积
+    *   @return
+    *
+    *   @note                            需在buildCpuContext之前调用；之后fp32输入张量不再分配，
+    *                                    getInputBuf()返回NULL，改为写入getImage8InputBuf()
+    *                                    输入层之后不是单个支持的卷积时打印提示并保持fp32输入
+    */
+    void setImage8Input(int imageChannels, const CpuNormalizeParam &norm);
+
+   /**
+    *	@brief  getImage8InputBuf	     获取uint8输入地址，大小为maxBatchSize张 netHeight x netWidth x imageChannels
+    *   @return                          未启用uint8输入时返回NULL
+    *
+    *   @note
+    */
+    uint8_t *getImage8InputBuf();
+
+    //uint8输入的通道数，fp32输入时为0
+    int getImage8Channels() const;
+
+    CpuNetBase(std::string netWorkName);
+    virtual ~CpuNetBase();
+
+   /**
+    *	@brief  setAffinity	             设置推理线程数、绑定的cpu和NUMA节点
+    *   @param  affinity		         见CpuAffinity
+    *   @return
+    *
+    *   @note                            需在buildCpuContext之前调用
+    */
+    void setAffinity(const CpuAffinity &affinity);
+
+    //推理用的线程池，单线程时为NULL；推理之外的并行工作(如批量预处理)也可以交给它
+    CpuThreadPool *getThreadPool();
+
+   /**
+    *	@brief  setInputSize	         改变输入宽高，各层按新形状重新计算，不重新分配内存
+    *   @param  height		             输入高，不超过buildCpuContext时的netHeight
+    *   @param  width		             输入宽，不超过buildCpuContext时的netWidth
+    *   @return                          超过最大尺寸时返回false
+    *
+    *   @note                            之后getInputBuf()等按新尺寸紧密排列，getOutputWidth()等返回新的输出大小
+    */
+    bool setInputSize(int height, int width);
+
+   /**
+    *	@brief  buildCpuContext	         加载MXNet模型，创建CPU推理网络
+    *   @param  symbolfile		         xxx-symbol.json
+    *   @param  paramsfile		         xxx-0000.params
+    *   @return
+    *
+    *   @note
+    */
+    void buildCpuContext(const std::string &symbolfile, const std::string &paramsfile);
+
+   /**
+    *	@brief  destroyCpuContext	     销毁CPU推理网络
+    *   @return
+    *
+    *   @note
+    */
+    void destroyCpuContext();
+
+    /**
+     *	 @brief  doInference	        CPU推理函数
+     *   @param  batchSize		        批量数
+     *   @param  input		            数据输入，NULL表示已写入getInputBuf()
+     *   @return
+     *
+     *   @note
+     */
+    virtual void doInference(int batchSize, float *input = NULL) = 0;
+
+   /**
+    *	@brief  loadCalibrationTable	 读取INT8校准表
+    *   @param  calibrationTable		 TRT-5102-EntropyCalibration2格式，每行 name: hex(amax / 127)
+    *   @return                          成功返回true
+    *
+    *   @note                            与tensorrt共用INT8-Calibration-Tool生成的表
+    */
+    bool loadCalibrationTable(const std::string &calibrationTable);
+
+   /**
+    *	@brief  setLayerPrecision	     设置某个卷积层的计算精度
+    *   @param  layerName		         层名，以*结尾表示前缀匹配
+    *   @param  precision		         kCpuFP32或kCpuINT8
+    *   @return                          返回被设置的层数
+    *
+    *   @note                            INT8需要先加载校准表，输入不在表中的层保持fp32
+    */
+    int setLayerPrecision(const std::string &layerName, CpuPrecision precision);
+
+   /**
+    *	@brief  getLayerPrecision	     获取卷积层的计算精度
+    *   @param  layerName		         层名
+    *   @return
+    *
+    *   @note
+    */
+    CpuPrecision getLayerPrecision(const std::string &layerName);
+
+   /**
+    *	@brief  getLayerNames	         获取指定类型的层名
+    *   @param  type		             层类型，例如Convolution，为空时返回全部
+    *   @return                          按执行顺序排列的层名
+    *
+    *   @note
+    */
+    std::vector<std::string> getLayerNames(const std::string &type = "");
+
+   /**
+    *	@brief  loadPrecisionConfig	     加载混合精度配置
+    *   @param  configFile		         每行 layer_name INT8|FP32，#开头为注释
+    *   @param  calibrationTable		 INT8校准表
+    *   @return                          配置或校准表不存在时返回false，网络保持fp32
+    *
+    *   @note                            配置文件由Mixed-Precision-Tool生成
+    */
+    bool loadPrecisionConfig(const std::string &configFile, const std::string &calibrationTable);
+
+   /**
+    *	@brief  savePrecisionConfig	     保存当前每个卷积层的精度
+    *   @param  configFile		         输出文件
+    *   @return                          成功返回true
+    *
+    *   @note
+    */
+    bool savePrecisionConfig(const std::string &configFile);
+
+   /**
+    *	@brief  autotune	             逐层测速，为每个fp32卷积选择最快的实现和分块
+    *   @param  tuneFile		         调优缓存，一般放在模型旁边
+    *   @return                          使用了缓存返回true，重新调优返回false
+    *
+    *   @note                            缓存头记录cpu型号、输入大小、模型文件大小和修改时间、逐层精度和线程数，
+    *                                    任何一项不一致时重新调优并覆盖
+    *                                    需在设置精度之后调用，INT8的层不参与
+    */
+    bool autotune(const std::string &tuneFile);
+
+   /**
+    *	@brief  setCpuProfilerEnabled	 是否统计每层耗时
+    *   @param  enableCpuProfiler		 true表示是，false表示否
+    *   @return
+    *
+    *   @note
+    */
+    void setCpuProfilerEnabled(const bool &enableCpuProfiler);
+
+    CpuProfiler *getProfiler();
+
+   /**
+    *	@brief  setFoldLayers	         加载时是否把BatchNorm和relu合并进卷积
+    *   @param  foldLayers		         默认true，需在buildCpuContext之前调用
+    *   @return
+    *
+    *   @note                            INT8校准时关闭，每个中间张量都能得到量化系数
+    */
+    void setFoldLayers(const bool &foldLayers);
+
+    //网络中所有张量，forward之后可以读取中间结果
+    const std::vector<CpuTensor *> &getTensors() const;
+
+   /**
+    *	@brief  getArenaStats	         张量和权重内存的使用情况
+    *   @return                          其中hugeTlbBytes + transparentHugeBytes为实际落在大页上的大小
+    *
+    *   @note
+    */
+    CpuArenaStats getArenaStats() const;
+
+protected:
+   /**
+    *	@brief  reshape	                 按批量数重新计算各层形状
+    *   @param  batchSize		         批量数
+    *   @return
+    *
+    *   @note                            内存按maxBatchSize分配，之后不会再分配
+    */
+    void reshape(int batchSize);
+
+    void forward();
+
+    CpuTensor *tensor_by_name(const std::string &name);
+
+private:
+   /**
+    *	@brief  allocateMemory	         开辟内存空间
+    *   @return
+    *
+    *   @note					         子类必须实现
+    */
+    virtual void allocateMemory() = 0;
+
+   /**
+    *	@brief  releaseMemory	         释放内存空间
+    *   @return
+    *
+    *   @note					         子类必须实现
+    */
+    virtual void releaseMemory() = 0;
+
+protected:
+    unsigned int maxBatchSize;
+
+    int batchSize;
+    int channel;
+    int netWidth;
+    int netHeight;
+    int maxNetWidth;                //buildCpuContext时的输入大小，内存按它分配
+    int maxNetHeight;
+
+    std::vector<std::string> outputs;
+    float *inputBuffer;
+    std::string netWorkName;
+
+    std::string symbolFile;         //buildCpuContext加载的模型文件，autotune缓存据此判断模型是否变化
+    std::string paramsFile;
+
+    std::vector<CpuLayer *> layers;
+    std::vector<CpuTensor *> tensors;
+    CpuTensor *inputTensor;
+
+    //张量名 -> 量化系数
+    std::map<std::string, float> calibrationScales;
+
+    CpuProfiler *profiler;
+    bool enableCpuProfiler;
+    bool foldLayers;
+
+    //张量和权重的内存池
+    CpuArena *arena;
+
+    CpuAffinity affinity;
+    CpuThreadPool *threadPool;
+
+    //uint8输入，image8Channels为0时是fp32输入
+    int image8Channels;
+    CpuNormalizeParam image8Norm;
+    uint8_t *image8InputBuffer;
+};
+
+#endif // CPUNETBASE_H
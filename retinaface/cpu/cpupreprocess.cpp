@@ -0,0 +1,463 @@
+#include "cpupreprocess.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+//cv::resize INTER_LINEAR的取样位置：src = (dst + 0.5) * scale - 0.5，超出边界时取边上的像素
+static inline void linearCoord(int d, double scale, int size, int &s, float &f)
+{
+    double fs = (d + 0.5) * scale - 0.5;
+    s = (int)floor(fs);
+    f = (float)(fs - s);
+    if(s < 0) {
+        s = 0;
+        f = 0;
+    }
+    if(s >= size - 1) {
+        s = size - 1;
+        f = 0;
+    }
+}
+
+void orientedSize(int srcW, int srcH, const CpuOrientation &orientation, int &width, int &height)
+{
+    bool transpose = orientation.rotation == 90 || orientation.rotation == 270;
+    width = transpose ? srcH : srcW;
+    height = transpose ? srcW : srcH;
+}
+
+void letterboxSize(int srcW, int srcH, float scale, int dstW, int dstH, int &width, int &height)
+{
+    //与cv::resize(Size(), 1 / scale, 1 / scale)的取整一致
+    double inv = 1.0 / std::max(1.0f, scale);
+    width = std::min(dstW, std::max(1, (int)lround(srcW * inv)));
+    height = std::min(dstH, std::max(1, (int)lround(srcH * inv)));
+}
+
+//cv::resize INTER_LINEAR的双线性取样：先把源行水平插值成RGB平面(单通道输出时为一个平面)，缓存最近两行
+//相邻输出行共用源行时不重复读取，每个源像素只读一次
+//源行的读取和颜色转换由RowSource完成：operator()(sy, sampler, planes)
+class LinearSampler
+{
+public:
+    LinearSampler(int srcW, int srcH, float scale, int dstW, int dstH, int planes = 3)
+        : planes(planes), srcH(srcH)
+    {
+        letterboxSize(srcW, srcH, scale, dstW, dstH, width, height);
+        step = std::max(1.0f, scale);
+
+        //取样表和行缓存放在每个线程复用的缓冲里，同一线程同时只有一个取样器，稳定后不再分配内存
+        static thread_local vector<int> indexBuffer;
+        static thread_local vector<float> floatBuffer;
+        if(indexBuffer.size() < 2 * (size_t)width) {
+            indexBuffer.resize(2 * width);
+        }
+        if(floatBuffer.size() < (2 * planes + 1) * (size_t)width) {
+            floatBuffer.resize((2 * planes + 1) * width);
+        }
+        xIndex = indexBuffer.data();
+        xNext = indexBuffer.data() + width;
+        xWeight = floatBuffer.data();
+        for(int x = 0; x < width; x++) {
+            linearCoord(x, step, srcW, xIndex[x], xWeight[x]);
+            xNext[x] = std::min(xIndex[x] + 1, srcW - 1);
+        }
+
+        rows[0] = floatBuffer.data() + width;
+        rows[1] = floatBuffer.data() + (planes + 1) * width;
+        rowIndex[0] = -1;
+        rowIndex[1] = -1;
+    }
+
+    //第y行输出对应的上下两行(planes个平面，每个平面width个float)和垂直权重
+    template<typename RowSource>
+    void sampleRow(const RowSource &source, int y, const float *&top, const float *&bottom, float &fy)
+    {
+        int sy;
+        linearCoord(y, step, srcH, sy, fy);
+
+        if(rowIndex[0] != sy) {
+            if(rowIndex[1] == sy) {
+                std::swap(rows[0], rows[1]);
+                std::swap(rowIndex[0], rowIndex[1]);
+            }
+            else {
+                source(sy, *this, rows[0]);
+                rowIndex[0] = sy;
+            }
+        }
+        if(fy > 0 && rowIndex[1] != sy + 1) {
+            source(sy + 1, *this, rows[1]);
+            rowIndex[1] = sy + 1;
+        }
+
+        top = rows[0];
+        bottom = fy > 0 ? rows[1] : rows[0];
+    }
+
+public:
+    int width;
+    int height;
+    int planes;
+
+    //每个输出列的左右两个源像素和右边的权重，最右边xNext指向自己
+    int *xIndex;
+    int *xNext;
+    float *xWeight;
+
+private:
+    int srcH;
+    double step;
+
+    float *rows[2];
+    int rowIndex[2];
+};
+
+//正向图像坐标(u, v)对应的存储图像坐标：sx = x0 + u * ux + v * vx，sy = y0 + u * uy + v * vy
+struct OrientedAxes
+{
+    int x0, y0;
+    int ux, uy;
+    int vx, vy;
+
+    OrientedAxes(int srcW, int srcH, const CpuOrientation &orientation)
+    {
+        int width, height;
+        orientedSize(srcW, srcH, orientation, width, height);
+        switch(orientation.rotation) {
+        case 90:    //正向(u, v) = 存储(v, srcH - 1 - u)
+            x0 = 0; y0 = srcH - 1; ux = 0; uy = -1; vx = 1; vy = 0;
+            break;
+        case 180:
+            x0 = srcW - 1; y0 = srcH - 1; ux = -1; uy = 0; vx = 0; vy = -1;
+            break;
+        case 270:   //正向(u, v) = 存储(srcW - 1 - v, u)
+            x0 = srcW - 1; y0 = 0; ux = 0; uy = 1; vx = -1; vy = 0;
+            break;
+        default:
+            x0 = 0; y0 = 0; ux = 1; uy = 0; vx = 0; vy = 1;
+            break;
+        }
+        //镜像：u换成width - 1 - u
+        if(orientation.mirror) {
+            x0 += (width - 1) * ux;
+            y0 += (width - 1) * uy;
+            ux = -ux;
+            uy = -uy;
+        }
+    }
+};
+
+//按正向图像读取的一个平面：第v行第u个像素在origin + v * rowStep + u * pixelStep
+//不旋转时rowStep为行字节数，pixelStep为像素字节数；旋转90/270度时两者互换，按列读取存储图像
+struct OrientedPlane
+{
+    const uint8_t *origin;
+    ptrdiff_t rowStep;
+    ptrdiff_t pixelStep;
+
+    OrientedPlane(const uint8_t *src, size_t step, int channels, const OrientedAxes &axes)
+    {
+        origin = src + axes.y0 * (ptrdiff_t)step + axes.x0 * channels;
+        rowStep = axes.vy * (ptrdiff_t)step + axes.vx * channels;
+        pixelStep = axes.uy * (ptrdiff_t)step + axes.ux * channels;
+    }
+};
+
+//BGR8交错排列的源行
+struct BGRRowSource
+{
+    OrientedPlane plane;
+
+    void operator()(int sy, const LinearSampler &sampler, float *planes) const
+    {
+        const uint8_t *row = plane.origin + sy * plane.rowStep;
+        ptrdiff_t pixelStep = plane.pixelStep;
+        int width = sampler.width;
+        float *r = planes;
+        float *g = planes + width;
+        float *b = planes + 2 * width;
+        for(int x = 0; x < width; x++) {
+            const uint8_t *p0 = row + sampler.xIndex[x] * pixelStep;
+            const uint8_t *p1 = row + sampler.xNext[x] * pixelStep;
+            float f = sampler.xWeight[x];
+            float b0 = p0[0], g0 = p0[1], r0 = p0[2];
+            b[x] = b0 + (p1[0] - b0) * f;
+            g[x] = g0 + (p1[1] - g0) * f;
+            r[x] = r0 + (p1[2] - r0) * f;
+        }
+    }
+};
+
+//YUV420的源行，色度取所在2x2块的值(与cvtColor一致)，水平插值后再转RGB
+//转换是线性的，先插值再转换与先转换再插值只差在截断上，这样只转换缩小后的像素
+//旋转时色度块按存储图像的坐标取
+struct YUV420RowSource
+{
+    const uint8_t *y;
+    const uint8_t *u;
+    const uint8_t *v;
+    size_t yStride;
+    size_t uvStride;
+    int uvStep;
+    OrientedAxes axes;
+
+    void operator()(int sy, const LinearSampler &sampler, float *planes) const
+    {
+        int rowX = axes.x0 + sy * axes.vx;
+        int rowY = axes.y0 + sy * axes.vy;
+        int width = sampler.width;
+        float *r = planes;
+        float *g = planes + width;
+        float *b = planes + 2 * width;
+        for(int x = 0; x < width; x++) {
+            int x0 = rowX + sampler.xIndex[x] * axes.ux;
+            int y0 = rowY + sampler.xIndex[x] * axes.uy;
+            int x1 = rowX + sampler.xNext[x] * axes.ux;
+            int y1 = rowY + sampler.xNext[x] * axes.uy;
+            float f = sampler.xWeight[x];
+            float y00 = y[y0 * yStride + x0];
+            float yv = y00 + (y[y1 * yStride + x1] - y00) * f;
+            size_t c0 = (y0 / 2) * uvStride + (x0 / 2) * uvStep;
+            size_t c1 = (y1 / 2) * uvStride + (x1 / 2) * uvStep;
+            float u0 = u[c0], v0 = v[c0];
+            float uv = u0 + (u[c1] - u0) * f - 128;
+            float vv = v0 + (v[c1] - v0) * f - 128;
+
+            //BT.601 limited range，系数与OpenCV的COLOR_YUV2BGR_NV12/I420相同
+            float luma = std::max(0.0f, yv - 16) * 1.164f;
+            r[x] = std::min(255.0f, std::max(0.0f, luma + 1.596f * vv));
+            g[x] = std::min(255.0f, std::max(0.0f, luma - 0.813f * vv - 0.391f * uv));
+            b[x] = std::min(255.0f, std::max(0.0f, luma + 2.018f * uv));
+        }
+    }
+};
+
+//单通道(灰度/红外)的源行，取样器有三个平面时复制成三个相同的平面(等价于GRAY2BGR)
+//limitedRange时按BT.601把Y的16~235拉伸到0~255，与YUV转RGB后灰色像素的值一致
+struct GrayRowSource
+{
+    OrientedPlane plane;
+    bool limitedRange;
+
+    void operator()(int sy, const LinearSampler &sampler, float *planes) const
+    {
+        const uint8_t *row = plane.origin + sy * plane.rowStep;
+        ptrdiff_t pixelStep = plane.pixelStep;
+        int width = sampler.width;
+        for(int x = 0; x < width; x++) {
+            float v0 = row[sampler.xIndex[x] * pixelStep];
+            float v = v0 + (row[sampler.xNext[x] * pixelStep] - v0) * sampler.xWeight[x];
+            planes[x] = limitedRange ? std::min(255.0f, std::max(0.0f, v - 16) * 1.164f) : v;
+        }
+        for(int c = 1; c < sampler.planes; c++) {
+            memcpy(planes + c * width, planes, width * sizeof(float));
+        }
+    }
+};
+
+template<typename RowSource>
+static void letterboxToPlanar(const RowSource &source, LinearSampler &sampler,
+                              float *dst, int dstW, int dstH, const CpuNormalizeParam &norm)
+{
+    int width = sampler.width;
+    int height = sampler.height;
+
+    float mul[3], add[3], pad[3];
+    for(int c = 0; c < 3; c++) {
+        mul[c] = 1.0f / (norm.scale * norm.stds[2 - c]);
+        add[c] = -norm.means[2 - c] / norm.stds[2 - c];
+        pad[c] = add[c];
+    }
+
+    size_t planeSize = (size_t)dstW * dstH;
+    for(int y = 0; y < height; y++) {
+        const float *top, *bottom;
+        float fy;
+        sampler.sampleRow(source, y, top, bottom, fy);
+
+        for(int c = 0; c < 3; c++) {
+            const float *a = top + c * width;
+            const float *b = bottom + c * width;
+            float *out = dst + c * planeSize + (size_t)y * dstW;
+
+            int x = 0;
+#ifdef __AVX2__
+            __m256 vfy = _mm256_set1_ps(fy);
+            __m256 vmul = _mm256_set1_ps(mul[c]);
+            __m256 vadd = _mm256_set1_ps(add[c]);
+            for(; x + 8 <= width; x += 8) {
+                __m256 va = _mm256_loadu_ps(a + x);
+                __m256 vb = _mm256_loadu_ps(b + x);
+                __m256 v = _mm256_fmadd_ps(_mm256_sub_ps(vb, va), vfy, va);
+                _mm256_storeu_ps(out + x, _mm256_fmadd_ps(v, vmul, vadd));
+            }
+#endif
+            for(; x < width; x++) {
+                float v = a[x] + (b[x] - a[x]) * fy;
+                out[x] = v * mul[c] + add[c];
+            }
+            std::fill(out + width, out + dstW, pad[c]);
+        }
+    }
+
+    //下方补边
+    for(int c = 0; c < 3; c++) {
+        float *out = dst + c * planeSize + (size_t)height * dstW;
+        std::fill(out, dst + (c + 1) * planeSize, pad[c]);
+    }
+}
+
+template<typename RowSource>
+static void letterboxToBGR(const RowSource &source, LinearSampler &sampler, uint8_t *dst, int dstW, int dstH)
+{
+    int width = sampler.width;
+    int height = sampler.height;
+
+    for(int y = 0; y < height; y++) {
+        const float *top, *bottom;
+        float fy;
+        sampler.sampleRow(source, y, top, bottom, fy);
+
+        uint8_t *out = dst + (size_t)y * dstW * 3;
+        for(int c = 0; c < 3; c++) {
+            //平面是RGB，输出保持BGR
+            const float *a = top + (2 - c) * width;
+            const float *b = bottom + (2 - c) * width;
+            for(int x = 0; x < width; x++) {
+                float v = a[x] + (b[x] - a[x]) * fy;
+                out[x * 3 + c] = (uint8_t)std::min(255, (int)(v + 0.5f));
+            }
+        }
+        memset(out + width * 3, 0, (dstW - width) * 3);
+    }
+    memset(dst + (size_t)height * dstW * 3, 0, (size_t)(dstH - height) * dstW * 3);
+}
+
+template<typename RowSource>
+static void letterboxToGray(const RowSource &source, LinearSampler &sampler, uint8_t *dst, int dstW, int dstH)
+{
+    int width = sampler.width;
+    int height = sampler.height;
+
+    for(int y = 0; y < height; y++) {
+        const float *top, *bottom;
+        float fy;
+        sampler.sampleRow(source, y, top, bottom, fy);
+
+        uint8_t *out = dst + (size_t)y * dstW;
+        for(int x = 0; x < width; x++) {
+            float v = top[x] + (bottom[x] - top[x]) * fy;
+            out[x] = (uint8_t)std::min(255, (int)(v + 0.5f));
+        }
+        memset(out + width, 0, dstW - width);
+    }
+    memset(dst + (size_t)height * dstW, 0, (size_t)(dstH - height) * dstW);
+}
+
+void letterboxBGRToPlanar(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                          float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                          const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(srcW, srcH, orientation, width, height);
+    BGRRowSource source = {OrientedPlane(src, srcStep, 3, OrientedAxes(srcW, srcH, orientation))};
+    LinearSampler sampler(width, height, scale, dstW, dstH);
+    letterboxToPlanar(source, sampler, dst, dstW, dstH, norm);
+}
+
+void letterboxBGR(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                  uint8_t *dst, int dstW, int dstH, const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(srcW, srcH, orientation, width, height);
+    BGRRowSource source = {OrientedPlane(src, srcStep, 3, OrientedAxes(srcW, srcH, orientation))};
+    LinearSampler sampler(width, height, scale, dstW, dstH);
+    letterboxToBGR(source, sampler, dst, dstW, dstH);
+}
+
+void letterboxYUV420ToPlanar(const CpuYUV420Image &src, float scale,
+                             float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                             const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(src.width, src.height, orientation, width, height);
+    YUV420RowSource source = {src.y, src.u, src.v, src.yStride, src.uvStride, src.uvStep,
+                              OrientedAxes(src.width, src.height, orientation)};
+    LinearSampler sampler(width, height, scale, dstW, dstH);
+    letterboxToPlanar(source, sampler, dst, dstW, dstH, norm);
+}
+
+void letterboxYUV420ToBGR(const CpuYUV420Image &src, float scale, uint8_t *dst, int dstW, int dstH,
+                          const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(src.width, src.height, orientation, width, height);
+    YUV420RowSource source = {src.y, src.u, src.v, src.yStride, src.uvStride, src.uvStep,
+                              OrientedAxes(src.width, src.height, orientation)};
+    LinearSampler sampler(width, height, scale, dstW, dstH);
+    letterboxToBGR(source, sampler, dst, dstW, dstH);
+}
+
+void letterboxGrayToPlanar(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                           float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                           const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(srcW, srcH, orientation, width, height);
+    GrayRowSource source = {OrientedPlane(src, srcStep, 1, OrientedAxes(srcW, srcH, orientation)), false};
+    LinearSampler sampler(width, height, scale, dstW, dstH);
+    letterboxToPlanar(source, sampler, dst, dstW, dstH, norm);
+}
+
+void letterboxGray(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                   uint8_t *dst, int dstW, int dstH, const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(srcW, srcH, orientation, width, height);
+    GrayRowSource source = {OrientedPlane(src, srcStep, 1, OrientedAxes(srcW, srcH, orientation)), false};
+    LinearSampler sampler(width, height, scale, dstW, dstH, 1);
+    letterboxToGray(source, sampler, dst, dstW, dstH);
+}
+
+void letterboxYUV420ToGray(const CpuYUV420Image &src, float scale, uint8_t *dst, int dstW, int dstH,
+                           const CpuOrientation &orientation)
+{
+    int width, height;
+    orientedSize(src.width, src.height, orientation, width, height);
+    GrayRowSource source = {OrientedPlane(src.y, src.yStride, 1, OrientedAxes(src.width, src.height, orientation)), true};
+    LinearSampler sampler(width, height, scale, dstW, dstH, 1);
+    letterboxToGray(source, sampler, dst, dstW, dstH);
+}
+
+void flipLetterbox(const uint8_t *src, uint8_t *dst, int width, int height, int channels, int dstW, int dstH)
+{
+    size_t rowSize = (size_t)dstW * channels;
+    memcpy(dst, src, rowSize * dstH);
+    for(int y = 0; y < height; y++) {
+        const uint8_t *in = src + y * rowSize;
+        uint8_t *out = dst + y * rowSize;
+        for(int x = 0; x < width; x++) {
+            memcpy(out + x * channels, in + (width - 1 - x) * channels, channels);
+        }
+    }
+}
+
+void flipLetterboxPlanar(const float *src, float *dst, int width, int height, int dstW, int dstH)
+{
+    size_t planeSize = (size_t)dstW * dstH;
+    memcpy(dst, src, planeSize * 3 * sizeof(float));
+    for(int c = 0; c < 3; c++) {
+        for(int y = 0; y < height; y++) {
+            const float *in = src + c * planeSize + (size_t)y * dstW;
+            float *out = dst + c * planeSize + (size_t)y * dstW;
+            std::reverse_copy(in, in + width, out);
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef CPUPREPROCESS_H
+#define CPUPREPROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//输入归一化：网络输入第c个通道(RGB) = (bgr[2 - c] / scale - means[2 - c]) / stds[2 - c]
+//与insightface的python实现一致，means和stds按BGR顺序给出
+struct CpuNormalizeParam
+{
+    float means[3];
+    float stds[3];
+    float scale;
+};
+
+//YUV420图像(相机帧)，色度平面宽高各为一半
+//I420：u、v为两个平面，uvStep = 1；NV12：u指向UV交错平面，v = u + 1，uvStep = 2
+struct CpuYUV420Image
+{
+    const uint8_t *y;
+    const uint8_t *u;
+    const uint8_t *v;
+    size_t yStride;         //亮度每行字节数
+    size_t uvStride;        //色度每行字节数
+    int uvStep;             //同一色度平面相邻像素的间隔
+    int width;
+    int height;
+};
+
+//存储图像的方向：顺时针旋转rotation度(0/90/180/270，同cv::rotate)，再按mirror水平镜像，得到正向图像
+//letterbox按正向图像取样，旋转和镜像在取样时完成，不生成转正后的整幅图像
+struct CpuOrientation
+{
+    int rotation;
+    bool mirror;
+
+    CpuOrientation(int rotation = 0, bool mirror = false) : rotation(rotation), mirror(mirror) {}
+};
+
+//srcW x srcH的存储图像转正后的宽高
+void orientedSize(int srcW, int srcH, const CpuOrientation &orientation, int &width, int &height);
+
+/**
+*	@brief  letterboxSize	            letterbox后图像区域的大小，其余为补边
+*   @param  width		                输出，图像区域宽
+*   @param  height		                输出，图像区域高
+*   @return
+*
+*   @note                               与cv::resize(fx = fy = 1 / scale)的取整一致，其余参数同letterboxBGRToPlanar
+*/
+void letterboxSize(int srcW, int srcH, float scale, int dstW, int dstH, int &width, int &height);
+
+/**
+*	@brief  letterboxBGRToPlanar	    缩放、补边、BGR转RGB、归一化、转float、拆成平面，一次完成
+*   @param  src		                    BGR8交错排列的图像
+*   @param  srcW		                存储图像的宽
+*   @param  srcH		                存储图像的高
+*   @param  srcStep		                每行字节数
+*   @param  scale		                正向图像的缩小倍数，>=1，按cv::resize(fx = fy = 1 / scale)的双线性插值取样
+*   @param  dst		                    网络输入，3 x dstH x dstW
+*   @param  dstW		                网络输入宽
+*   @param  dstH		                网络输入高
+*   @param  norm		                归一化参数
+*   @param  orientation		            存储图像的方向，默认不旋转
+*   @return
+*
+*   @note                               图像放在左上角，右边和下边补黑色(与先补0再归一化一致)
+*                                       每个源像素只读一次，中间不产生整幅的临时图像
+*/
+void letterboxBGRToPlanar(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                          float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                          const CpuOrientation &orientation = CpuOrientation());
+
+/**
+*	@brief  letterboxBGR	            缩放、补边，输出仍是BGR8交错排列，给直接读取BGR8的第一层卷积使用
+*   @param  dst		                    dstH x dstW x 3
+*   @return
+*
+*   @note                               其余参数同letterboxBGRToPlanar，补边为0，归一化在第一层卷积中完成
+*/
+void letterboxBGR(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                  uint8_t *dst, int dstW, int dstH, const CpuOrientation &orientation = CpuOrientation());
+
+/**
+*	@brief  letterboxYUV420ToPlanar	    同letterboxBGRToPlanar，输入为YUV420
+*   @param  src		                    NV12或I420图像
+*   @return
+*
+*   @note                               YUV转RGB在水平插值之后进行，只转换缩小后的像素，系数与cvtColor一致
+*/
+void letterboxYUV420ToPlanar(const CpuYUV420Image &src, float scale,
+                             float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                             const CpuOrientation &orientation = CpuOrientation());
+
+//同letterboxBGR，输入为YUV420
+void letterboxYUV420ToBGR(const CpuYUV420Image &src, float scale, uint8_t *dst, int dstW, int dstH,
+                          const CpuOrientation &orientation = CpuOrientation());
+
+/**
+*	@brief  letterboxGrayToPlanar	    同letterboxBGRToPlanar，输入为单通道(灰度/红外)图像
+*   @param  src		                    单通道图像
+*   @return
+*
+*   @note                               灰度复制成三个相同的通道再归一化，给fp32输入的网络使用
+*/
+void letterboxGrayToPlanar(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                           float *dst, int dstW, int dstH, const CpuNormalizeParam &norm,
+                           const CpuOrientation &orientation = CpuOrientation());
+
+/**
+*	@brief  letterboxGray	            缩放、补边，输出单通道uint8，给权重按通道求和后的第一层卷积使用
+*   @param  src		                    单通道图像
+*   @param  dst		                    dstH x dstW
+*   @return
+*
+*   @note                               其余参数同letterboxBGRToPlanar，补边为0
+*/
+void letterboxGray(const uint8_t *src, int srcW, int srcH, size_t srcStep, float scale,
+                   uint8_t *dst, int dstW, int dstH, const CpuOrientation &orientation = CpuOrientation());
+
+//同letterboxGray，只读取YUV420的亮度平面，Y按BT.601从16~235拉伸到0~255
+void letterboxYUV420ToGray(const CpuYUV420Image &src, float scale, uint8_t *dst, int dstW, int dstH,
+                           const CpuOrientation &orientation = CpuOrientation());
+
+/**
+*	@brief  flipLetterbox	            把letterbox后的uint8网络输入水平翻转到另一张，用于翻转增强
+*   @param  src		                    dstH x dstW x channels
+*   @param  width		                图像区域宽，只翻转[0, width)，补边不动
+*   @param  height		                图像区域高
+*   @return
+*
+*   @note
+*/
+void flipLetterbox(const uint8_t *src, uint8_t *dst, int width, int height, int channels, int dstW, int dstH);
+
+//同flipLetterbox，输入为3 x dstH x dstW的fp32网络输入
+void flipLetterboxPlanar(const float *src, float *dst, int width, int height, int dstW, int dstH);
+
+#endif // CPUPREPROCESS_H
@@ -0,0 +1,126 @@
+#include "cpuretinafacenet.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+CpuRetinaFaceNet::CpuRetinaFaceNet(string netWorkName) : CpuNetBase(netWorkName)
+{
+    //MXNet模型没有输入尺寸，这里固定输入大小
+    maxBatchSize = 8;
+    channel = 3;
+    netWidth = 640;
+    netHeight = 640;
+
+    outputs = {"face_rpn_cls_prob_reshape_stride32",
+               "face_rpn_bbox_pred_stride32",
+               "face_rpn_landmark_pred_stride32",
+               "face_rpn_cls_prob_reshape_stride16",
+               "face_rpn_bbox_pred_stride16",
+               "face_rpn_landmark_pred_stride16",
+               "face_rpn_cls_prob_reshape_stride8",
+               "face_rpn_bbox_pred_stride8",
+               "face_rpn_landmark_pred_stride8"};
+
+    results.resize(outputs.size());
+    for(size_t i = 0; i < outputs.size(); i++) {
+        results[i].layer_name = outputs[i];
+        results[i].data = NULL;
+        results[i].batchStride = 0;
+    }
+}
+
+CpuRetinaFaceNet::~CpuRetinaFaceNet()
+{
+}
+
+void CpuRetinaFaceNet::doInference(int batchSize, float *input)
+{
+    if(input != NULL && inputBuffer == NULL) {
+        printf("cpu net reads uint8 input, float input is ignored.\n");
+    }
+    else if(input != NULL && input != inputBuffer) {
+        memcpy(inputBuffer, input, batchSize * channel * netHeight * netWidth * sizeof(float));
+    }
+
+    if(batchSize != this->batchSize) {
+        reshape(batchSize);
+    }
+
+    forward();
+
+    //输出只记录指针和形状，后处理直接读取张量
+    for(size_t i = 0; i < outputTensors.size(); i++) {
+        results[i].data = outputTensors[i]->data;
+        results[i].batchStride = outputTensors[i]->count(1);
+        results[i].batchsize = batchSize;
+        //setInputSize之后输出大小会变
+        const CpuTensor *t = outputTensors[i];
+        results[i].outputDims = CpuDims(t->channels, t->height, t->width);
+    }
+}
+
+CpuBlob* CpuRetinaFaceNet::blob_by_name(const string &layer_name)
+{
+    for(size_t i = 0; i < results.size(); i++) {
+        if(results[i].layer_name == layer_name) {
+            return &results[i];
+        }
+    }
+
+    return NULL;
+}
+
+vector<int> CpuRetinaFaceNet::getOutputWidth()
+{
+    //返回每个fpn输出宽
+    if(outputTensors.size() == 0) {
+        return vector<int>();
+    }
+
+    vector<int> out;
+    out.push_back(outputTensors[0]->width);
+    out.push_back(outputTensors[3]->width);
+    out.push_back(outputTensors[6]->width);
+
+    return out;
+}
+
+vector<int> CpuRetinaFaceNet::getOutputHeight()
+{
+    //返回每个fpn输出高
+    if(outputTensors.size() == 0) {
+        return vector<int>();
+    }
+
+    vector<int> out;
+    out.push_back(outputTensors[0]->height);
+    out.push_back(outputTensors[3]->height);
+    out.push_back(outputTensors[6]->height);
+
+    return out;
+}
+
+void CpuRetinaFaceNet::allocateMemory()
+{
+    outputTensors.resize(outputs.size());
+    for(size_t i = 0; i < outputs.size(); i++) {
+        outputTensors[i] = tensor_by_name(outputs[i]);
+        if(outputTensors[i] == NULL) {
+            printf("output %s not found, exit!\n", outputs[i].c_str());
+            exit(0);
+        }
+
+        const CpuTensor *t = outputTensors[i];
+        results[i].layer_index = i;
+        results[i].outputDims = CpuDims(t->channels, t->height, t->width);
+        results[i].outputSize = maxBatchSize * t->count(1) * sizeof(float);
+    }
+}
+
+void CpuRetinaFaceNet::releaseMemory()
+{
+    outputTensors.clear();
+}
@@ -0,0 +1,69 @@
+#ifndef CPURETINAFACENET_H
+#define CPURETINAFACENET_H
+
+#include <string>
+#include <vector>
+#include "cpunetbase.h"
+
+using namespace std;
+
+//与TrtBlob保持一致
+struct CpuBlob
+{
+    string layer_name;
+    int layer_index;
+    int outputSize;
+    const float *data;          //直接指向输出张量，不拷贝，下一次doInference前有效
+    size_t batchStride;         //相邻两张图的输出间隔的float数
+    CpuDims outputDims;
+    int batchsize;
+
+    //第index张图的输出，outputDims排列
+    const float *batch(int index) const { return data + index * batchStride; }
+};
+
+class CpuRetinaFaceNet : public CpuNetBase
+{
+public:
+    CpuRetinaFaceNet(std::string netWorkName);
+    ~CpuRetinaFaceNet();
+
+    /**
+     *	@brief  doInference	            CPU推理函数
+     *   @param  batchSize		        批量数
+     *   @param  input		            数据输入，NULL表示已写入getInputBuf()
+     *   @return
+     *
+     *   @note
+     */
+    virtual void doInference(int batchSize, float *input = NULL) override;
+
+    CpuBlob *blob_by_name(const string &layer_name);
+
+    vector<int> getOutputWidth();
+    vector<int> getOutputHeight();
+private:
+
+   /**
+    *	@brief  allocateMemory	        查找输出张量
+    *   @return
+    *
+    *   @note
+    */
+    virtual void allocateMemory() override;
+
+   /**
+    *	@brief  releaseMemory	        释放内存空间
+    *   @return
+    *
+    *   @note
+    */
+    virtual void releaseMemory() override;
+
+private:
+    vector<CpuTensor *> outputTensors;
+
+    vector<CpuBlob> results;
+};
+
+#endif // CPURETINAFACENET_H
@@ -0,0 +1,167 @@
+#include "cputhreadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fstream>
+#include <string>
+#include <algorithm>
+
+CpuThreadPool::CpuThreadPool(int numThreads, const vector<int> &cpus)
+    : task(NULL), taskSize(0), taskGrain(1), generation(0), pending(0), stop(false)
+{
+    numThreads = std::max(1, numThreads);
+    for(int i = 0; i < numThreads; i++) {
+        workers.push_back(thread(&CpuThreadPool::workerLoop, this, i));
+        if(!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpus.size()], &set);
+            if(pthread_setaffinity_np(workers[i].native_handle(), sizeof(set), &set) != 0) {
+                printf("bind worker %d to cpu %d failed.\n", i, cpus[i % cpus.size()]);
+            }
+        }
+    }
+}
+
+CpuThreadPool::~CpuThreadPool()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stop = true;
+    }
+    startCond.notify_all();
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+int CpuThreadPool::getNumThreads() const
+{
+    return workers.size();
+}
+
+void CpuThreadPool::parallelFor(int n, const function<void(int, int, int)> &func, int grain)
+{
+    if(n <= 0) {
+        return;
+    }
+
+    unique_lock<mutex> guard(lock);
+    task = &func;
+    taskSize = n;
+    taskGrain = std::max(1, grain);
+    pending = workers.size();
+    generation++;
+    startCond.notify_all();
+    doneCond.wait(guard, [this] { return pending == 0; });
+    task = NULL;
+}
+
+void CpuThreadPool::workerLoop(int index)
+{
+    int seen = 0;
+    while(true) {
+        const function<void(int, int, int)> *func;
+        int n, grain;
+        {
+            unique_lock<mutex> guard(lock);
+            startCond.wait(guard, [&] { return stop || generation != seen; });
+            if(stop) {
+                return;
+            }
+            seen = generation;
+            func = task;
+            n = taskSize;
+            grain = taskGrain;
+        }
+
+        //按grain对齐均分，第index段
+        int threads = workers.size();
+        int chunks = (n + grain - 1) / grain;
+        int begin = std::min(n, (int)((long)chunks * index / threads) * grain);
+        int end = std::min(n, (int)((long)chunks * (index + 1) / threads) * grain);
+        if(begin < end) {
+            (*func)(begin, end, index);
+        }
+
+        unique_lock<mutex> guard(lock);
+        if(--pending == 0) {
+            doneCond.notify_one();
+        }
+    }
+}
+
+bool bindCurrentThread(const vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i = 0; i < cpus.size(); i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+//cpulist格式：0-3,8-11
+static vector<int> parseCpuList(const string &list)
+{
+    vector<int> cpus;
+    size_t pos = 0;
+    while(pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if(comma == string::npos) {
+            comma = list.size();
+        }
+        string range = list.substr(pos, comma - pos);
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for(int c = first; c <= last && !range.empty(); c++) {
+            cpus.push_back(c);
+        }
+        pos = comma + 1;
+    }
+    return cpus;
+}
+
+vector<CpuNumaNode> getNumaNodes()
+{
+    //节点号可以不连续(无内存或下线的节点)，按目录名枚举并保留真实的节点号
+    vector<CpuNumaNode> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(dir != NULL) {
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            if(strncmp(name, "node", 4) != 0 || name[4] < '0' || name[4] > '9') {
+                continue;
+            }
+            ifstream input(string("/sys/devices/system/node/") + name + "/cpulist");
+            if(!input.good()) {
+                continue;
+            }
+            string line;
+            getline(input, line);
+            CpuNumaNode node;
+            node.id = atoi(name + 4);
+            node.cpus = parseCpuList(line);
+            nodes.push_back(node);
+        }
+        closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const CpuNumaNode &a, const CpuNumaNode &b) {
+        return a.id < b.id;
+    });
+
+    if(nodes.empty()) {
+        CpuNumaNode node;
+        node.id = -1;
+        for(unsigned int c = 0; c < std::max(1u, thread::hardware_concurrency()); c++) {
+            node.cpus.push_back(c);
+        }
+        nodes.push_back(node);
+    }
+    return nodes;
+}
@@ -0,0 +1,84 @@
+#ifndef CPUTHREADPOOL_H
+#define CPUTHREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+//推理用的工作线程，每个线程可以绑定到一个核上
+//parallelFor时调用线程只等待，计算全部在工作线程上完成，保证内存访问都来自绑定的核
+class CpuThreadPool
+{
+public:
+   /**
+    *	@brief  CpuThreadPool	        创建工作线程
+    *   @param  numThreads		        线程数
+    *   @param  cpus		            第i个线程绑定到cpus[i % cpus.size()]，为空时不绑定
+    *   @return
+    *
+    *   @note
+    */
+    CpuThreadPool(int numThreads, const vector<int> &cpus = vector<int>());
+    ~CpuThreadPool();
+
+    int getNumThreads() const;
+
+   /**
+    *	@brief  parallelFor	            把[0, n)切成连续的几段并行执行
+    *   @param  n		                任务数
+    *   @param  func		            func(begin, end, threadIndex)，threadIndex用来选择线程自己的缓冲
+    *   @param  grain		            每段的长度是grain的倍数(最后一段除外)
+    *   @return
+    *
+    *   @note                           不可重入，同一时刻只能有一个parallelFor
+    */
+    void parallelFor(int n, const function<void(int, int, int)> &func, int grain = 1);
+
+private:
+    void workerLoop(int index);
+
+private:
+    vector<thread> workers;
+    mutex lock;
+    condition_variable startCond;
+    condition_variable doneCond;
+
+    const function<void(int, int, int)> *task;
+    int taskSize;
+    int taskGrain;
+    int generation;         //每次parallelFor加1，唤醒工作线程
+    int pending;            //还没完成的线程数
+    bool stop;
+};
+
+//pool为NULL时在当前线程执行
+//模板直接调用func，交给线程池时用std::cref包装，std::function不会为捕获的变量分配内存
+template<typename Func>
+void parallelFor(CpuThreadPool *pool, int n, const Func &func, int grain = 1)
+{
+    if(pool == NULL || pool->getNumThreads() == 1 || n <= grain) {
+        if(n > 0) {
+            func(0, n, 0);
+        }
+        return;
+    }
+    pool->parallelFor(n, std::cref(func), grain);
+}
+
+//把当前线程绑定到cpus上，成功返回true
+bool bindCurrentThread(const vector<int> &cpus);
+
+struct CpuNumaNode
+{
+    int id;                 //内核中的节点号，mbind使用；没有NUMA信息时为-1
+    vector<int> cpus;
+};
+
+//每个NUMA节点的cpu列表，按节点号排列，读取/sys/devices/system/node，没有NUMA信息时返回一个包含所有cpu的节点
+vector<CpuNumaNode> getNumaNodes();
+
+#endif // CPUTHREADPOOL_H
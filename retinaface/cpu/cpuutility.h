@@ -0,0 +1,42 @@
+#ifndef CPUUTILITY_H
+#define CPUUTILITY_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+//与tensorrt的Profiler接口保持一致，按层累计耗时
+struct CpuProfiler
+{
+    typedef std::pair<std::string, float> Record;
+    std::vector<Record> mProfile;
+
+    void reportLayerTime(const char* layerName, float ms)
+    {
+        auto record = std::find_if(mProfile.begin(), mProfile.end(),
+                      [&](const Record& r){ return r.first == layerName; });
+        if (record == mProfile.end())
+            mProfile.push_back(std::make_pair(layerName, ms));
+        else
+            record->second += ms;
+    }
+
+    void printLayerTimes()
+    {
+        float totalTime = 0;
+        for (size_t i = 0; i < mProfile.size(); i++)
+        {
+            printf("%-40.40s %4.3fms\n", mProfile[i].first.c_str(), mProfile[i].second );
+            totalTime += mProfile[i].second;
+        }
+        printf("Time over all layers: %4.3f\n", totalTime );
+    }
+
+    void reset()
+    {
+        mProfile.clear();
+    }
+};
+
+#endif // CPUUTILITY_H
@@ -0,0 +1,696 @@
+#include "mxnetloader.h"
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+//######################################################################
+//json
+//######################################################################
+
+//symbol.json只用到对象、数组、字符串和数字，这里只实现最小的解析器
+struct JsonValue
+{
+    enum Type {kNull, kBool, kNumber, kString, kArray, kObject};
+
+    Type type;
+    string str;
+    double number;
+    vector<JsonValue> array;
+    vector<pair<string, JsonValue>> object;
+
+    JsonValue() : type(kNull), number(0) {}
+
+    const JsonValue *find(const string &key) const
+    {
+        for(size_t i = 0; i < object.size(); i++) {
+            if(object[i].first == key) {
+                return &object[i].second;
+            }
+        }
+        return NULL;
+    }
+};
+
+class JsonParser
+{
+public:
+    JsonParser(const string &text) : text(text), pos(0) {}
+
+    bool parse(JsonValue &value)
+    {
+        return parseValue(value) && (skipSpace(), pos == text.size());
+    }
+
+private:
+    void skipSpace()
+    {
+        while(pos < text.size() && isspace((unsigned char)text[pos])) {
+            pos++;
+        }
+    }
+
+    bool parseValue(JsonValue &value)
+    {
+        skipSpace();
+        if(pos >= text.size()) {
+            return false;
+        }
+
+        char c = text[pos];
+        if(c == '{') {
+            return parseObject(value);
+        }
+        else if(c == '[') {
+            return parseArray(value);
+        }
+        else if(c == '"') {
+            value.type = JsonValue::kString;
+            return parseString(value.str);
+        }
+        else if(text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+            value.type = JsonValue::kBool;
+            value.number = text[pos] == 't' ? 1 : 0;
+            pos += text[pos] == 't' ? 4 : 5;
+            return true;
+        }
+        else if(text.compare(pos, 4, "null") == 0) {
+            value.type = JsonValue::kNull;
+            pos += 4;
+            return true;
+        }
+
+        const char *begin = text.c_str() + pos;
+        char *end = NULL;
+        value.type = JsonValue::kNumber;
+        value.number = strtod(begin, &end);
+        if(end == begin) {
+            return false;
+        }
+        pos += end - begin;
+        return true;
+    }
+
+    bool parseString(string &str)
+    {
+        //跳过引号
+        pos++;
+        str.clear();
+        while(pos < text.size() && text[pos] != '"') {
+            if(text[pos] == '\\' && pos + 1 < text.size()) {
+                pos++;
+                switch(text[pos]) {
+                case 'n': str += '\n'; break;
+                case 't': str += '\t'; break;
+                default: str += text[pos]; break;
+                }
+            }
+            else {
+                str += text[pos];
+            }
+            pos++;
+        }
+        if(pos >= text.size()) {
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    bool parseArray(JsonValue &value)
+    {
+        value.type = JsonValue::kArray;
+        pos++;
+        skipSpace();
+        if(pos < text.size() && text[pos] == ']') {
+            pos++;
+            return true;
+        }
+
+        while(1) {
+            JsonValue item;
+            if(!parseValue(item)) {
+                return false;
+            }
+            value.array.push_back(item);
+
+            skipSpace();
+            if(pos >= text.size()) {
+                return false;
+            }
+            if(text[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if(text[pos] == ']') {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    bool parseObject(JsonValue &value)
+    {
+        value.type = JsonValue::kObject;
+        pos++;
+        skipSpace();
+        if(pos < text.size() && text[pos] == '}') {
+            pos++;
+            return true;
+        }
+
+        while(1) {
+            skipSpace();
+            string key;
+            if(pos >= text.size() || text[pos] != '"' || !parseString(key)) {
+                return false;
+            }
+            skipSpace();
+            if(pos >= text.size() || text[pos] != ':') {
+                return false;
+            }
+            pos++;
+
+            JsonValue item;
+            if(!parseValue(item)) {
+                return false;
+            }
+            value.object.push_back(std::make_pair(key, item));
+
+            skipSpace();
+            if(pos >= text.size()) {
+                return false;
+            }
+            if(text[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if(text[pos] == '}') {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+private:
+    const string &text;
+    size_t pos;
+};
+
+//######################################################################
+//attrs
+//######################################################################
+
+//"(3, 3)" -> {3, 3}，单个数字也当作元组
+static vector<int> parseTuple(const string &str)
+{
+    vector<int> values;
+    string tmp;
+    for(size_t i = 0; i < str.size(); i++) {
+        char c = str[i];
+        if(isdigit((unsigned char)c) || c == '-') {
+            tmp += c;
+        }
+        else if(!tmp.empty()) {
+            values.push_back(atoi(tmp.c_str()));
+            tmp.clear();
+        }
+    }
+    if(!tmp.empty()) {
+        values.push_back(atoi(tmp.c_str()));
+    }
+    return values;
+}
+
+static string attr(const MXNetNode &node, const string &key, const string &def)
+{
+    map<string, string>::const_iterator it = node.attrs.find(key);
+    return it == node.attrs.end() ? def : it->second;
+}
+
+static vector<int> attrTuple(const MXNetNode &node, const string &key, const vector<int> &def)
+{
+    map<string, string>::const_iterator it = node.attrs.find(key);
+    if(it == node.attrs.end()) {
+        return def;
+    }
+    vector<int> values = parseTuple(it->second);
+    //(3,)这种写法表示二维都一样
+    if(values.size() == 1 && def.size() == 2) {
+        values.push_back(values[0]);
+    }
+    return values;
+}
+
+static bool attrBool(const MXNetNode &node, const string &key, bool def)
+{
+    string value = attr(node, key, def ? "True" : "False");
+    return value == "True" || value == "true" || value == "1";
+}
+
+//######################################################################
+//loader
+//######################################################################
+
+MXNetLoader::MXNetLoader()
+{
+    foldLayers = true;
+}
+
+MXNetLoader::~MXNetLoader()
+{
+}
+
+bool MXNetLoader::loadSymbol(const string &symbolFile)
+{
+    ifstream file(symbolFile.c_str());
+    if(!file.good()) {
+        printf("the symbol file %s doesn't exist!\n", symbolFile.c_str());
+        return false;
+    }
+    stringstream buffer;
+    buffer << file.rdbuf();
+    string text = buffer.str();
+
+    JsonValue root;
+    JsonParser parser(text);
+    if(!parser.parse(root) || root.type != JsonValue::kObject) {
+        printf("parse symbol file %s failed!\n", symbolFile.c_str());
+        return false;
+    }
+
+    const JsonValue *jnodes = root.find("nodes");
+    const JsonValue *jheads = root.find("heads");
+    if(jnodes == NULL || jheads == NULL) {
+        printf("symbol file has no nodes or heads!\n");
+        return false;
+    }
+
+    nodes.clear();
+    for(size_t i = 0; i < jnodes->array.size(); i++) {
+        const JsonValue &jnode = jnodes->array[i];
+        const JsonValue *jop = jnode.find("op");
+        const JsonValue *jname = jnode.find("name");
+        if(jop == NULL || jname == NULL) {
+            printf("node %d of symbol file has no op or name!\n", (int)i);
+            return false;
+        }
+        MXNetNode node;
+        node.op = jop->str;
+        node.name = jname->str;
+
+        //不同版本的MXNet属性字段名不一样
+        const JsonValue *jattrs = jnode.find("attrs");
+        if(jattrs == NULL) {
+            jattrs = jnode.find("attr");
+        }
+        if(jattrs == NULL) {
+            jattrs = jnode.find("param");
+        }
+        if(jattrs != NULL) {
+            for(size_t k = 0; k < jattrs->object.size(); k++) {
+                node.attrs[jattrs->object[k].first] = jattrs->object[k].second.str;
+            }
+        }
+
+        const JsonValue *jinputs = jnode.find("inputs");
+        if(jinputs != NULL) {
+            for(size_t k = 0; k < jinputs->array.size(); k++) {
+                //节点按拓扑顺序排列，输入只能是前面的节点
+                const JsonValue &jinput = jinputs->array[k];
+                int idx = jinput.array.empty() ? -1 : (int)jinput.array[0].number;
+                if(idx < 0 || idx >= (int)i) {
+                    printf("invalid input of %s in symbol file!\n", node.name.c_str());
+                    return false;
+                }
+                node.inputs.push_back(idx);
+            }
+        }
+        nodes.push_back(node);
+    }
+
+    heads.clear();
+    outputNames.clear();
+    for(size_t i = 0; i < jheads->array.size(); i++) {
+        const JsonValue &jhead = jheads->array[i];
+        int idx = jhead.array.empty() ? -1 : (int)jhead.array[0].number;
+        if(idx < 0 || idx >= (int)nodes.size()) {
+            printf("invalid head %d in symbol file!\n", (int)i);
+            return false;
+        }
+        heads.push_back(idx);
+        outputNames.push_back(nodes[idx].name);
+    }
+
+    return true;
+}
+
+template<typename T> static bool readValue(ifstream &file, T &value)
+{
+    file.read(reinterpret_cast<char *>(&value), sizeof(T));
+    return file.good();
+}
+
+//文件中剩余的字节数，按文件给出的大小分配内存前用它检查
+static uint64_t bytesLeft(ifstream &file, uint64_t fileSize)
+{
+    std::streamoff pos = file.tellg();
+    return pos < 0 || (uint64_t)pos > fileSize ? 0 : fileSize - pos;
+}
+
+bool MXNetLoader::loadParams(const string &paramsFile)
+{
+    const uint64_t kListMagic = 0x112;
+    const uint32_t kNDArrayV2Magic = 0xF993fac9;
+    const uint32_t kNDArrayV3Magic = 0xF993faca;
+    //magic、stype、ndim，每个数组至少这么多字节
+    const uint64_t kMinArrayBytes = 12;
+    const int32_t kMaxDims = 8;
+
+    ifstream file(paramsFile.c_str(), ios::binary);
+    if(!file.good()) {
+        printf("the params file %s doesn't exist!\n", paramsFile.c_str());
+        return false;
+    }
+    file.seekg(0, ios::end);
+    uint64_t fileSize = (uint64_t)file.tellg();
+    file.seekg(0, ios::beg);
+
+    uint64_t header = 0, reserved = 0, count = 0;
+    if(!readValue(file, header) || !readValue(file, reserved) || header != kListMagic ||
+       !readValue(file, count) || count > bytesLeft(file, fileSize) / kMinArrayBytes) {
+        printf("invalid params file %s!\n", paramsFile.c_str());
+        return false;
+    }
+
+    vector<MXNetNDArray> arrays(count);
+    for(uint64_t i = 0; i < count; i++) {
+        uint32_t magic = 0;
+        int32_t stype = 0;
+        int32_t ndim = 0;
+        if(!readValue(file, magic) || !readValue(file, stype) || !readValue(file, ndim)) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+        if(magic != kNDArrayV2Magic && magic != kNDArrayV3Magic) {
+            printf("unsupported ndarray format %x!\n", magic);
+            return false;
+        }
+        if(stype != 0) {
+            printf("sparse ndarray is not supported!\n");
+            return false;
+        }
+        if(ndim < 1 || ndim > kMaxDims) {
+            printf("invalid ndarray dims %d in params file %s!\n", ndim, paramsFile.c_str());
+            return false;
+        }
+
+        //每一维都不超过剩余字节数，乘积超过时立即停止，不会溢出
+        uint64_t size = 1;
+        for(int32_t d = 0; d < ndim; d++) {
+            int64_t dim = 0;
+            if(!readValue(file, dim) || dim <= 0 || (uint64_t)dim > bytesLeft(file, fileSize) / sizeof(float) / size) {
+                printf("invalid ndarray shape in params file %s!\n", paramsFile.c_str());
+                return false;
+            }
+            arrays[i].shape.push_back((int)dim);
+            size *= dim;
+        }
+
+        int32_t devType = 0, devId = 0, typeFlag = 0;
+        if(!readValue(file, devType) || !readValue(file, devId) || !readValue(file, typeFlag)) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+        //0表示float32
+        if(typeFlag != 0) {
+            printf("only float32 params are supported!\n");
+            return false;
+        }
+
+        if(size * sizeof(float) > bytesLeft(file, fileSize)) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+        arrays[i].data.resize(size);
+        file.read(reinterpret_cast<char *>(arrays[i].data.data()), size * sizeof(float));
+        if(!file.good()) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+    }
+
+    uint64_t numNames = 0;
+    if(!readValue(file, numNames) || numNames != count) {
+        printf("params file %s has no names!\n", paramsFile.c_str());
+        return false;
+    }
+
+    params.clear();
+    for(uint64_t i = 0; i < numNames; i++) {
+        uint64_t len = 0;
+        if(!readValue(file, len) || len > bytesLeft(file, fileSize)) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+        string name(len, '\0');
+        file.read(&name[0], len);
+        if(!file.good()) {
+            printf("params file %s is truncated!\n", paramsFile.c_str());
+            return false;
+        }
+
+        //去掉arg:和aux:前缀
+        size_t colon = name.find(':');
+        if(colon != string::npos) {
+            name = name.substr(colon + 1);
+        }
+        params[name].shape.swap(arrays[i].shape);
+        params[name].data.swap(arrays[i].data);
+    }
+
+    return true;
+}
+
+const MXNetNDArray *MXNetLoader::param(const string &name) const
+{
+    map<string, MXNetNDArray>::const_iterator it = params.find(name);
+    return it == params.end() ? NULL : &it->second;
+}
+
+bool MXNetLoader::batchNormParams(const MXNetNode &node, vector<float> &scale, vector<float> &shift) const
+{
+    if(node.inputs.size() < 5) {
+        return false;
+    }
+
+    const MXNetNDArray *gamma = param(nodes[node.inputs[1]].name);
+    const MXNetNDArray *beta = param(nodes[node.inputs[2]].name);
+    const MXNetNDArray *mean = param(nodes[node.inputs[3]].name);
+    const MXNetNDArray *var = param(nodes[node.inputs[4]].name);
+    if(gamma == NULL || beta == NULL || mean == NULL || var == NULL) {
+        printf("missing params of %s!\n", node.name.c_str());
+        return false;
+    }
+
+    //MXNet默认 eps = 1e-3, fix_gamma = True
+    float eps = atof(attr(node, "eps", "0.001").c_str());
+    bool fixGamma = attrBool(node, "fix_gamma", true);
+
+    size_t channels = mean->data.size();
+    scale.resize(channels);
+    shift.resize(channels);
+    for(size_t c = 0; c < channels; c++) {
+        float g = fixGamma ? 1.0f : gamma->data[c];
+        scale[c] = g / sqrt(var->data[c] + eps);
+        shift[c] = beta->data[c] - mean->data[c] * scale[c];
+    }
+
+    return true;
+}
+
+const vector<string> &MXNetLoader::getOutputNames() const
+{
+    return outputNames;
+}
+
+void MXNetLoader::setFoldLayers(bool fold)
+{
+    foldLayers = fold;
+}
+
+bool MXNetLoader::createNet(vector<CpuLayer *> &layers, vector<CpuTensor *> &tensors, CpuTensor *&input)
+{
+    input = NULL;
+
+    //统计每个节点被引用次数，只被一个节点使用的卷积输出才能合并后续层
+    vector<int> consumers(nodes.size(), 0);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        for(size_t k = 0; k < nodes[i].inputs.size(); k++) {
+            consumers[nodes[i].inputs[k]]++;
+        }
+    }
+    for(size_t i = 0; i < heads.size(); i++) {
+        consumers[heads[i]]++;
+    }
+
+    vector<CpuTensor *> outputOf(nodes.size(), (CpuTensor *)NULL);
+    vector<CpuLayer *> producer(nodes.size(), (CpuLayer *)NULL);
+
+    //json中节点已经按拓扑顺序排列
+    for(size_t i = 0; i < nodes.size(); i++) {
+        const MXNetNode &node = nodes[i];
+
+        if(node.op == "null") {
+            //不是参数的变量就是网络输入
+            if(param(node.name) == NULL && consumers[i] > 0) {
+                if(input != NULL) {
+                    printf("only one input is supported, %s!\n", node.name.c_str());
+                    return false;
+                }
+                input = new CpuTensor(node.name);
+                tensors.push_back(input);
+                outputOf[i] = input;
+            }
+            continue;
+        }
+
+        int from = node.inputs.empty() ? -1 : node.inputs[0];
+        CpuLayer *prev = from >= 0 ? producer[from] : NULL;
+        bool fusable = foldLayers && prev != NULL && prev->type == "Convolution" && consumers[from] == 1;
+
+        if(node.op == "BatchNorm" && fusable) {
+            vector<float> scale, shift;
+            if(!batchNormParams(node, scale, shift)) {
+                return false;
+            }
+            static_cast<CpuConvolutionLayer *>(prev)->foldBatchNorm(scale, shift);
+            outputOf[i] = outputOf[from];
+            outputOf[i]->name = node.name;
+            producer[i] = prev;
+            continue;
+        }
+        if(node.op == "Activation" && attr(node, "act_type", "relu") == "relu" && fusable) {
+            static_cast<CpuConvolutionLayer *>(prev)->setFusedReLU(true);
+            outputOf[i] = outputOf[from];
+            outputOf[i]->name = node.name;
+            //relu之后不能再合并BatchNorm
+            producer[i] = NULL;
+            continue;
+        }
+
+        CpuLayer *layer = NULL;
+        if(node.op == "Convolution") {
+            vector<int> kernel = attrTuple(node, "kernel", vector<int>{1, 1});
+            vector<int> stride = attrTuple(node, "stride", vector<int>{1, 1});
+            vector<int> pad = attrTuple(node, "pad", vector<int>{0, 0});
+            vector<int> dilate = attrTuple(node, "dilate", vector<int>{1, 1});
+
+            CpuConvParam p;
+            p.num_output = atoi(attr(node, "num_filter", "0").c_str());
+            p.group = atoi(attr(node, "num_group", "1").c_str());
+            p.kernel_h = kernel[0];
+            p.kernel_w = kernel[1];
+            p.stride_h = stride[0];
+            p.stride_w = stride[1];
+            p.pad_h = pad[0];
+            p.pad_w = pad[1];
+            p.dilate_h = dilate[0];
+            p.dilate_w = dilate[1];
+
+            if(node.inputs.size() < 2) {
+                printf("convolution %s has no weight input!\n", node.name.c_str());
+                return false;
+            }
+            const MXNetNDArray *weight = param(nodes[node.inputs[1]].name);
+            const MXNetNDArray *bias = NULL;
+            if(!attrBool(node, "no_bias", false) && node.inputs.size() > 2) {
+                bias = param(nodes[node.inputs[2]].name);
+            }
+            if(weight == NULL) {
+                printf("missing weight of %s!\n", node.name.c_str());
+                return false;
+            }
+
+            CpuConvolutionLayer *conv = new CpuConvolutionLayer(node.name, p);
+            conv->setWeights(weight->data, bias ? bias->data : vector<float>());
+            layer = conv;
+        }
+        else if(node.op == "BatchNorm") {
+            vector<float> scale, shift;
+            if(!batchNormParams(node, scale, shift)) {
+                return false;
+            }
+            layer = new CpuBatchNormLayer(node.name, scale, shift);
+        }
+        else if(node.op == "Activation") {
+            layer = new CpuActivationLayer(node.name, attr(node, "act_type", "relu"));
+        }
+        else if(node.op == "UpSampling") {
+            string sampleType = attr(node, "sample_type", "nearest");
+            int scale = atoi(attr(node, "scale", "1").c_str());
+            vector<float> weights;
+            //bilinear的第二个输入是反卷积权重
+            if(sampleType == "bilinear" && node.inputs.size() > 1) {
+                const MXNetNDArray *weight = param(nodes[node.inputs[1]].name);
+                if(weight != NULL) {
+                    weights = weight->data;
+                }
+            }
+            layer = new CpuUpSamplingLayer(node.name, sampleType, scale, weights);
+        }
+        else if(node.op == "Crop") {
+            vector<int> offset = attrTuple(node, "offset", vector<int>{0, 0});
+            vector<int> hw = attrTuple(node, "h_w", vector<int>{0, 0});
+            layer = new CpuCropLayer(node.name, offset[0], offset[1], hw[0], hw[1],
+                                     attrBool(node, "center_crop", false));
+        }
+        else if(node.op == "elemwise_add" || node.op == "_plus" || node.op == "_Plus" ||
+                node.op == "broadcast_add" || node.op == "ElementWiseSum" || node.op == "add_n") {
+            layer = new CpuEltwiseAddLayer(node.name);
+        }
+        else if(node.op == "Concat") {
+            layer = new CpuConcatLayer(node.name, atoi(attr(node, "dim", "1").c_str()));
+        }
+        else if(node.op == "SoftmaxActivation") {
+            if(attr(node, "mode", "instance") != "channel") {
+                printf("only channel mode softmax is supported, %s!\n", node.name.c_str());
+                return false;
+            }
+            layer = new CpuSoftmaxLayer(node.name);
+        }
+        else if(node.op == "Reshape") {
+            layer = new CpuReshapeLayer(node.name, parseTuple(attr(node, "shape", "()")));
+        }
+        else {
+            printf("unsupported op %s of %s!\n", node.op.c_str(), node.name.c_str());
+            return false;
+        }
+
+        //只有数据输入才连接，参数输入已经拷贝进层里
+        for(size_t k = 0; k < node.inputs.size(); k++) {
+            CpuTensor *bottom = outputOf[node.inputs[k]];
+            if(bottom != NULL) {
+                layer->bottoms.push_back(bottom);
+            }
+        }
+        CpuTensor *top = new CpuTensor(node.name);
+        layer->tops.push_back(top);
+        tensors.push_back(top);
+        layers.push_back(layer);
+
+        outputOf[i] = top;
+        producer[i] = layer;
+    }
+
+    if(input == NULL) {
+        printf("symbol has no input!\n");
+        return false;
+    }
+
+    return true;
+}
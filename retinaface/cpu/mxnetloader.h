@@ -0,0 +1,79 @@
+#ifndef MXNETLOADER_H
+#define MXNETLOADER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "cpulayers.h"
+
+using namespace std;
+
+struct MXNetNode
+{
+    string op;
+    string name;
+    map<string, string> attrs;
+    //输入节点的编号，每个节点只有一个输出
+    vector<int> inputs;
+};
+
+struct MXNetNDArray
+{
+    vector<int> shape;
+    vector<float> data;
+};
+
+//直接读取MXNet的symbol.json和params，构建CPU推理网络，不需要先转成caffe模型
+class MXNetLoader
+{
+public:
+    MXNetLoader();
+    ~MXNetLoader();
+
+   /**
+    *	@brief  loadSymbol	            解析网络结构文件
+    *   @param  symbolFile		        xxx-symbol.json
+    *   @return                         成功返回true
+    *
+    *   @note
+    */
+    bool loadSymbol(const string &symbolFile);
+
+   /**
+    *	@brief  loadParams	            解析NDArray参数文件
+    *   @param  paramsFile		        xxx-0000.params
+    *   @return                         成功返回true
+    *
+    *   @note                           只支持dense float32参数
+    */
+    bool loadParams(const string &paramsFile);
+
+   /**
+    *	@brief  createNet	            按拓扑顺序创建CPU网络层
+    *   @param  layers		            返回网络层，调用者负责释放
+    *   @param  tensors		            返回所有张量，调用者负责释放
+    *   @param  input		            返回输入张量
+    *   @return                         成功返回true
+    *
+    *   @note                           BatchNorm和relu会尽量合并进前面的卷积
+    */
+    bool createNet(vector<CpuLayer *> &layers, vector<CpuTensor *> &tensors, CpuTensor *&input);
+
+    //是否把BatchNorm和relu合并进卷积，校准时需要关闭以得到每个张量
+    void setFoldLayers(bool fold);
+
+    const vector<string> &getOutputNames() const;
+
+private:
+    const MXNetNDArray *param(const string &name) const;
+    bool batchNormParams(const MXNetNode &node, vector<float> &scale, vector<float> &shift) const;
+
+private:
+    vector<MXNetNode> nodes;
+    vector<int> heads;
+    vector<string> outputNames;
+    map<string, MXNetNDArray> params;
+    bool foldLayers;
+};
+
+#endif // MXNETLOADER_H
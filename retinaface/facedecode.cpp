@@ -0,0 +1,165 @@
+#include "facedecode.h"
+#include <math.h>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __AVX2__
+//cephes的expf：exp(x) = 2^n * exp(r)，r在[-ln2/2, ln2/2]内用多项式计算
+static inline __m256 exp256(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f)), _mm256_set1_ps(88.3762626647949f));
+
+    __m256 fx = _mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f));
+    fx = _mm256_floor_ps(fx);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127));
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(n, 23)));
+}
+#endif
+
+#if defined(__AVX2__) && !defined(__AVX512F__)
+//8位比较掩码 -> 保留的lane依次排在前面的重排下标
+struct CompactTable
+{
+    int lanes[256][8];
+
+    CompactTable()
+    {
+        for(int mask = 0; mask < 256; mask++) {
+            int n = 0;
+            for(int lane = 0; lane < 8; lane++) {
+                if(mask & (1 << lane)) {
+                    lanes[mask][n++] = lane;
+                }
+            }
+            for(; n < 8; n++) {
+                lanes[mask][n] = 0;
+            }
+        }
+    }
+};
+
+static const CompactTable compactTable;
+#endif
+
+int compactAboveThreshold(const float *score, int count, float threshold, int *index)
+{
+    int n = 0;
+    int i = 0;
+#if defined(__AVX512F__)
+    const __m512 thr = _mm512_set1_ps(threshold);
+    __m512i pos = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i step = _mm512_set1_epi32(16);
+    for(; i + 16 <= count; i += 16) {
+        __mmask16 keep = _mm512_cmp_ps_mask(_mm512_loadu_ps(score + i), thr, _CMP_GT_OQ);
+        _mm512_mask_compressstoreu_epi32(index + n, keep, pos);
+        n += __builtin_popcount(keep);
+        pos = _mm512_add_epi32(pos, step);
+    }
+#elif defined(__AVX2__)
+    //写入的8个下标中只有前popcount个有效，后面的会被下一次覆盖；i + 8 <= count保证不越界
+    const __m256 thr = _mm256_set1_ps(threshold);
+    __m256i pos = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    for(; i + 8 <= count; i += 8) {
+        int keep = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(score + i), thr, _CMP_GT_OQ));
+        __m256i perm = _mm256_loadu_si256((const __m256i *)compactTable.lanes[keep]);
+        _mm256_storeu_si256((__m256i *)(index + n), _mm256_permutevar8x32_epi32(pos, perm));
+        n += __builtin_popcount(keep);
+        pos = _mm256_add_epi32(pos, step);
+    }
+#endif
+    for(; i < count; i++) {
+        index[n] = i;
+        n += score[i] > threshold;
+    }
+    return n;
+}
+
+void decodeFaces(const FaceDecodePlanes &planes, const int *index, int n, int clipW, int clipH,
+                 const FaceDecodeResult &result)
+{
+    int i = 0;
+#ifdef __AVX2__
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 maxX = _mm256_set1_ps(clipW - 1);
+    const __m256 maxY = _mm256_set1_ps(clipH - 1);
+    const __m256 gridW = _mm256_set1_ps(planes.gridW);
+    const __m256 invGridW = _mm256_set1_ps(1.0f / planes.gridW);
+    const __m256 stride = _mm256_set1_ps(planes.stride);
+    const __m256 ctrX = _mm256_set1_ps(planes.anchor.ctrX);
+    const __m256 ctrY = _mm256_set1_ps(planes.anchor.ctrY);
+    const __m256 w = _mm256_set1_ps(planes.anchor.width);
+    const __m256 h = _mm256_set1_ps(planes.anchor.height);
+    for(; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(index + i));
+
+        //j拆成(x, y)：(j + 0.5) / gridW取整离整数至少差0.5 / gridW，乘倒数的误差远小于它
+        __m256 j = _mm256_cvtepi32_ps(idx);
+        __m256 y = _mm256_floor_ps(_mm256_mul_ps(_mm256_add_ps(j, half), invGridW));
+        __m256 x = _mm256_fnmadd_ps(y, gridW, j);
+        __m256 cx = _mm256_fmadd_ps(x, stride, ctrX);
+        __m256 cy = _mm256_fmadd_ps(y, stride, ctrY);
+
+        //框：中心平移、宽高按exp缩放
+        __m256 px = _mm256_fmadd_ps(_mm256_i32gather_ps(planes.delta[0], idx, 4), w, cx);
+        __m256 py = _mm256_fmadd_ps(_mm256_i32gather_ps(planes.delta[1], idx, 4), h, cy);
+        __m256 pw = _mm256_mul_ps(exp256(_mm256_i32gather_ps(planes.delta[2], idx, 4)), w);
+        __m256 ph = _mm256_mul_ps(exp256(_mm256_i32gather_ps(planes.delta[3], idx, 4)), h);
+        __m256 rw = _mm256_mul_ps(half, _mm256_sub_ps(pw, one));
+        __m256 rh = _mm256_mul_ps(half, _mm256_sub_ps(ph, one));
+
+        //越界处理：只限制左上不小于0、右下不超过边界
+        _mm256_storeu_ps(result.box[0] + i, _mm256_max_ps(_mm256_sub_ps(px, rw), zero));
+        _mm256_storeu_ps(result.box[1] + i, _mm256_max_ps(_mm256_sub_ps(py, rh), zero));
+        _mm256_storeu_ps(result.box[2] + i, _mm256_min_ps(_mm256_add_ps(px, rw), maxX));
+        _mm256_storeu_ps(result.box[3] + i, _mm256_min_ps(_mm256_add_ps(py, rh), maxY));
+
+        //关键点：x按宽、y按高缩放后平移到anchor中心
+        for(int k = 0; k < 10; k += 2) {
+            __m256 lx = _mm256_i32gather_ps(planes.landmark[k], idx, 4);
+            __m256 ly = _mm256_i32gather_ps(planes.landmark[k + 1], idx, 4);
+            _mm256_storeu_ps(result.landmark[k] + i, _mm256_fmadd_ps(lx, w, cx));
+            _mm256_storeu_ps(result.landmark[k + 1] + i, _mm256_fmadd_ps(ly, h, cy));
+        }
+    }
+#endif
+    for(; i < n; i++) {
+        int j = index[i];
+        int y = j / planes.gridW;
+        int x = j - y * planes.gridW;
+        float cx = planes.anchor.ctrX + x * planes.stride;
+        float cy = planes.anchor.ctrY + y * planes.stride;
+        float w = planes.anchor.width;
+        float h = planes.anchor.height;
+
+        float px = planes.delta[0][j] * w + cx;
+        float py = planes.delta[1][j] * h + cy;
+        float pw = exp(planes.delta[2][j]) * w;
+        float ph = exp(planes.delta[3][j]) * h;
+
+        result.box[0][i] = std::max(px - 0.5f * (pw - 1.0f), 0.0f);
+        result.box[1][i] = std::max(py - 0.5f * (ph - 1.0f), 0.0f);
+        result.box[2][i] = std::min(px + 0.5f * (pw - 1.0f), (float)(clipW - 1));
+        result.box[3][i] = std::min(py + 0.5f * (ph - 1.0f), (float)(clipH - 1));
+
+        for(int k = 0; k < 10; k += 2) {
+            result.landmark[k][i] = planes.landmark[k][j] * w + cx;
+            result.landmark[k + 1][i] = planes.landmark[k + 1][j] * h + cy;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef FACEDECODE_H
+#define FACEDECODE_H
+
+#include <vector>
+
+using namespace std;
+
+//一种anchor的形状：网格(0, 0)处的中心和宽高
+//位置j(= y * 宽 + x)处的anchor只是中心平移(x * stride, y * stride)
+struct AnchorShape
+{
+    float ctrX;
+    float ctrY;
+    float width;
+    float height;
+};
+
+//一层中一种anchor的输入：anchor按位置j现算，网络输出的各个平面按位置j取值
+struct FaceDecodePlanes
+{
+    AnchorShape anchor;
+    int stride;                     //该层相对网络输入的步长
+    int gridW;                      //该层输出宽
+    const float *delta[4];          //dx, dy, dw, dh
+    const float *landmark[10];      //x0, y0, x1, y1, ... x4, y4
+};
+
+//解码结果，SoA排列，每个数组n个
+struct FaceDecodeResult
+{
+    float *box[4];                  //x1, y1, x2, y2
+    float *landmark[10];
+};
+
+/**
+*	@brief  compactAboveThreshold	    扫描一个score平面，把大于阈值的位置按顺序写成紧凑的下标列表
+*   @param  score		                count个置信度
+*   @param  count		                位置个数
+*   @param  threshold		            阈值，score > threshold的位置保留
+*   @param  index		                输出，至少count个
+*   @return                             保留的个数
+*
+*   @note                               没有逐个位置的分支：AVX-512用compress store，AVX2用比较掩码查表重排后整段写入
+*/
+int compactAboveThreshold(const float *score, int count, float threshold, int *index);
+
+/**
+*	@brief  decodeFaces	            按候选位置解码人脸框和关键点，并把框裁剪到网络输入内
+*   @param  planes		            anchor和网络输出
+*   @param  index		            候选的位置j
+*   @param  n		                候选个数
+*   @param  clipW		            网络输入宽，x2不超过clipW - 1
+*   @param  clipH		            网络输入高，y2不超过clipH - 1
+*   @param  result		            输出，第i个候选写在各数组的第i个
+*   @return
+*
+*   @note                           框：中心按(dx, dy)乘anchor宽高平移，宽高乘exp(dw)、exp(dh)；关键点同中心的平移
+*                                   裁剪只限制左上不小于0、右下不超过clipW - 1、clipH - 1
+*                                   anchor由位置j拆出的(x, y)现算，不读取anchor表
+*                                   AVX2时一次处理8个候选，按下标gather读取，exp用多项式近似(相对误差约1e-7)
+*/
+void decodeFaces(const FaceDecodePlanes &planes, const int *index, int n, int clipW, int clipH,
+                 const FaceDecodeResult &result);
+
+#endif // FACEDECODE_H
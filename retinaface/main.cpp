@@ -15,7 +15,9 @@ int main()
     RetinaFace *rf = new RetinaFace(path, "net3");
 
     //cv::VideoCapture cap(0);
-    cv::Mat img = cv::imread("/home/ubuntu/Pictures/t1.jpg");
+    //大图在解码时直接缩小，检测框乘以decodeScale回到原图
+    float decodeScale = 1.0;
+    cv::Mat img = rf->readImage("/home/ubuntu/Pictures/t1.jpg", decodeScale);
     
     vector<Mat> imgs;
     for(int i = 0; i < 64; i++) {
@@ -32,6 +34,51 @@ int main()
 //    float time = 0;
 //    int count = 0;
 
+#if defined(USE_CPU) && defined(USE_ALLOC_COUNT)
+    {
+        //ROI、YUV420和灰度图路径同样在预热之后不应再分配堆内存
+        vector<FaceDetectInfo> faces;
+        cv::Rect roi(img.cols / 4, img.rows / 4, img.cols / 2, img.rows / 2);
+        cv::Mat even = img(cv::Rect(0, 0, img.cols & ~1, img.rows & ~1));
+        cv::Mat i420, gray;
+        cv::cvtColor(even, i420, cv::COLOR_BGR2YUV_I420);
+        cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+
+        YUV420Frame frame;
+        frame.format = kYUV420I420;
+        frame.width = even.cols;
+        frame.height = even.rows;
+        frame.yStride = even.cols;
+        frame.uvStride = even.cols / 2;
+        frame.y = i420.data;
+        frame.u = frame.y + frame.width * frame.height;
+        frame.v = frame.u + frame.width * frame.height / 4;
+
+        const char *names[] = {"roi", "yuv420", "gray"};
+        for(int path = 0; path < 3; path++) {
+            unsigned long long allocations = 0;
+            for(int i = 0; i < 3; i++) {
+                if(i == 2) {
+                    allocations = getHeapAllocationCount();
+                }
+                if(path == 0) {
+                    rf->detect(img, roi, faces, 0.9);
+                }
+                else if(path == 1) {
+                    rf->detect(frame, faces, 0.9);
+                }
+                else {
+                    rf->detect(gray, faces, 0.9);
+                }
+            }
+            unsigned long long current = getHeapAllocationCount();
+            if(current != allocations) {
+                printf("%s detect allocated %llu times.\n", names[path], current - allocations);
+            }
+        }
+    }
+#endif
+
     //注：使用OPENCV计时和timer类计时有点偏差
     float time = 0;
     int count = 0;
@@ -47,6 +94,15 @@ int main()
         //time += t1 * 1000 / cv::getTickFrequency();
         time += ti.elapsedMilliSeconds();
         count ++;
+#if defined(USE_CPU) && defined(USE_ALLOC_COUNT)
+        //第一次检测之后不应再分配堆内存
+        static unsigned long long allocations = 0;
+        unsigned long long current = getHeapAllocationCount();
+        if(count > 2 && current != allocations) {
+            printf("detect %d allocated %llu times.\n", count, current - allocations);
+        }
+        allocations = current;
+#endif
         if(count % 1000 == 0) {
             printf("face detection average time = %f.\n", time / count);
         }
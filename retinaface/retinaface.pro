@@ -4,17 +4,38 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 DEFINES += USE_TENSORRT USE_NPP #USE_TENSORRT_INT8
+#DEFINES += USE_CPU
+#DEFINES += USE_ALLOC_COUNT
 
 SOURCES += main.cpp \
     RetinaFace.cpp \
+    facedecode.cpp \
     tensorrt/trtnetbase.cpp \
-    tensorrt/trtretinafacenet.cpp
+    tensorrt/trtretinafacenet.cpp \
+    cpu/cpulayers.cpp \
+    cpu/cpuconvkernels.cpp \
+    cpu/cpuarena.cpp \
+    cpu/cputhreadpool.cpp \
+    cpu/cpupreprocess.cpp \
+    cpu/mxnetloader.cpp \
+    cpu/cpunetbase.cpp \
+    cpu/cpuretinafacenet.cpp
 
 HEADERS += \
     RetinaFace.h \
+    facedecode.h \
     tensorrt/trtnetbase.h \
     tensorrt/trtutility.h \
     tensorrt/trtretinafacenet.h \
+    cpu/cpulayers.h \
+    cpu/cpuconvkernels.h \
+    cpu/cpuarena.h \
+    cpu/cputhreadpool.h \
+    cpu/cpupreprocess.h \
+    cpu/mxnetloader.h \
+    cpu/cpunetbase.h \
+    cpu/cpuretinafacenet.h \
+    cpu/cpuutility.h \
     timer.h
 
 CUDA_SOURCES += \
@@ -27,7 +48,7 @@ INCLUDEPATH += /home/ubuntu/caffe-office/caffe/include
 LIBS += -lprotobuf -L/home/ubuntu/caffe-office/caffe/build/lib -lcaffe
 
 # 3rd party
-LIBS += -lglog -lboost_system
+LIBS += -lglog -lboost_system -lpthread
 
 INCLUDEPATH += /usr/local/TensorRT/include
 LIBS += -L/usr/local/TensorRT/lib -lnvinfer -lnvcaffe_parser\
@@ -37,6 +37,8 @@ TrtRetinaFaceNet::TrtRetinaFaceNet(string netWorkName) : TrtNetBase(netWorkName)
     results.resize(outputs.size());
     for(size_t i = 0; i < outputs.size(); i++) {
         results[i].layer_name = outputs[i];
+        results[i].data = NULL;
+        results[i].batchStride = 0;
     }
 }
 
@@ -86,22 +88,15 @@ void TrtRetinaFaceNet::doInference(int batchSize, float *input)
         }
     }
 
-    //output to vector
+    //输出只记录主机缓冲的指针和形状，后处理直接读取
     for(size_t i = 0; i < outputBuffers.size(); i++){
-        int count = outputsizes[i] / (sizeof(float) * maxBatchSize);
-        results[i].result.clear();
-        for(int j = 0; j < batchSize; j++) {
-            const float* confidenceBegin = outputBuffers[i] + j * count;
-            const float* confidenceEnd = confidenceBegin + count;
-            std::vector<float> ret = std::vector<float>(confidenceBegin, confidenceEnd);
-            results[i].result.push_back(ret);
-        }
-
+        results[i].data = outputBuffers[i];
+        results[i].batchStride = outputsizes[i] / (sizeof(float) * maxBatchSize);
         results[i].batchsize = batchSize;
     }
 }
 
-TrtBlob* TrtRetinaFaceNet::blob_by_name(string layer_name)
+TrtBlob* TrtRetinaFaceNet::blob_by_name(const string &layer_name)
 {
     vector<TrtBlob>::iterator it =
             std::find_if(results.begin(), results.end(), boost::bind(&TrtBlob::layer_name, _1) == layer_name);
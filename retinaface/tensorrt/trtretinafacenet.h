@@ -16,9 +16,13 @@ struct TrtBlob
     string layer_name;
     int layer_index;
     int outputSize;
-    std::vector<std::vector<float>> result;
+    const float *data;          //指向拷回主机的输出缓冲，不拷贝，下一次doInference前有效
+    size_t batchStride;         //相邻两张图的输出间隔的float数
     DimsCHW outputDims;
     int batchsize;
+
+    //第index张图的输出，outputDims排列
+    const float *batch(int index) const { return data + index * batchStride; }
 };
 
 class TrtRetinaFaceNet : public TrtNetBase
@@ -40,7 +44,7 @@ public:
      */
     virtual void doInference(int batchSize, float *input = NULL) override;
 
-    TrtBlob *blob_by_name(string layer_name);
+    TrtBlob *blob_by_name(const string &layer_name);
 
     vector<int> getOutputWidth();
     vector<int> getOutputHeight();